@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include "admit.h"
+
+/* A window with more than 1 in SLOW_RATIO requests over the target
+   counts as congested: */
+#define SLOW_RATIO 10
+
+struct admit_t {
+  int max_limit;
+  long target_us;
+  int limit;
+  int inflight;
+  int saturated;    /* whether the cap was reached in this window */
+  int count, slow;  /* requests finished in this window, and slow ones */
+  unsigned long rejected;
+};
+
+admit_t *make_admit(int max_limit, long target_us) {
+  admit_t *a = calloc(1, sizeof(admit_t));
+
+  a->max_limit = max_limit;
+  a->target_us = target_us;
+  a->limit = max_limit;
+
+  return a;
+}
+
+int admit_enter(admit_t *a) {
+  int limit = __atomic_load_n(&a->limit, __ATOMIC_RELAXED);
+  int n = __atomic_add_fetch(&a->inflight, 1, __ATOMIC_RELAXED);
+
+  if (n >= limit)
+    __atomic_store_n(&a->saturated, 1, __ATOMIC_RELAXED);
+  if (n > limit) {
+    __atomic_sub_fetch(&a->inflight, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&a->rejected, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Adjusts the cap at the end of a window of `count` requests, of
+   which `slow` were over the target: */
+static void adjust(admit_t *a, int count, int slow) {
+  int limit = __atomic_load_n(&a->limit, __ATOMIC_RELAXED);
+  int saturated = __atomic_exchange_n(&a->saturated, 0, __ATOMIC_RELAXED);
+
+  if (slow * SLOW_RATIO > count)
+    limit -= (limit > 4) ? limit / 4 : 1;
+  else if (saturated)
+    limit++;
+
+  if (limit < 1)
+    limit = 1;
+  if (limit > a->max_limit)
+    limit = a->max_limit;
+  __atomic_store_n(&a->limit, limit, __ATOMIC_RELAXED);
+}
+
+void admit_leave(admit_t *a, long usec) {
+  int limit = __atomic_load_n(&a->limit, __ATOMIC_RELAXED);
+  int count, slow;
+
+  __atomic_sub_fetch(&a->inflight, 1, __ATOMIC_RELAXED);
+
+  if (usec > a->target_us)
+    __atomic_add_fetch(&a->slow, 1, __ATOMIC_RELAXED);
+  count = __atomic_add_fetch(&a->count, 1, __ATOMIC_RELAXED);
+
+  /* Whichever thread ends the window claims it by resetting the
+     count; a slow request from the next window may be counted in
+     this one, which only matters at the edges */
+  if ((count >= limit)
+      && __atomic_compare_exchange_n(&a->count, &count, 0, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    slow = __atomic_exchange_n(&a->slow, 0, __ATOMIC_RELAXED);
+    adjust(a, count, slow);
+  }
+}
+
+int admit_limit(admit_t *a) {
+  return __atomic_load_n(&a->limit, __ATOMIC_RELAXED);
+}
+
+int admit_inflight(admit_t *a) {
+  return __atomic_load_n(&a->inflight, __ATOMIC_RELAXED);
+}
+
+unsigned long admit_rejected(admit_t *a) {
+  return __atomic_load_n(&a->rejected, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,30 @@
+/* Admission control caps the number of requests being served at
+   once, so that under overload the excess is turned away at once
+   instead of slowing down every request. The cap adapts by AIMD on
+   observed latency: after each window of as many requests as the
+   cap, it shrinks by a quarter if more than 1 in 10 of them took
+   longer than a target latency, and otherwise grows by one if the
+   cap was reached during the window.
+
+   The functions are safe to call from multiple threads, and take no
+   locks. */
+
+/* Opaque type for an admission controller instance: */
+typedef struct admit_t admit_t;
+
+/* Creates a controller whose cap starts at, and never exceeds,
+   `max_limit`, aiming for requests to take at most `target_us`
+   microseconds: */
+admit_t *make_admit(int max_limit, long target_us);
+
+/* Returns 1 if a request may start, or 0 if it must be turned away: */
+int admit_enter(admit_t *a);
+
+/* Records that a request admitted by admit_enter() finished after
+   `usec` microseconds: */
+void admit_leave(admit_t *a, long usec);
+
+/* Current values, for reporting: */
+int admit_limit(admit_t *a);
+int admit_inflight(admit_t *a);
+unsigned long admit_rejected(admit_t *a);
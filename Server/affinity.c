@@ -0,0 +1,33 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "affinity.h"
+
+int allowed_cpus(int **cpus) {
+  cpu_set_t set;
+  int cpu, n = 0;
+
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) || !CPU_COUNT(&set)) {
+    *cpus = NULL;
+    return 0;
+  }
+
+  *cpus = malloc(CPU_COUNT(&set) * sizeof(int));
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &set))
+      (*cpus)[n++] = cpu;
+
+  return n;
+}
+
+void pin_thread(int cpu) {
+  cpu_set_t set;
+
+  if (cpu < 0)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
@@ -0,0 +1,9 @@
+/* Affinity lists the cores that the process may run on and keeps
+   threads on one of them. */
+
+/* Returns the number of cores that the process may run on, and sets
+   `*cpus` to a freshly allocated array of their numbers: */
+int allowed_cpus(int **cpus);
+
+/* Keeps the calling thread on core `cpu`, unless `cpu` is -1: */
+void pin_thread(int cpu);
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "arena.h"
+
+#define ALIGNMENT          16
+#define ALIGN(n)           (((n) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
+#define THREAD_ARENA_BLOCK 16384
+
+typedef struct block_t {
+  struct block_t *next;
+  size_t size, used;
+  char data[] __attribute__((aligned(ALIGNMENT)));
+} block_t;
+
+struct arena_t {
+  size_t block_size;
+  block_t *blocks;    /* current block first */
+  block_t *first;     /* the block that survives arena_reset() */
+};
+
+static block_t *make_block(size_t size) {
+  block_t *b;
+
+  if ((size > SIZE_MAX - sizeof(block_t))
+      || !(b = malloc(sizeof(block_t) + size)))
+    return NULL;
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+arena_t *make_arena(size_t block_size) {
+  arena_t *a = malloc(sizeof(arena_t));
+
+  a->block_size = ALIGN(block_size);
+  a->first = a->blocks = make_block(a->block_size);
+
+  return a;
+}
+
+void free_arena(arena_t *a) {
+  block_t *b, *next;
+
+  for (b = a->blocks; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+  free(a);
+}
+
+void *arena_alloc(arena_t *a, size_t n) {
+  block_t *b = a->blocks;
+  void *p;
+
+  if (n > SIZE_MAX - ALIGNMENT)
+    return NULL;
+  n = ALIGN(n ? n : 1);
+
+  if (b->size - b->used < n) {
+    if (n > a->block_size / 4) {
+      /* A large request gets its own block behind the current one,
+         so that the rest of the current block is still used: */
+      block_t *big = make_block(n);
+      if (!big)
+        return NULL;
+      big->used = n;
+      big->next = b->next;
+      b->next = big;
+      return big->data;
+    }
+    if (!(b = make_block(a->block_size)))
+      return NULL;
+    b->next = a->blocks;
+    a->blocks = b;
+  }
+
+  p = b->data + b->used;
+  b->used += n;
+
+  return p;
+}
+
+void *arena_realloc(arena_t *a, void *p, size_t old_n, size_t n) {
+  block_t *b = a->blocks;
+  void *q;
+
+  /* The most recent allocation can grow in place: */
+  if (p && ((char *)p + ALIGN(old_n) == b->data + b->used)
+      && (ALIGN(n) - ALIGN(old_n) <= b->size - b->used)) {
+    b->used += ALIGN(n) - ALIGN(old_n);
+    return p;
+  }
+
+  if (!(q = arena_alloc(a, n)))
+    return NULL;
+  if (p)
+    memcpy(q, p, (old_n < n ? old_n : n));
+
+  return q;
+}
+
+char *arena_strndup(arena_t *a, const char *s, size_t n) {
+  char *d = arena_alloc(a, n + 1);
+
+  if (!d)
+    return NULL;
+  memcpy(d, s, n);
+  d[n] = 0;
+
+  return d;
+}
+
+void arena_reset(arena_t *a) {
+  block_t *b, *next;
+
+  for (b = a->blocks; b; b = next) {
+    next = b->next;
+    if (b != a->first)
+      free(b);
+  }
+
+  a->first->next = NULL;
+  a->first->used = 0;
+  a->blocks = a->first;
+}
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_arena(void *a) {
+  free_arena(a);
+}
+
+static void make_arena_key(void) {
+  pthread_key_create(&arena_key, free_thread_arena);
+}
+
+arena_t *thread_arena(void) {
+  arena_t *a;
+
+  pthread_once(&arena_once, make_arena_key);
+  a = pthread_getspecific(arena_key);
+  if (!a) {
+    a = make_arena(THREAD_ARENA_BLOCK);
+    pthread_setspecific(arena_key, a);
+  }
+
+  return a;
+}
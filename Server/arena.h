@@ -0,0 +1,37 @@
+/* An arena hands out memory by bumping a pointer through large
+   blocks, and releases everything it handed out at once. It suits
+   data that lives exactly as long as one request: allocating is
+   cheap, nothing is freed piece by piece, and the thread's allocator
+   is not touched on the request path once the arena has warmed up.
+
+   An arena is not thread-safe; each thread uses its own. */
+
+/* Opaque type for an arena instance: */
+typedef struct arena_t arena_t;
+
+/* Creates an arena that allocates `block_size`-byte blocks: */
+arena_t *make_arena(size_t block_size);
+
+/* Destroys an arena and everything allocated from it: */
+void free_arena(arena_t *a);
+
+/* Returns `n` bytes, suitably aligned for any type, that stay valid
+   until the arena is reset or freed, or NULL if memory runs out: */
+void *arena_alloc(arena_t *a, size_t n);
+
+/* Like realloc() for memory from arena_alloc(), where `old_n` is the
+   size that `p` was allocated with; on failure, returns NULL and
+   leaves `p` alone: */
+void *arena_realloc(arena_t *a, void *p, size_t old_n, size_t n);
+
+/* Returns a NUL-terminated copy of the first `n` bytes of `s`, or
+   NULL if memory runs out: */
+char *arena_strndup(arena_t *a, const char *s, size_t n);
+
+/* Releases everything allocated from the arena, keeping one block
+   for reuse: */
+void arena_reset(arena_t *a);
+
+/* Returns the calling thread's arena for request-scoped data,
+   creating it on first use; it is freed when the thread exits. */
+arena_t *thread_arena(void);
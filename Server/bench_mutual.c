@@ -0,0 +1,152 @@
+/*
+ * bench_mutual.c - compares ways of finding the friends that two
+ *   users have in common, for friend lists of 10 to 1M entries:
+ *
+ *    dictionary   - look up each of one user's friend names in a
+ *                   dictionary of the other's (the old representation)
+ *    merge        - a plain merge of two sorted ID arrays
+ *    sorted       - intset_intersect_sorted() on the same arrays
+ *    intset       - intset_intersect() on two intset_t sets
+ *    changed      - the same, with both sets changed before each call,
+ *                   so that large sets are sorted again every time
+ *
+ * Each pair of lists has about half of its entries in common.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "dictionary.h"
+#include "intset.h"
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t merge(const unsigned int *a, size_t na,
+                    const unsigned int *b, size_t nb, unsigned int *out)
+{
+  size_t i = 0, j = 0, n = 0;
+
+  while ((i < na) && (j < nb)) {
+    if (a[i] < b[j])
+      i++;
+    else if (a[i] > b[j])
+      j++;
+    else {
+      out[n++] = a[i];
+      i++;
+      j++;
+    }
+  }
+
+  return n;
+}
+
+static size_t dictionary_common(dictionary_t *a, dictionary_t *b)
+{
+  size_t i, n = 0, count = dictionary_count(a);
+
+  for (i = 0; i < count; i++) {
+    if (dictionary_get(b, dictionary_key(a, i)))
+      n++;
+  }
+
+  return n;
+}
+
+static void report(const char *name, size_t n, double secs, int reps,
+                   size_t common)
+{
+  printf("  %-10s %10.1f ns/entry %12.3f us/call  (%lu common)\n",
+         name, secs * 1e9 / ((double)n * reps), secs * 1e6 / reps,
+         (unsigned long)common);
+}
+
+static void bench(size_t n)
+{
+  unsigned int *a = malloc(2 * n * sizeof(unsigned int));
+  unsigned int *b = malloc(2 * n * sizeof(unsigned int));
+  unsigned int *out = malloc(2 * n * sizeof(unsigned int));
+  dictionary_t *da = make_dictionary(COMPARE_CASE_SENS, NULL);
+  dictionary_t *db = make_dictionary(COMPARE_CASE_SENS, NULL);
+  intset_t sa, sb;
+  size_t na = 0, nb = 0, k, common = 0;
+  char name[32];
+  int reps, r;
+  double t;
+
+  intset_init(&sa);
+  intset_init(&sb);
+
+  /* Each ID in [0, 2n) is in each list with probability 1/2: */
+  for (k = 0; k < 2 * n; k++) {
+    snprintf(name, sizeof(name), "user%lu", (unsigned long)k);
+    if (rand() & 1) {
+      a[na++] = k;
+      intset_add(&sa, k);
+      dictionary_set(da, name, (void *)1);
+    }
+    if (rand() & 1) {
+      b[nb++] = k;
+      intset_add(&sb, k);
+      dictionary_set(db, name, (void *)1);
+    }
+  }
+
+  reps = 20000000 / n;
+  if (reps < 1)
+    reps = 1;
+
+  printf("%lu and %lu entries:\n", (unsigned long)na, (unsigned long)nb);
+
+  t = now();
+  for (r = 0; r < reps; r++)
+    common = dictionary_common(da, db);
+  report("dictionary", n, now() - t, reps, common);
+
+  t = now();
+  for (r = 0; r < reps; r++)
+    common = merge(a, na, b, nb, out);
+  report("merge", n, now() - t, reps, common);
+
+  t = now();
+  for (r = 0; r < reps; r++)
+    common = intset_intersect_sorted(a, na, b, nb, out);
+  report("sorted", n, now() - t, reps, common);
+
+  t = now();
+  for (r = 0; r < reps; r++)
+    common = intset_intersect(&sa, &sb, out);
+  report("intset", n, now() - t, reps, common);
+
+  t = now();
+  for (r = 0; r < reps; r++) {
+    intset_remove(&sa, a[0]);
+    intset_add(&sa, a[0]);
+    intset_remove(&sb, b[0]);
+    intset_add(&sb, b[0]);
+    common = intset_intersect(&sa, &sb, out);
+  }
+  report("changed", n, now() - t, reps, common);
+
+  free_dictionary(da);
+  free_dictionary(db);
+  intset_clear(&sa);
+  intset_clear(&sb);
+  free(a);
+  free(b);
+  free(out);
+}
+
+int main(int argc, char **argv)
+{
+  size_t n;
+
+  for (n = 10; n <= 1000000; n *= 10)
+    bench(n);
+
+  return 0;
+}
@@ -0,0 +1,307 @@
+/*
+ * bench_query.c - compares the throughput of query_decode(),
+ *   query_encode(), and entity_encode() from more_string.c against
+ *   the byte-at-a-time versions that they replaced (copied below),
+ *   on inputs like those that clients send:
+ *
+ *    names      - friend names with no bytes that need work
+ *    friends    - a percent-encoded friend list, as in a form body
+ *    html       - text with an occasional character to escape
+ *    binary     - random bytes, nearly all of which need work
+ *
+ * Before timing, the results of each pair are checked against each
+ * other, including query_decode_into() decoding in place.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dictionary.h"
+#include "more_string.h"
+
+/* Bytes of input per call, and bytes to process per measurement: */
+#define INPUT_LEN 4096
+#define WORK (256 << 20)
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int ishexdigit(int v) {
+  return (((v >= '0') && (v <= '9'))
+          || ((v >= 'A') && (v <= 'F'))
+          || ((v >= 'a') && (v <= 'f')));
+}
+
+static int hex_value(int v) {
+  if ((v >= '0') && (v <= '9'))
+    return v - '0';
+  else if ((v >= 'A') && (v <= 'F'))
+    return v - 'A' + 10;
+  else
+    return v - 'a' + 10;
+}
+
+static int hex_digit(int v) {
+  if (v < 10)
+    return '0' + v;
+  else
+    return 'a' + (v - 10);
+}
+
+static char *scalar_query_decode(const char *data) {
+  int i, j;
+  char *dest = NULL;
+
+  while (1) {
+    for (i = j = 0; data[i]; i++, j++) {
+      if ((data[i] == '%')
+          && (ishexdigit(data[i+1]))
+          && (ishexdigit(data[i+2]))) {
+        if (dest)
+          dest[j] = hex_value(data[i+1]) * 16 + hex_value(data[i+2]);
+        i += 2;
+      } else if (dest) {
+        if (data[i] == '+')
+          dest[j] = ' ';
+        else
+          dest[j] = data[i];
+      }
+    }
+
+    if (dest) {
+      dest[j] = 0;
+      return dest;
+    }
+
+    dest = malloc(j + 1);
+  }
+}
+
+static char *scalar_query_encode(const char *data) {
+  int i, j;
+  char *dest = NULL;
+
+  while (1) {
+    for (i = j = 0; data[i]; i++, j++) {
+      if (((data[i] >= 'a') && (data[i] <= 'z'))
+          || ((data[i] >= 'A') && (data[i] <= 'Z'))
+          || ((data[i] >= '0') && (data[i] <= '9'))) {
+        if (dest)
+          dest[j] = data[i];
+      } else {
+        if (dest) {
+          dest[j] = '%';
+          dest[j+1] = hex_digit(((unsigned char *)data)[i] >> 4);
+          dest[j+2] = hex_digit(((unsigned char *)data)[i] & 0xF);
+        }
+        j += 2;
+      }
+    }
+
+    if (dest) {
+      dest[j] = 0;
+      return dest;
+    }
+
+    dest = malloc(j + 1);
+  }
+}
+
+static char *scalar_entity_encode(const char *data) {
+  int i, j;
+  char *dest = NULL;
+
+  while (1) {
+    for (i = j = 0; data[i]; i++, j++) {
+      if ((data[i] == '<') || (data[i] == '>')) {
+        if (dest) {
+          dest[j] = '&';
+          dest[j+1] = ((data[i] == '<') ? 'l' : 'g');
+          dest[j+2] = 't';
+          dest[j+3] = ';';
+        }
+        j += 3;
+      } else if (data[i] == '&') {
+        if (dest)
+          memcpy(dest + j, "&amp;", 5);
+        j += 4;
+      } else if (data[i] == '"') {
+        if (dest)
+          memcpy(dest + j, "&quot;", 6);
+        j += 5;
+      } else {
+        if (dest)
+          dest[j] = data[i];
+      }
+    }
+
+    if (dest) {
+      dest[j] = 0;
+      return dest;
+    }
+
+    dest = malloc(j + 1);
+  }
+}
+
+typedef char *(*convert_t)(const char *);
+
+static char *make_names(void)
+{
+  char *s = malloc(INPUT_LEN + 1);
+  size_t i;
+
+  for (i = 0; i < INPUT_LEN; i++)
+    s[i] = (i % 9 == 8) ? '0' + (i % 10) : 'a' + rand() % 26;
+  s[INPUT_LEN] = 0;
+
+  return s;
+}
+
+static char *make_friends(void)
+{
+  char *s = malloc(INPUT_LEN + 16), *enc;
+  size_t len = 0;
+
+  /* Names separated by newlines, about 10% of them with a space */
+  while (len < INPUT_LEN * 2 / 3)
+    len += sprintf(s + len, "%s%d%s\n", (rand() % 10) ? "user" : "first last",
+                   rand() % 100000, (rand() % 4) ? "" : "é");
+  enc = scalar_query_encode(s);
+  enc[INPUT_LEN] = 0;
+  free(s);
+
+  return enc;
+}
+
+static char *make_html(void)
+{
+  static const char *special = "<>&\"";
+  char *s = make_names();
+  size_t i;
+
+  for (i = 0; i < INPUT_LEN; i++)
+    if (!(rand() % 40))
+      s[i] = special[rand() % 4];
+    else if (!(rand() % 8))
+      s[i] = ' ';
+
+  return s;
+}
+
+static char *make_binary(void)
+{
+  char *s = malloc(INPUT_LEN + 1);
+  size_t i;
+
+  for (i = 0; i < INPUT_LEN; i++)
+    s[i] = 1 + rand() % 255;
+  s[INPUT_LEN] = 0;
+
+  return s;
+}
+
+static void check(const char *what, convert_t scalar, convert_t fast,
+                  const char *in)
+{
+  char *a = scalar(in), *b = fast(in);
+
+  if (strcmp(a, b)) {
+    fprintf(stderr, "%s: results differ\n", what);
+    exit(1);
+  }
+  free(a);
+  free(b);
+}
+
+/* Checks every length and alignment of a prefix of `in`, so that the
+   block and tail code both see each kind of byte: */
+static void check_all(convert_t scalar, convert_t fast, const char *in,
+                      const char *what)
+{
+  char buf[80], *expect, *copy;
+  size_t start, len, n;
+
+  for (start = 0; start < 16; start++)
+    for (len = 0; len < 64; len++) {
+      memcpy(buf, in + start, len);
+      buf[len] = 0;
+      check(what, scalar, fast, buf);
+
+      if (fast == query_decode) {
+        expect = scalar_query_decode(buf);
+        copy = strdup(buf);
+        n = query_decode_into(copy, copy, len);
+        if ((n != strlen(expect)) || strcmp(copy, expect)) {
+          fprintf(stderr, "%s: in-place decoding differs\n", what);
+          exit(1);
+        }
+        free(expect);
+        free(copy);
+      }
+    }
+
+  check(what, scalar, fast, in);
+}
+
+static double rate(convert_t f, const char *in)
+{
+  int reps = WORK / INPUT_LEN, r;
+  double t = now();
+
+  for (r = 0; r < reps; r++)
+    free(f(in));
+
+  return WORK / (now() - t) / (1 << 20);
+}
+
+static double rate_into(const char *in)
+{
+  int reps = WORK / INPUT_LEN, r;
+  char *buf = malloc(INPUT_LEN + 1);
+  double t = now();
+
+  for (r = 0; r < reps; r++)
+    query_decode_into(buf, in, INPUT_LEN);
+
+  t = now() - t;
+  free(buf);
+  return WORK / t / (1 << 20);
+}
+
+int main(int argc, char **argv)
+{
+  const char *names[] = { "names", "friends", "html", "binary" };
+  char *inputs[4];
+  int i;
+
+  inputs[0] = make_names();
+  inputs[1] = make_friends();
+  inputs[2] = make_html();
+  inputs[3] = make_binary();
+
+  for (i = 0; i < 4; i++) {
+    check_all(scalar_query_decode, query_decode, inputs[i], "query_decode");
+    check_all(scalar_query_encode, query_encode, inputs[i], "query_encode");
+    check_all(scalar_entity_encode, entity_encode, inputs[i], "entity_encode");
+  }
+
+  printf("MB/s for %d-byte inputs:      scalar     vector\n", INPUT_LEN);
+  for (i = 0; i < 4; i++) {
+    printf("%s:\n", names[i]);
+    printf("  query_decode            %10.0f %10.0f\n",
+           rate(scalar_query_decode, inputs[i]), rate(query_decode, inputs[i]));
+    printf("  query_decode_into                  %10.0f\n",
+           rate_into(inputs[i]));
+    printf("  query_encode            %10.0f %10.0f\n",
+           rate(scalar_query_encode, inputs[i]), rate(query_encode, inputs[i]));
+    printf("  entity_encode           %10.0f %10.0f\n",
+           rate(scalar_entity_encode, inputs[i]), rate(entity_encode, inputs[i]));
+  }
+
+  return 0;
+}
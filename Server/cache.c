@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "dictionary.h"
+#include "cache.h"
+
+/* Keys are split over shards by hash, each with its own lock and an
+   equal share of the size limit: */
+#define CACHE_SHARDS 16
+
+struct cached_t {
+  int refs;                 /* updated atomically */
+  unsigned long version;
+  int recent;               /* used since the clock hand last passed */
+  size_t len;
+  char data[];
+};
+
+typedef struct {
+  pthread_mutex_t lock;
+  dictionary_t *entries;    /* key -> cached_t */
+  size_t bytes;
+  size_t hand;              /* CLOCK position in `entries` */
+} cache_shard_t;
+
+struct cache_t {
+  size_t shard_bytes;
+  cache_shard_t shards[CACHE_SHARDS];
+};
+
+static void release_value(void *e) {
+  cached_release(e);
+}
+
+cache_t *make_cache(size_t max_bytes) {
+  cache_t *c = malloc(sizeof(cache_t));
+  int i;
+
+  c->shard_bytes = max_bytes / CACHE_SHARDS;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    pthread_mutex_init(&c->shards[i].lock, NULL);
+    c->shards[i].entries = make_dictionary(COMPARE_CASE_SENS, release_value);
+    c->shards[i].bytes = 0;
+    c->shards[i].hand = 0;
+  }
+
+  return c;
+}
+
+static cache_shard_t *key_shard(cache_t *c, const char *key) {
+  const unsigned char *s = (const unsigned char *)key;
+  unsigned int h = 2166136261u;
+
+  for (; *s; s++)
+    h = (h ^ *s) * 16777619u;
+
+  return &c->shards[(h >> 16) % CACHE_SHARDS];
+}
+
+/* The space that an entry takes up in its shard: */
+static size_t entry_bytes(const char *key, cached_t *e) {
+  return sizeof(cached_t) + e->len + strlen(key) + 1;
+}
+
+static void remove_entry(cache_shard_t *shard, const char *key) {
+  cached_t *e = dictionary_get(shard->entries, key);
+
+  if (e) {
+    shard->bytes -= entry_bytes(key, e);
+    dictionary_remove(shard->entries, key);
+  }
+}
+
+cached_t *cache_get(cache_t *c, const char *key, unsigned long version) {
+  cache_shard_t *shard = key_shard(c, key);
+  cached_t *e;
+
+  pthread_mutex_lock(&shard->lock);
+  e = dictionary_get(shard->entries, key);
+  if (e && (e->version != version)) {
+    remove_entry(shard, key);
+    e = NULL;
+  }
+  if (e) {
+    e->recent = 1;
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return e;
+}
+
+cached_t *make_cached(size_t len) {
+  cached_t *e = malloc(sizeof(cached_t) + len);
+
+  e->refs = 1;
+  e->version = 0;
+  e->recent = 1;
+  e->len = len;
+
+  return e;
+}
+
+char *cached_data(cached_t *e) {
+  return e->data;
+}
+
+size_t cached_length(cached_t *e) {
+  return e->len;
+}
+
+void cache_put(cache_t *c, const char *key, unsigned long version,
+               cached_t *e) {
+  cache_shard_t *shard = key_shard(c, key);
+  size_t bytes = entry_bytes(key, e), count;
+
+  if (bytes > c->shard_bytes)
+    return;
+
+  e->version = version;
+  __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&shard->lock);
+
+  remove_entry(shard, key);
+  dictionary_set(shard->entries, key, e);
+  shard->bytes += bytes;
+
+  /* Sweep the clock hand, giving recently used entries a second
+     chance, until there's room (which the new entry, being recent,
+     survives for at least one turn): */
+  while (shard->bytes > c->shard_bytes) {
+    cached_t *victim;
+
+    count = dictionary_count(shard->entries);
+    if (shard->hand >= count)
+      shard->hand = 0;
+    victim = dictionary_value(shard->entries, shard->hand);
+    if (victim->recent) {
+      victim->recent = 0;
+      shard->hand++;
+    } else {
+      /* Removal moves the last entry into this position */
+      remove_entry(shard, dictionary_key(shard->entries, shard->hand));
+    }
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void cached_release(cached_t *e) {
+  if (!__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL))
+    free(e);
+}
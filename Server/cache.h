@@ -0,0 +1,39 @@
+/* A cache maps keys to immutable byte strings, such as fully
+   serialized responses, each tagged with the version of the data it
+   was built from. A lookup with a newer version finds nothing and
+   drops the stale entry, so changing the data never has to reach
+   into the cache.
+
+   Entries are reference-counted, so a thread can keep sending an
+   entry after another thread replaces or evicts it. When the cache
+   is over its size limit, it evicts entries that have not been used
+   recently (using the CLOCK algorithm).
+
+   The cache is safe to use from multiple threads. */
+
+/* Opaque types for a cache and for an entry: */
+typedef struct cache_t cache_t;
+typedef struct cached_t cached_t;
+
+/* Creates an empty cache that holds up to about `max_bytes`: */
+cache_t *make_cache(size_t max_bytes);
+
+/* Returns the entry for `key` if it was built from `version`, or
+   NULL. The caller must release a returned entry. */
+cached_t *cache_get(cache_t *c, const char *key, unsigned long version);
+
+/* Creates an entry to hold `len` bytes, for the caller to fill in
+   before passing it to cache_put(); the caller must release it: */
+cached_t *make_cached(size_t len);
+
+/* Returns the bytes of an entry, and their number: */
+char *cached_data(cached_t *e);
+size_t cached_length(cached_t *e);
+
+/* Stores `e` as the entry for `key` built from `version`, unless it
+   is too big for the cache: */
+void cache_put(cache_t *c, const char *key, unsigned long version,
+               cached_t *e);
+
+/* Drops the caller's reference to an entry: */
+void cached_release(cached_t *e);
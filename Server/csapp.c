@@ -811,6 +811,19 @@ void V(sem_t *sem)
 	unix_error("V error");
 }
 
+int TryP(sem_t *sem)
+{
+    while (sem_trywait(sem) < 0) {
+	if (errno == EAGAIN)
+	    return 0;
+	if (errno != EINTR) {
+	    unix_error("TryP error");
+	    return 0;
+	}
+    }
+    return 1;
+}
+
 #else
 
 void Sem_init(sem_t *sem, int pshared, unsigned int v)
@@ -854,6 +867,21 @@ void P(sem_t *sem)
     posix_error(rc, "P error");
 }
 
+int TryP(sem_t *sem)
+{
+  int rc, ok = 0;
+
+  if ((rc = pthread_mutex_lock(&sem->m)))
+    posix_error(rc, "TryP error");
+  if (sem->ready) {
+    --sem->ready;
+    ok = 1;
+  }
+  if ((rc = pthread_mutex_unlock(&sem->m)))
+    posix_error(rc, "TryP error");
+  return ok;
+}
+
 void V(sem_t *sem)
 {
   int rc;
@@ -913,6 +941,13 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* Interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
+	    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+		/* Non-blocking descriptor: wait until it drains */
+		struct pollfd pfd = { fd, POLLOUT, 0 };
+		if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR))
+		    return -1;
+		nwritten = 0;
+	    }
 	    else
 		return -1;       /* errno set by write() */
 	}
@@ -938,8 +973,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_size);
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* Interrupted by sig handler return */
 		return -1;
@@ -969,10 +1003,95 @@ void rio_readinitb(rio_t *rp, int fd)
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
+    rp->rio_buf = rp->rio_small;
+    rp->rio_size = sizeof(rp->rio_small);
     rp->rio_bufptr = rp->rio_buf;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_freeb - Release a read buffer that has grown
+ */
+void rio_freeb(rio_t *rp)
+{
+    if (rp->rio_buf != rp->rio_small)
+	free(rp->rio_buf);
+    rp->rio_buf = rp->rio_small;
+    rp->rio_size = sizeof(rp->rio_small);
+    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_cnt = 0;
+}
+
+/*
+ * rio_fillb - Read more bytes after the unread ones, making room by
+ *    moving them to the start of the buffer or by growing it
+ */
+ssize_t rio_fillb(rio_t *rp, size_t max)
+{
+    ssize_t rc;
+    size_t size;
+    char *buf;
+
+    if (rp->rio_bufptr != rp->rio_buf) {
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+    }
+
+    if (rp->rio_cnt == rp->rio_size) {
+	if (rp->rio_size >= max) {
+	    errno = ENOBUFS;
+	    return -1;
+	}
+	size = 2 * rp->rio_size;
+	if (size > max)
+	    size = max;
+	if (rp->rio_buf == rp->rio_small) {
+	    if ((buf = malloc(size)))
+		memcpy(buf, rp->rio_small, rp->rio_cnt);
+	} else
+	    buf = realloc(rp->rio_buf, size);
+	if (!buf)
+	    return -1;
+	rp->rio_buf = rp->rio_bufptr = buf;
+	rp->rio_size = size;
+    }
+
+    do {
+	rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		  rp->rio_size - rp->rio_cnt);
+    } while ((rc < 0) && (errno == EINTR));
+
+    if (rc > 0)
+	rp->rio_cnt += rc;
+    return rc;
+}
+
+/*
+ * rio_consumeb - Skip unread bytes, typically after using them in place
+ */
+void rio_consumeb(rio_t *rp, size_t n)
+{
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+
+/*
+ * rio_sliceb - Take up to n unread bytes in place (buffered)
+ */
+ssize_t rio_sliceb(rio_t *rp, size_t n, char **slice)
+{
+    ssize_t rc;
+
+    if ((rp->rio_cnt <= 0) && ((rc = rio_fillb(rp, rp->rio_size)) <= 0))
+	return rc;
+
+    if (n > rp->rio_cnt)
+	n = rp->rio_cnt;
+    *slice = rp->rio_bufptr;
+    rio_consumeb(rp, n);
+    return n;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -1001,28 +1120,33 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1) {
-		return 0; /* EOF, no data read */
-            }
-	    else {
-		break;    /* EOF, some data was read */
-            }
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl;
+
+    /* Copy each buffered run up to and including a newline at once */
+    while (n + 1 < maxlen) {
+	if (rp->rio_cnt <= 0) {
+	    if ((rc = rio_fillb(rp, rp->rio_size)) < 0)
+		return -1;	  /* Error */
+	    else if (rc == 0)
+		break;    /* EOF */
+	}
+
+	cnt = maxlen - 1 - n;
+	if (cnt > rp->rio_cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)))
+	    cnt = nl + 1 - rp->rio_bufptr;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rio_consumeb(rp, cnt);
+	n += cnt;
+	if (nl)
+	    break;
     }
-    *bufp = '\0';
-    return n-1;
+    if (maxlen > 0)
+	bufp[n] = '\0';
+    return n;
 }
 /* $end rio_readlineb */
 
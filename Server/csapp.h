@@ -20,6 +20,7 @@
 #include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -43,7 +44,9 @@ typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_buf;             /* Internal buffer, rio_small until grown */
+    size_t rio_size;           /* Size of rio_buf */
+    char rio_small[RIO_BUFSIZE];
 } rio_t;
 /* $end rio_t */
 
@@ -191,6 +194,7 @@ void Sem_init(sem_t *sem, int pshared, unsigned int value);
 void Sem_destroy(sem_t *sem);
 void P(sem_t *sem);
 void V(sem_t *sem);
+int TryP(sem_t *sem); /* Like P, but returns 0 instead of blocking */
 #endif
 
 /* Rio (Robust I/O) package */
@@ -199,6 +203,18 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_freeb(rio_t *rp);
+
+/* Rio buffer access without copying. rio_fillb() reads more bytes
+   after the rio_cnt unread ones at rio_bufptr, moving them to the
+   start of the buffer or growing the buffer (to at most `max` bytes)
+   to make room; it returns the number of bytes added, 0 at EOF, or -1
+   on an error or if the buffer is full at `max` bytes. rio_sliceb()
+   returns up to `n` unread bytes in place, reading first if none are
+   buffered. Bytes stay valid until the next read from `rp`. */
+ssize_t rio_fillb(rio_t *rp, size_t max);
+void rio_consumeb(rio_t *rp, size_t n);
+ssize_t rio_sliceb(rio_t *rp, size_t n, char **slice);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -3,8 +3,20 @@
 #include <strings.h>
 #include <ctype.h>
 #include "dictionary.h"
+#include "arena.h"
+
+/* Keys and values are kept in dense, parallel arrays so that
+   dictionary_key() and dictionary_value() can iterate by index. A
+   separate open-addressing table (linear probing) maps a key's hash
+   to its position in the dense arrays. */
+
+#define SLOT_EMPTY   -1
+#define SLOT_DELETED -2
 
 static int same_key(const char *key1, const char *key2, int compare_mode);
+static unsigned int hash_key(const char *key, int compare_mode);
+static long find_slot(dictionary_t *d, const char *key, unsigned int h);
+static int rebuild_slots(dictionary_t *d, size_t nslots);
 
 struct dictionary_t {
   int compare_mode;
@@ -12,74 +24,167 @@ struct dictionary_t {
   size_t count, alloc;
   const char **keys;
   void **values;
+  unsigned int *hashes;   /* hashes[i] is the hash of keys[i] */
+  long *slots;            /* index into keys/values, or SLOT_... */
+  size_t nslots, used;    /* table size; non-empty slots (incl. deleted) */
+  arena_t *arena;         /* where to allocate, or NULL for malloc */
 };
 
 static void no_free(void *p) { }
 
+/* Allocation that goes to the dictionary's arena, if any: */
+
+static void *d_realloc(dictionary_t *d, void *p, size_t old_n, size_t n) {
+  if (d->arena)
+    return arena_realloc(d->arena, p, old_n, n);
+  return realloc(p, n);
+}
+
+static void d_free(dictionary_t *d, void *p) {
+  if (!d->arena)
+    free(p);
+}
+
+static char *d_strdup(dictionary_t *d, const char *s) {
+  if (d->arena)
+    return arena_strndup(d->arena, s, strlen(s));
+  return strdup(s);
+}
+
 dictionary_t *make_dictionary(int compare_mode, free_proc_t free_value) {
   dictionary_t *d = calloc(1, sizeof(dictionary_t));
 
   d->compare_mode = compare_mode;
   d->free_value = (free_value ? free_value : no_free);
-  
+
+  return d;
+}
+
+dictionary_t *make_arena_dictionary(struct arena_t *a, int compare_mode,
+                                    free_proc_t free_value) {
+  dictionary_t *d = arena_alloc(a, sizeof(dictionary_t));
+
+  if (!d)
+    return NULL;
+  memset(d, 0, sizeof(dictionary_t));
+  d->compare_mode = compare_mode;
+  d->free_value = (free_value ? free_value : no_free);
+  d->arena = a;
+
   return d;
 }
 
 void free_dictionary(dictionary_t *d) {
   int i;
-  
+
   for (i = 0; i < d->count; i++) {
-    free((void *)d->keys[i]);
+    d_free(d, (void *)d->keys[i]);
     d->free_value(d->values[i]);
   }
+
+  d_free(d, d->keys);
+  d_free(d, d->values);
+  d_free(d, d->hashes);
+  d_free(d, d->slots);
+  d_free(d, d);
 }
 
-void dictionary_set(dictionary_t *d, const char *key, void *value) {
-  int i;
+int dictionary_set(dictionary_t *d, const char *key, void *value) {
+  unsigned int h = hash_key(key, d->compare_mode);
+  long s = find_slot(d, key, h);
+  char *copy;
+  void *p;
 
-  for (i = 0; i < d->count; i++) {
-    if (same_key(key, d->keys[i], d->compare_mode)) {
-      d->free_value(d->values[i]);
-      d->values[i] = value;
-      return;
-    }
+  if ((s >= 0) && (d->slots[s] >= 0)) {
+    long i = d->slots[s];
+    d->free_value(d->values[i]);
+    d->values[i] = value;
+    return 1;
   }
 
+  /* Each array is replaced only once its bigger copy exists, so a
+     failure leaves the dictionary as it was: */
   if (d->count == d->alloc) {
-    d->alloc = 2 * (d->alloc + 1);
-    d->keys = realloc(d->keys, d->alloc*sizeof(const char*));
-    d->values = realloc(d->values, d->alloc*sizeof(void*));
+    size_t old = d->alloc, alloc = 2 * (d->alloc + 1);
+    if (!(p = d_realloc(d, d->keys, old*sizeof(const char*),
+                        alloc*sizeof(const char*))))
+      return 0;
+    d->keys = p;
+    if (!(p = d_realloc(d, d->values, old*sizeof(void*),
+                        alloc*sizeof(void*))))
+      return 0;
+    d->values = p;
+    if (!(p = d_realloc(d, d->hashes, old*sizeof(unsigned int),
+                        alloc*sizeof(unsigned int))))
+      return 0;
+    d->hashes = p;
+    d->alloc = alloc;
+  }
+
+  if (!(copy = d_strdup(d, key)))
+    return 0;
+
+  /* Keep the table at most 3/4 full, counting deleted slots: */
+  if ((d->used + 1) * 4 > d->nslots * 3) {
+    size_t nslots = (d->nslots ? d->nslots : 8);
+    while ((d->count + 1) * 2 > nslots)
+      nslots *= 2;
+    if (!rebuild_slots(d, nslots)) {
+      d_free(d, copy);
+      return 0;
+    }
+    s = find_slot(d, key, h);
   }
 
-  d->keys[d->count] = strdup(key);
+  if (d->slots[s] == SLOT_EMPTY)
+    d->used++;
+  d->slots[s] = d->count;
+
+  d->keys[d->count] = copy;
   d->values[d->count] = value;
+  d->hashes[d->count] = h;
   d->count++;
+  return 1;
 }
 
 void dictionary_remove(dictionary_t *d, const char *key) {
-  int i, j;
+  unsigned int h;
+  long s, i, last;
 
-  for (i = 0; i < d->count; i++) {
-    if (same_key(key, d->keys[i], d->compare_mode)) {
-      free((void *)d->keys[i]);
-      d->free_value(d->values[i]);
-      for (j = i + 1; j < d->count; j++) {
-        d->keys[j-1] = d->keys[j];
-        d->values[j-1] = d->values[j];
-      }
-      --d->count;
-      return;
-    }
+  if (!d->count)
+    return;
+
+  h = hash_key(key, d->compare_mode);
+  s = find_slot(d, key, h);
+  if ((s < 0) || (d->slots[s] < 0))
+    return;
+
+  i = d->slots[s];
+  d_free(d, (void *)d->keys[i]);
+  d->free_value(d->values[i]);
+  d->slots[s] = SLOT_DELETED;
+
+  /* Move the last entry into the hole to keep the arrays dense: */
+  last = d->count - 1;
+  if (i != last) {
+    s = find_slot(d, d->keys[last], d->hashes[last]);
+    d->slots[s] = i;
+    d->keys[i] = d->keys[last];
+    d->values[i] = d->values[last];
+    d->hashes[i] = d->hashes[last];
   }
+  --d->count;
 }
 
 void *dictionary_get(dictionary_t *d, const char *key) {
-  int i;
+  long s;
 
-  for (i = 0; i < d->count; i++) {
-    if (same_key(key, d->keys[i], d->compare_mode))
-      return d->values[i];
-  }
+  if (!d->count)
+    return NULL;
+
+  s = find_slot(d, key, hash_key(key, d->compare_mode));
+  if ((s >= 0) && (d->slots[s] >= 0))
+    return d->values[d->slots[s]];
 
   return NULL;
 }
@@ -112,3 +217,66 @@ static int same_key(const char *key1, const char *key2, int compare_mode) {
   else
     return !strcmp(key1, key2);
 }
+
+/* FNV-1a, folding ASCII case first when keys compare insensitively: */
+static unsigned int hash_key(const char *key, int compare_mode) {
+  const unsigned char *s = (const unsigned char *)key;
+  unsigned int h = 2166136261u;
+
+  if (compare_mode == COMPARE_CASE_INSENS) {
+    for (; *s; s++)
+      h = (h ^ tolower(*s)) * 16777619u;
+  } else {
+    for (; *s; s++)
+      h = (h ^ *s) * 16777619u;
+  }
+
+  return h;
+}
+
+/* Returns the slot that holds `key`, or else the slot where `key`
+   should be inserted (preferring the first deleted slot on the probe
+   path), or -1 if the table has no slots at all: */
+static long find_slot(dictionary_t *d, const char *key, unsigned int h) {
+  size_t mask, s;
+  long reuse = -1;
+
+  if (!d->nslots)
+    return -1;
+
+  mask = d->nslots - 1;
+  for (s = h & mask; ; s = (s + 1) & mask) {
+    long i = d->slots[s];
+    if (i == SLOT_EMPTY)
+      return (reuse >= 0) ? reuse : (long)s;
+    if (i == SLOT_DELETED) {
+      if (reuse < 0)
+        reuse = s;
+    } else if ((d->hashes[i] == h)
+               && same_key(key, d->keys[i], d->compare_mode))
+      return s;
+  }
+}
+
+/* Returns 0, keeping the old table, if there is no memory for the new
+   one: */
+static int rebuild_slots(dictionary_t *d, size_t nslots) {
+  size_t i, s, mask = nslots - 1;
+  long *slots = d_realloc(d, NULL, 0, nslots * sizeof(long));
+
+  if (!slots)
+    return 0;
+  d_free(d, d->slots);
+  d->slots = slots;
+  for (s = 0; s < nslots; s++)
+    d->slots[s] = SLOT_EMPTY;
+  d->nslots = nslots;
+
+  for (i = 0; i < d->count; i++) {
+    for (s = d->hashes[i] & mask; d->slots[s] != SLOT_EMPTY; s = (s + 1) & mask)
+      ;
+    d->slots[s] = i;
+  }
+  d->used = d->count;
+  return 1;
+}
@@ -1,6 +1,7 @@
 
 /* A dictionary maps a string to a pointer. The pointer can be
-   anything, such as another string. */
+   anything, such as another string. Lookup, insertion, and removal
+   take constant time on average. */
 
 /* Opaque type for a dictionary instance: */
 typedef struct dictionary_t dictionary_t;
@@ -20,6 +21,15 @@ typedef void (*free_proc_t)(void*);
    can be NULL: */
 dictionary_t *make_dictionary(int compare_mode, free_proc_t free_value);
 
+/* Like make_dictionary(), but the dictionary, its copies of keys, and
+   its internal arrays are all allocated from the arena `a`, so the
+   dictionary needs no freeing if it dies with the arena (though
+   free_dictionary() still destroys its values); returns NULL if the
+   arena runs out of memory: */
+struct arena_t;
+dictionary_t *make_arena_dictionary(struct arena_t *a, int compare_mode,
+                                    free_proc_t free_value);
+
 /* Destroys a dictionary, which frees all key strings --- and also
    destroys all values using the function provided to
    make_dictionary() if that function is not NULL: */
@@ -29,10 +39,14 @@ void free_dictionary(dictionary_t *d);
    value (if any) that `key` is currently mapped to. The dictionary
    makes its own copy of `key` and does not refer to that pointer on
    return. It keeps the `value` pointer as-is and effectively takes
-   ownership of the value. */
-void dictionary_set(dictionary_t *d, const char *key, void *value);
+   ownership of the value. Returns 1, or 0 if memory runs out, in
+   which case the dictionary is unchanged and `value` still belongs
+   to the caller. */
+int dictionary_set(dictionary_t *d, const char *key, void *value);
 
-/* Removes the dictionary's mapping, if any, for `key`. */
+/* Removes the dictionary's mapping, if any, for `key`. To keep
+   indices dense, the last key/value moves into the removed one's
+   position, so removal changes the order seen by dictionary_key(). */
 void dictionary_remove(dictionary_t *d, const char *key);
 
 /* Returns the dictionary's value for `key`, or NULL if the dictionary
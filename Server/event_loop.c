@@ -0,0 +1,664 @@
+#include "csapp.h"
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "http_parser.h"
+#include "arena.h"
+#include "event_loop.h"
+#include "response.h"
+#include "stats.h"
+#include "log.h"
+#include "wheel.h"
+
+#define MAX_EVENTS  64
+#define INITIAL_BUF 4096
+#define STREAM_BUF  65536   /* room for a streamed body's next piece */
+
+/* Most response bytes that wait for a slow client, per connection; a
+   response that needs more fails, and the connection is closed. An
+   output buffer bigger than OUTPUT_KEEP is freed once it drains. */
+#define OUTPUT_MAX  (16 << 20)
+#define OUTPUT_KEEP 65536
+
+/* Deadlines are kept to within a tick: */
+#define TICK_MS     100
+#define WHEEL_SLOTS 512
+
+/* Results of conn_read(): */
+enum { READ_CLOSED, READ_AGAIN, READ_FULL };
+
+/* A connection moves from reading the head of a request to reading
+   its body, and then back to reading a head if the connection stays
+   open: */
+enum { CONN_HEAD, CONN_BODY };
+
+/* What a connection's deadline is for; see conn_schedule(): */
+enum { WAIT_NONE, WAIT_IDLE, WAIT_HEAD, WAIT_BODY, WAIT_WRITE };
+
+typedef struct waker_t waker_t;
+
+typedef struct conn_t {
+  wheel_timer_t timer;
+  int wait;
+  int fd;
+  int state;
+  char *buf;
+  size_t len, alloc;
+  http_request_t req;   /* parser state for the current request */
+  size_t body_len;      /* Content-Length of the body */
+  void *stream;         /* where the body goes, if it is streamed */
+  size_t body_seen;     /* bytes of a streamed body passed along */
+  int nrequest;         /* number of requests dispatched so far */
+  int entered;          /* the gate let the current request in... */
+  long entered_us;      /* ...at this time */
+  char *out;            /* response bytes the socket couldn't take yet */
+  size_t out_len, out_sent, out_alloc;
+  int eof;              /* the client has stopped sending */
+  int closing;          /* close once the output is sent */
+  int failed;           /* output was lost; close right away */
+  int held;             /* see el_hold() */
+  waker_t *home;        /* the loop thread that the connection is on */
+  struct conn_t *next_resumed;
+  int (*resume)(int fd, void *data);
+  void *resume_data;
+} conn_t;
+
+/* Wakes a loop thread to continue the connections that el_resume()
+   hands it from other threads: */
+struct waker_t {
+  int fd;               /* an eventfd in the thread's epoll set */
+  pthread_mutex_t lock;
+  conn_t *resumed, **last_resumed;
+};
+
+typedef struct {
+  int listenfd;
+  request_proc_t proc;
+  const body_stream_t *streams;
+  const request_gate_t *gate;
+  deadlines_t deadlines;
+} loop_t;
+
+/* Each loop thread's deadlines, its waker, and the connection whose
+   request it is serving: */
+static __thread wheel_t *wheel;
+static __thread waker_t *waker;
+static __thread conn_t *serving;
+
+static void *loop_thread(void *vl);
+static void accept_all(int epfd, loop_t *l);
+static void resume_all(loop_t *l);
+static int conn_read(conn_t *c);
+static int conn_advance(conn_t *c, loop_t *l);
+static int conn_dispatch(conn_t *c, loop_t *l);
+static int conn_enter(conn_t *c, loop_t *l);
+static void conn_leave(conn_t *c, loop_t *l);
+static void conn_reset(conn_t *c, loop_t *l);
+static void conn_schedule(conn_t *c, loop_t *l);
+static void conn_event(conn_t *c, loop_t *l);
+static int conn_flush(conn_t *c);
+static int out_pending(int fd);
+static int out_queue(int fd, const char *data, size_t len);
+static int conn_grow(conn_t *c, size_t alloc);
+static void free_conn(conn_t *c, loop_t *l);
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static long now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void run_event_loop(int listenfd, int nthreads, request_proc_t proc,
+                    const body_stream_t *streams,
+                    const request_gate_t *gate,
+                    const deadlines_t *deadlines) {
+  loop_t *l = malloc(sizeof(loop_t));
+  int i;
+
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+
+  l->listenfd = listenfd;
+  l->proc = proc;
+  l->streams = streams;
+  l->gate = gate;
+  l->deadlines = *deadlines;
+  set_nonblocking(listenfd);
+
+  for (i = 1; i < nthreads; i++) {
+    pthread_t th;
+    Pthread_create(&th, NULL, loop_thread, l);
+    Pthread_detach(th);
+  }
+
+  loop_thread(l);
+}
+
+static void *loop_thread(void *vl) {
+  loop_t *l = vl;
+  struct epoll_event ev, events[MAX_EVENTS];
+  wheel_timer_t *t;
+  int epfd, n, i;
+
+  if ((epfd = epoll_create1(0)) < 0)
+    unix_error("epoll_create1 error");
+
+  /* Every loop watches the listening socket; EPOLLEXCLUSIVE wakes
+     only one of them per incoming connection: */
+  ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, l->listenfd, &ev) < 0)
+    unix_error("epoll_ctl error");
+
+  waker = malloc(sizeof(waker_t));
+  if ((waker->fd = eventfd(0, EFD_NONBLOCK)) < 0)
+    unix_error("eventfd error");
+  pthread_mutex_init(&waker->lock, NULL);
+  waker->resumed = NULL;
+  waker->last_resumed = &waker->resumed;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = waker;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, waker->fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+
+  static const response_queue_t out = { out_pending, out_queue };
+
+  wheel = make_wheel(TICK_MS, WHEEL_SLOTS, now_ms());
+  response_set_queue(&out);
+
+  while (1) {
+    n = epoll_wait(epfd, events, MAX_EVENTS, wheel_wait_ms(wheel, now_ms()));
+    if (n < 0) {
+      if (errno != EINTR)
+        unix_error("epoll_wait error");
+      continue;
+    }
+
+    for (i = 0; i < n; i++) {
+      conn_t *c = events[i].data.ptr;
+      if (!c)
+        accept_all(epfd, l);
+      else if ((void *)c == waker)
+        resume_all(l);
+      else
+        conn_event(c, l);
+    }
+
+    /* Close connections whose time is up, without a word: a client
+       that is too slow to send its request or read its reply is
+       unlikely to read any more */
+    while ((t = wheel_expired(wheel, now_ms()))) {
+      conn_t *c = (conn_t *)((char *)t - offsetof(conn_t, timer));
+      log_msg(LOG_DEBUG, "Closing connection %d: timed out\n", c->fd);
+      free_conn(c, l);
+    }
+  }
+
+  return NULL;
+}
+
+/* Accepts until the (edge-triggered) listening socket is drained: */
+static void accept_all(int epfd, loop_t *l) {
+  struct sockaddr_storage clientaddr;
+  socklen_t clientlen;
+  char hostname[MAXLINE], port[MAXLINE];
+  struct epoll_event ev;
+  conn_t *c;
+  int connfd;
+
+  while (1) {
+    clientlen = sizeof(clientaddr);
+    connfd = accept(l->listenfd, (SA *)&clientaddr, &clientlen);
+    if (connfd < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        unix_error("Accept error");
+      if (errno != EINTR)
+        return;
+      continue;
+    }
+    set_nonblocking(connfd);
+    stats_conn_opened();
+
+    /* Numeric lookup only, so that the loop never blocks on DNS: */
+    if (log_enabled(LOG_DEBUG)
+        && !getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE,
+                        port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV))
+      log_msg(LOG_DEBUG, "Accepted connection from (%s, %s)\n",
+              hostname, port);
+
+    c = calloc(1, sizeof(conn_t));
+    c->fd = connfd;
+    c->state = CONN_HEAD;
+    c->home = waker;
+    wheel_timer_init(&c->timer);
+    http_request_init(&c->req);
+    c->alloc = INITIAL_BUF;
+    c->buf = malloc(c->alloc);
+
+    /* Edge-triggered EPOLLOUT only fires once a full socket has
+       room again, so it costs nothing until output is queued */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+      unix_error("epoll_ctl error");
+      free_conn(c, l);
+    } else
+      conn_schedule(c, l);
+  }
+}
+
+void *el_hold(void) {
+  conn_t *c = serving;
+
+  /* Only a complete request can wait, or one that waited already;
+     see conn_dispatch() and resume_all() */
+  if (!c || c->held || ((c->state != CONN_BODY) && !c->resume))
+    return NULL;
+
+  c->held = 1;
+  wheel_cancel(wheel, &c->timer);
+  c->wait = WAIT_NONE;
+  return c;
+}
+
+void el_resume(void *hold, int (*proc)(int fd, void *data), void *data) {
+  conn_t *c = hold;
+  waker_t *w = c->home;
+  uint64_t one = 1;
+
+  c->resume = proc;
+  c->resume_data = data;
+  c->next_resumed = NULL;
+
+  pthread_mutex_lock(&w->lock);
+  *w->last_resumed = c;
+  w->last_resumed = &c->next_resumed;
+  pthread_mutex_unlock(&w->lock);
+
+  if (write(w->fd, &one, sizeof(one)) < 0)
+    log_msg(LOG_DEBUG, "eventfd write error: %s\n", strerror(errno));
+}
+
+/* Finishes the requests of held connections that el_resume() has
+   handed to this thread, then carries on with each connection: */
+static void resume_all(loop_t *l) {
+  conn_t *c, *next;
+  uint64_t n;
+  int keep;
+
+  if (read(waker->fd, &n, sizeof(n)) < 0)
+    n = 0;
+
+  pthread_mutex_lock(&waker->lock);
+  c = waker->resumed;
+  waker->resumed = NULL;
+  waker->last_resumed = &waker->resumed;
+  pthread_mutex_unlock(&waker->lock);
+
+  for (; c; c = next) {
+    next = c->next_resumed;
+    c->held = 0;
+
+    serving = c;
+    keep = c->resume(c->fd, c->resume_data);
+    serving = NULL;
+    arena_reset(thread_arena());
+
+    if (c->held)
+      continue;
+    c->resume = NULL;
+    if (!keep)
+      c->closing = 1;
+    conn_leave(c, l);
+    conn_event(c, l);
+  }
+}
+
+/* Handles readiness on a connection. Requests are served as long as
+   no output is waiting, even after the client has shut down its side
+   of the connection; a streamed body is passed along whenever the
+   buffer fills. While output is waiting, nothing more is read, so a
+   client that doesn't read its responses can't pile up more. A held
+   connection is left alone until resume_all() gets to it. */
+static void conn_event(conn_t *c, loop_t *l) {
+  int r;
+
+  if (c->held)
+    return;
+
+  if (c->out_len && !conn_flush(c))
+    c->failed = 1;
+
+  while (!c->out_len && !c->closing && !c->failed) {
+    r = c->eof ? READ_CLOSED : conn_read(c);
+    if (r == READ_CLOSED)
+      c->eof = 1;
+    if (!conn_advance(c, l))
+      c->closing = 1;
+    else if (c->out_len || c->held)
+      break;
+    else if (r == READ_CLOSED)
+      c->closing = 1;
+    else if (r != READ_FULL)
+      break;
+  }
+
+  if (c->held)
+    return;
+  if (c->failed || (c->closing && !c->out_len))
+    free_conn(c, l);
+  else
+    conn_schedule(c, l);
+}
+
+/* Sends queued output until it is all gone or the socket is full,
+   returning 0 on an error: */
+static int conn_flush(conn_t *c) {
+  ssize_t n;
+
+  while (c->out_sent < c->out_len) {
+    n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent,
+             MSG_NOSIGNAL);
+    if (n > 0) {
+      c->out_sent += n;
+      stats_bytes_out(n);
+    } else if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      return 1;
+    else if ((n == 0) || (errno != EINTR))
+      return 0;
+  }
+
+  c->out_len = c->out_sent = 0;
+  if (c->out_alloc > OUTPUT_KEEP) {
+    free(c->out);
+    c->out = NULL;
+    c->out_alloc = 0;
+  }
+  return 1;
+}
+
+/* The response_queue_t for the connection being served: */
+static int out_pending(int fd) {
+  return serving && (serving->fd == fd)
+         && (serving->out_len || serving->failed);
+}
+
+static int out_queue(int fd, const char *data, size_t len) {
+  conn_t *c = serving;
+  size_t alloc;
+  char *out;
+
+  if (!c || (c->fd != fd) || c->failed)
+    return -1;
+  if (c->out_len + len > OUTPUT_MAX) {
+    c->failed = 1;
+    return -1;
+  }
+
+  /* (Requests aren't served while output waits, so none of it has
+     been sent yet) */
+  if (c->out_len + len > c->out_alloc) {
+    alloc = c->out_alloc ? c->out_alloc : INITIAL_BUF;
+    while (alloc < c->out_len + len)
+      alloc *= 2;
+    if (!(out = realloc(c->out, alloc))) {
+      c->failed = 1;
+      return -1;
+    }
+    c->out = out;
+    c->out_alloc = alloc;
+  }
+
+  memcpy(c->out + c->out_len, data, len);
+  c->out_len += len;
+  return 0;
+}
+
+/* Reads everything currently available, returning READ_AGAIN once
+   nothing more is available, READ_CLOSED if no more will arrive
+   because of EOF or an error, or READ_FULL if the buffer for a
+   streamed body is full, a head has grown too big to be valid, or a
+   collected body has arrived along with as much of the next request
+   as a head can be: */
+static int conn_read(conn_t *c) {
+  ssize_t n;
+
+  while (1) {
+    if (c->len + 1 >= c->alloc) {
+      if (c->stream
+          || ((c->state == CONN_HEAD) && (c->len > HTTP_MAX_HEAD_BYTES))
+          || ((c->state == CONN_BODY)
+              && (c->len >= c->req.pos + c->body_len + HTTP_MAX_HEAD_BYTES)))
+        return READ_FULL;
+      if (!conn_grow(c, 2 * c->alloc))
+        return READ_CLOSED;
+    }
+
+    n = read(c->fd, c->buf + c->len, c->alloc - c->len - 1);
+    if (n > 0) {
+      c->len += n;
+      stats_bytes_in(n);
+    }
+    else if (n == 0)
+      return READ_CLOSED;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return READ_AGAIN;
+    else if (errno != EINTR)
+      return READ_CLOSED;
+  }
+}
+
+/* Moves the connection's state machine forward over newly read
+   bytes, dispatching each complete request; returns 0 once the
+   connection should be closed: */
+static int conn_advance(conn_t *c, loop_t *l) {
+  size_t need;
+
+  while (1) {
+    /* Pipelined requests wait until the last response has gone out */
+    if (c->out_len || c->failed || c->held)
+      return 1;
+
+    if (c->state == CONN_HEAD) {
+      switch (http_parse(&c->req, c->buf, c->len)) {
+      case HTTP_PARSE_MORE:
+        return 1;
+      case HTTP_PARSE_DONE:
+        /* Let the request in, or turn it away, before any of its body
+           is read or streamed */
+        if (l->gate && !conn_enter(c, l))
+          return 0;
+        c->body_len = http_content_length(&c->req);
+        if (c->body_len && l->streams
+            && (c->stream = l->streams->open(&c->req))) {
+          /* Keep the head, plus a bounded amount of the body: */
+          if ((c->alloc < c->req.pos + STREAM_BUF)
+              && !conn_grow(c, c->req.pos + STREAM_BUF))
+            return 0;
+        } else if (c->body_len > HTTP_MAX_BODY_BYTES) {
+          /* Too big to collect, so answer without reading it */
+          return conn_dispatch(c, l);
+        }
+        c->state = CONN_BODY;
+        break;
+      default:
+        /* Anything unparseable is answered right away: */
+        return conn_dispatch(c, l);
+      }
+    }
+
+    if ((c->state == CONN_BODY) && c->stream) {
+      /* Pass along the body bytes that have arrived, leaving any
+         pipelined bytes after the body in the buffer: */
+      size_t n = c->len - c->req.pos;
+      if (n > c->body_len - c->body_seen)
+        n = c->body_len - c->body_seen;
+      l->streams->write(c->stream, c->buf + c->req.pos, n);
+      memmove(c->buf + c->req.pos, c->buf + c->req.pos + n,
+              c->len - c->req.pos - n);
+      c->len -= n;
+      c->body_seen += n;
+      if (c->body_seen < c->body_len)
+        return 1;
+      if (!conn_dispatch(c, l))
+        return 0;
+      conn_reset(c, l);
+    } else if (c->state == CONN_BODY) {
+      need = c->req.pos + c->body_len;
+      if (c->len < need) {
+        /* Make room for the whole body at once: */
+        if ((need + 1 > c->alloc) && !conn_grow(c, need + 1))
+          return 0;
+        return 1;
+      }
+      if (!conn_dispatch(c, l))
+        return 0;
+      conn_reset(c, l);
+    }
+  }
+}
+
+static int conn_dispatch(conn_t *c, loop_t *l) {
+  char *body = NULL, next = 0;
+  int keep;
+
+  /* The buffer may have moved since the head was parsed: */
+  http_parse(&c->req, c->buf, c->len);
+
+  c->nrequest++;
+
+  if ((c->state == CONN_BODY) && !c->stream) {
+    /* Terminate the body in place (conn_read leaves room), keeping
+       the first byte of any request that follows to put back after */
+    body = c->buf + c->req.pos;
+    next = body[c->body_len];
+    body[c->body_len] = 0;
+  }
+
+  serving = c;
+  keep = l->proc(c->fd, &c->req, body, c->body_len, c->stream, c->nrequest);
+  serving = NULL;
+  if (body)
+    body[c->body_len] = next;
+
+  /* Everything the request allocated goes at once: */
+  arena_reset(thread_arena());
+
+  /* A held request is finished, and the connection kept or closed,
+     by resume_all() */
+  if (c->held)
+    return 1;
+  conn_leave(c, l);
+
+  return keep && (c->state == CONN_BODY);
+}
+
+/* Passes the head of the current request through the gate, returning
+   0 if the gate answered it instead: */
+static int conn_enter(conn_t *c, loop_t *l) {
+  int ok;
+
+  serving = c;
+  ok = l->gate->enter(c->fd, &c->req);
+  serving = NULL;
+  arena_reset(thread_arena());
+
+  if (ok) {
+    c->entered = 1;
+    c->entered_us = now_us();
+  }
+  return ok;
+}
+
+/* Tells the gate that the current request is done, if it let the
+   request in: */
+static void conn_leave(conn_t *c, loop_t *l) {
+  if (c->entered) {
+    c->entered = 0;
+    l->gate->leave(now_us() - c->entered_us);
+  }
+}
+
+/* Resizes the connection's buffer, returning 0 (and leaving the
+   buffer as it was) if there is no memory for it: */
+static int conn_grow(conn_t *c, size_t alloc) {
+  char *buf = realloc(c->buf, alloc);
+
+  if (!buf)
+    return 0;
+  c->buf = buf;
+  c->alloc = alloc;
+  return 1;
+}
+
+/* Drops the request that was just served from the buffer, keeping any
+   pipelined bytes that follow it: */
+static void conn_reset(conn_t *c, loop_t *l) {
+  size_t used = c->req.pos + (c->stream ? 0 : c->body_len);
+
+  memmove(c->buf, c->buf + used, c->len - used);
+  c->len -= used;
+  c->state = CONN_HEAD;
+  c->wait = WAIT_NONE;
+  c->body_len = 0;
+  if (c->stream) {
+    l->streams->close(c->stream);
+    c->stream = NULL;
+    c->body_seen = 0;
+  }
+  http_request_init(&c->req);
+}
+
+/* Sets the connection's deadline for what it is waiting on. A head
+   must arrive within a fixed time of its first byte, however slowly
+   it trickles in, while a body only has to keep arriving. */
+static void conn_schedule(conn_t *c, loop_t *l) {
+  int wait, ms;
+
+  if (c->out_len)
+    wait = WAIT_WRITE;
+  else if (c->state == CONN_BODY)
+    wait = WAIT_BODY;
+  else
+    wait = c->len ? WAIT_HEAD : WAIT_IDLE;
+  if ((wait == c->wait) && (wait != WAIT_BODY))
+    return;
+
+  c->wait = wait;
+  if (wait == WAIT_IDLE)
+    ms = l->deadlines.idle;
+  else if (wait == WAIT_HEAD)
+    ms = l->deadlines.head;
+  else if (wait == WAIT_WRITE)
+    ms = l->deadlines.write;
+  else
+    ms = l->deadlines.body;
+  wheel_schedule(wheel, &c->timer, now_ms() + ms);
+}
+
+static void free_conn(conn_t *c, loop_t *l) {
+  conn_leave(c, l);
+  wheel_cancel(wheel, &c->timer);
+  if (c->stream)
+    l->streams->close(c->stream);
+  close(c->fd);
+  stats_conn_closed();
+  free(c->buf);
+  free(c->out);
+  free(c);
+}
@@ -0,0 +1,91 @@
+/* An event loop serves many connections from a few threads: every
+   socket is non-blocking, and each thread waits on its own
+   edge-triggered epoll set. Each connection's request is collected
+   incrementally in a buffer, and a request procedure runs once the
+   whole request has arrived.
+
+   Each loop thread keeps the connections' deadlines in a timer wheel
+   and closes a connection as soon as its deadline passes, so a client
+   that is slow or stalls costs only its buffer until then. Responses
+   that a client doesn't read right away wait in the connection's
+   output buffer, so no client ever makes its loop thread wait. */
+
+/* Called on a loop thread to respond to the `nrequest`th request
+   (counting from 1) on `fd`. `req` holds the parsed head, which is
+   complete unless parsing failed (in which case the procedure is
+   called as soon as the failure is found, with a NULL `body`).
+   Otherwise `body` holds the request's `body_len` Content-Length
+   bytes, NUL-terminated, unless the body was streamed (see below),
+   in which case `body` is NULL and `stream` is the body's stream.
+   Unless a gate (see below) has answered it already, a body longer
+   than HTTP_MAX_BODY_BYTES that is not streamed is never read: the
+   procedure is called as soon as the head arrives, with a NULL
+   `body` and no stream, and the connection is closed afterward. The
+   procedure returns 1 to keep the connection open for another
+   (possibly already pipelined) request, or 0 to have the loop close
+   `fd`. */
+typedef int (*request_proc_t)(int fd, http_request_t *req,
+                              char *body, size_t body_len,
+                              void *stream, int nrequest);
+
+/* Procedures for passing a request body along in pieces as it
+   arrives, instead of collecting it in memory first: */
+typedef struct {
+  /* Called once the head of `req` has arrived; returns NULL to have
+     the body collected as usual, or else a stream for the body */
+  void *(*open)(http_request_t *req);
+  /* Called with each piece of the body, in order */
+  void (*write)(void *stream, const char *data, size_t len);
+  /* Called after the request procedure, or when the connection
+     closes before the whole body has arrived */
+  void (*close)(void *stream);
+} body_stream_t;
+
+/* Procedures that bracket each request whose head parses, such as
+   for admission control: */
+typedef struct {
+  /* Called once the head of `req` has arrived on `fd`, before any of
+     its body is read or streamed; returns 1 to go on with the
+     request, or 0 after answering it, in which case the body is not
+     read and the connection is closed */
+  int (*enter)(int fd, http_request_t *req);
+  /* Called once for each request that enter() let through, after its
+     request procedure or when the connection closes before the
+     request is complete, with the microseconds since enter() */
+  void (*leave)(long usec);
+} request_gate_t;
+
+/* Called by a request procedure to answer its request later, from
+   any thread, instead of before returning; returns a hold to pass to
+   el_resume(), or NULL (if the caller is not a loop thread, or the
+   request is not complete) to have the procedure answer as usual.
+   Meanwhile the loop thread serves other connections, while this one
+   reads nothing and has no deadline, and the procedure's return
+   value is ignored. */
+void *el_hold(void);
+
+/* Has the loop thread that `hold` came from call `proc` with the
+   connection's fd and `data`, as soon as it can, to answer the held
+   request; `proc` returns 1 to keep the connection open, or 0, as a
+   request_proc_t does. `proc` may hold the request again. */
+void el_resume(void *hold, int (*proc)(int fd, void *data), void *data);
+
+/* Milliseconds that a connection may take before it is closed: */
+typedef struct {
+  int idle;   /* waiting for the first byte of a request */
+  int head;   /* from the first byte of a request to the end of its head */
+  int body;   /* waiting for each piece of a collected or streamed body */
+  int write;  /* for a client to take a response that didn't fit in
+                 its socket's buffer */
+} deadlines_t;
+
+/* Serves connections accepted from `listenfd` using `nthreads` loop
+   threads (at least 1, and one per core when `nthreads` is 0),
+   streaming bodies with `streams` and passing requests through `gate`
+   if they are not NULL, and closing connections that miss
+   `deadlines`. The calling thread becomes one of the loop threads,
+   so this function does not return. */
+void run_event_loop(int listenfd, int nthreads, request_proc_t proc,
+                    const body_stream_t *streams,
+                    const request_gate_t *gate,
+                    const deadlines_t *deadlines);
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "form.h"
+
+/* Same separators as parse_query(): */
+#define IS_QSEP(c) (((c) == '&') || ((c) == ';'))
+#define IS_END(c)  (((c) == 0) || ((c) == '#'))
+
+enum { FORM_NAME, FORM_VALUE, FORM_DONE };
+
+/* A growable string that stops growing at FORM_MAX_LEN bytes: */
+typedef struct {
+  char *s;
+  size_t len, alloc;
+  int too_long;
+} text_t;
+
+struct form_t {
+  char *list;
+  form_field_proc_t field;
+  form_item_proc_t item;
+  void *data;
+
+  int state;
+  int in_list;        /* whether the current value is the list */
+  text_t name, value; /* `value` is the current item in the list */
+  char pct[2];        /* hex digits after a '%' in the value */
+  int npct;           /* -1 if not after a '%' */
+};
+
+static void text_add(text_t *t, char c) {
+  if (t->len == FORM_MAX_LEN) {
+    t->too_long = 1;
+    return;
+  }
+  if (t->len + 1 >= t->alloc) {
+    t->alloc = (t->alloc ? 2 * t->alloc : 64);
+    t->s = realloc(t->s, t->alloc);
+  }
+  t->s[t->len++] = c;
+}
+
+static char *text_str(text_t *t) {
+  if (!t->s) {
+    t->alloc = 64;
+    t->s = malloc(t->alloc);
+  }
+  t->s[t->len] = 0;
+  return t->s;
+}
+
+static void text_clear(text_t *t) {
+  t->len = 0;
+  t->too_long = 0;
+}
+
+form_t *make_form(const char *list, form_field_proc_t field,
+                  form_item_proc_t item, void *data) {
+  form_t *f = calloc(1, sizeof(form_t));
+
+  f->list = (list ? strdup(list) : NULL);
+  f->field = field;
+  f->item = item;
+  f->data = data;
+  f->state = FORM_NAME;
+  f->npct = -1;
+
+  return f;
+}
+
+void free_form(form_t *f) {
+  free(f->list);
+  free(f->name.s);
+  free(f->value.s);
+  free(f);
+}
+
+/* Reports a complete list item: */
+static void end_item(form_t *f) {
+  if (f->value.len && !f->value.too_long)
+    f->item(text_str(&f->value), f->data);
+  text_clear(&f->value);
+}
+
+/* Adds a decoded byte to the value: */
+static void value_add(form_t *f, char c) {
+  if (f->in_list && (c == '\n'))
+    end_item(f);
+  else
+    text_add(&f->value, c);
+}
+
+/* A '%' that is not followed by two hex digits stands for itself: */
+static void flush_pct(form_t *f) {
+  int i;
+
+  if (f->npct < 0)
+    return;
+  value_add(f, '%');
+  for (i = 0; i < f->npct; i++)
+    value_add(f, f->pct[i]);
+  f->npct = -1;
+}
+
+static int hex_value(int c) {
+  return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/* Reports the field (or the end of the list) that ends here: */
+static void end_field(form_t *f) {
+  flush_pct(f);
+
+  if (f->in_list)
+    end_item(f);
+  else if (f->name.len && !f->name.too_long && !f->value.too_long)
+    f->field(text_str(&f->name), text_str(&f->value), f->data);
+
+  text_clear(&f->name);
+  text_clear(&f->value);
+  f->in_list = 0;
+}
+
+void form_add(form_t *f, const char *s, size_t len) {
+  size_t i;
+
+  for (i = 0; (i < len) && (f->state != FORM_DONE); i++) {
+    unsigned char c = s[i];
+
+    if (f->state == FORM_NAME) {
+      if (c == '=') {
+        f->in_list = (f->list && !f->name.too_long
+                      && !strcmp(text_str(&f->name), f->list));
+        f->state = FORM_VALUE;
+      } else if (IS_QSEP(c))
+        end_field(f);
+      else if (IS_END(c)) {
+        end_field(f);
+        f->state = FORM_DONE;
+      } else
+        text_add(&f->name, c);
+      continue;
+    }
+
+    /* In a value: */
+    if (f->npct >= 0) {
+      if (isxdigit(c)) {
+        f->pct[f->npct++] = c;
+        if (f->npct == 2) {
+          value_add(f, hex_value(f->pct[0]) * 16 + hex_value(f->pct[1]));
+          f->npct = -1;
+        }
+        continue;
+      }
+      flush_pct(f);
+    }
+
+    if (c == '%')
+      f->npct = 0;
+    else if (c == '+')
+      value_add(f, ' ');
+    else if (IS_QSEP(c)) {
+      end_field(f);
+      f->state = FORM_NAME;
+    } else if (IS_END(c)) {
+      end_field(f);
+      f->state = FORM_DONE;
+    } else
+      value_add(f, c);
+  }
+}
+
+void form_finish(form_t *f) {
+  if (f->state != FORM_DONE)
+    end_field(f);
+  f->state = FORM_DONE;
+}
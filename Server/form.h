@@ -0,0 +1,35 @@
+/* A form decoder parses an application/x-www-form-urlencoded body
+   that arrives in pieces, so that the body never has to be held in
+   memory all at once. Each field is reported as soon as it is
+   complete. Field names are kept as they appear (like parse_query())
+   and values are decoded.
+
+   One field can be named as a list: its value is split at newlines,
+   and each non-empty item is reported as soon as it is complete
+   instead of holding the whole value. Fields and items longer than
+   FORM_MAX_LEN bytes are ignored. */
+
+#define FORM_MAX_LEN 65536
+
+/* Opaque type for a form decoder instance: */
+typedef struct form_t form_t;
+
+/* Called with each field of the form, except the list: */
+typedef void (*form_field_proc_t)(const char *name, const char *value,
+                                  void *data);
+
+/* Called with each item of the list: */
+typedef void (*form_item_proc_t)(const char *item, void *data);
+
+/* Creates a decoder that reports to `field` and `item`, treating
+   the field named `list` (if not NULL) as a list: */
+form_t *make_form(const char *list, form_field_proc_t field,
+                  form_item_proc_t item, void *data);
+
+/* Decodes the next `len` bytes of the body: */
+void form_add(form_t *f, const char *s, size_t len);
+
+/* Reports whatever field or item the body ended in the middle of: */
+void form_finish(form_t *f);
+
+void free_form(form_t *f);
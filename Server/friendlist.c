@@ -9,39 +9,304 @@
  *   Carnegie Mellon University
  */
 #include "csapp.h"
+#include <netinet/tcp.h>
 #include "dictionary.h"
 #include "more_string.h"
-
-static void doit(int fd);
+#include "graph.h"
+#include "http_parser.h"
+#include "event_loop.h"
+#include "sbuf.h"
+#include "response.h"
+#include "arena.h"
+#include "persist.h"
+#include "form.h"
+#include "cache.h"
+#include "peer.h"
+#include "stats.h"
+#include "log.h"
+#include "affinity.h"
+#include "router.h"
+#include "admit.h"
+
+/* The connection that a handler responds on: */
+typedef struct {
+  int fd;
+  int keep_alive;   /* whether to leave `fd` open after the response */
+  int http11;       /* whether the client accepts chunked responses */
+} conn_t;
+
+static void usage(char *prog);
+static int parse_log_level(const char *s);
+static void serve_connection(int fd);
+static int doit(rio_t *rp, int nrequest);
 static void *t_doit(void *connfdp);
-static dictionary_t *read_requesthdrs(rio_t *rp);
-static void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *d);
-static void clienterror(int fd, char *cause, char *errnum, 
+static void *worker(void *vl);
+static void *accept_loop(void *vl);
+static int open_reuseport_listenfd(char *port);
+static void reject_busy(int fd);
+static long usec_since(struct timespec *start);
+static int el_doit(int fd, http_request_t *req, char *body, size_t body_len,
+                   void *stream, int nrequest);
+static int el_enter(int fd, http_request_t *req);
+static void el_leave(long usec);
+static int want_keep_alive(http_request_t *req, int nrequest);
+static int check_request(conn_t *conn, http_request_t *req);
+static void serve(conn_t *conn, http_request_t *req,
+                  char *body, size_t body_len, void *stream);
+static char *read_body(rio_t *rp, http_request_t *req, size_t *len_p);
+static int detach_head(rio_t *rp, http_request_t *req);
+static int read_stream(rio_t *rp, http_request_t *req, void *stream);
+static void *bulk_open(http_request_t *req);
+static void bulk_write(void *stream, const char *data, size_t len);
+static void bulk_close(void *stream);
+static dictionary_t *bulk_query(void *stream);
+static int is_form_post(http_request_t *req);
+static int streams_body(http_request_t *req);
+static void clienterror(conn_t *conn, char *cause, char *errnum, 
                         char *shortmsg, char *longmsg);
+static void out_of_memory(conn_t *conn);
 static void print_stringdictionary(dictionary_t *d);
-static void serve_request(int fd, dictionary_t *query);
-static void serve_sum(int fd, dictionary_t *query);
-static void serve_friends(int fd, dictionary_t *query);
-static void serve_befriend(int fd, dictionary_t *query);
-static void serve_unfriend(int fd, dictionary_t *query);
-static void serve_introduce(int fd, dictionary_t *query);
-
-static dictionary_t *users;
+static void stream_ok(conn_t *conn, response_t *r, const char *content_type);
+static int ok_header(conn_t *conn, response_t *r, const char *content_type,
+                     char *header, size_t size);
+static void collect_friend_line(const char *friend, void *data);
+static void send_cached(conn_t *conn, cached_t *e);
+static void add_introduced(const char *name, void *data);
+static int start_introduction(conn_t *conn, const char *user,
+                              const char *friend, const char *host,
+                              const char *port);
+static void *introduce_thread(void *data);
+static int introduce_resume(int fd, void *data);
+static void serve_request(conn_t *conn, dictionary_t *query);
+static void serve_sum(conn_t *conn, dictionary_t *query);
+static void serve_friends(conn_t *conn, dictionary_t *query);
+static void finish_change(conn_t *conn, const char *user);
+static void change_committed(int status, void *data);
+static int change_resume(int fd, void *data);
+static void send_friends(conn_t *conn, const char *user);
+static void serve_befriend(conn_t *conn, dictionary_t *query);
+static void serve_unfriend(conn_t *conn, dictionary_t *query);
+static void serve_mutual(conn_t *conn, dictionary_t *query);
+static void serve_introduce(conn_t *conn, dictionary_t *query);
+static void serve_distance(conn_t *conn, dictionary_t *query);
+static void serve_stats(conn_t *conn, dictionary_t *query);
+static void init_routes(void);
+static const struct route_t *find_route(http_request_t *req);
+
+/* Number of independently locked shards in the friend graph: */
+#define GRAPH_SHARDS 64
+
+/* Default depth of the worker pool's connection queue: */
+#define DEFAULT_QUEUE 1024
+
+/* Default size of each core's worker pool with --reuseport: */
+#define DEFAULT_CORE_WORKERS 4
+
+/* Request bodies up to this many bytes are read into the connection's
+   buffer and used in place; longer ones are copied out: */
+#define MAX_BUFFERED_BODY 65536
+
+/* Default seconds between snapshots of the friend graph: */
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+
+/* Default megabytes of serialized /friends responses to keep: */
+#define DEFAULT_CACHE_MB 64
+
+/* Friend lists longer than this many bytes are streamed instead of
+   being cached: */
+#define CACHE_MAX_ENTRY (1 << 20)
+
+/* A streamed bulk request is refused once the friends that arrive
+   before its `user` argument add up to this many bytes: */
+#define BULK_MAX_WAITING (1 << 20)
+
+/* Defaults for requests to other friendlist servers: */
+#define DEFAULT_PEER_TIMEOUT 5000  /* milliseconds per request */
+#define PEER_MAX_IDLE 8            /* idle connections kept per peer */
+
+/* How far /distance looks when the request doesn't say: */
+#define DEFAULT_MAX_DISTANCE 6
+
+/* Default latency that admission control aims for: */
+#define DEFAULT_TARGET_LATENCY 100   /* milliseconds */
+
+/* Defaults for persistent connections: */
+#define DEFAULT_IDLE_TIMEOUT 5     /* seconds to wait for a next request */
+#define DEFAULT_MAX_REQUESTS 100   /* requests served per connection */
+
+/* Defaults for slow clients, which are disconnected when they take
+   longer than this: */
+#define DEFAULT_HEADER_TIMEOUT 10  /* seconds for a request's head */
+#define DEFAULT_READ_TIMEOUT 10    /* seconds for each piece of a body */
+#define DEFAULT_WRITE_TIMEOUT 10   /* seconds for each write of a response */
+
+/* A listening socket with its own accept loop and, if connections
+   go to a worker pool, its own pool and queue. With --reuseport,
+   each core has one, and the listener's threads run only on that
+   core. */
+typedef struct {
+  int listenfd;
+  int cpu;          /* -1 if the threads can run anywhere */
+  sbuf_t queue;
+} listener_t;
+
+static graph_t *users;
+static listener_t *listeners;
+static int nlisteners;
+static int workers;      /* per listener; 0 for a thread per connection */
+static int reverse_dns;  /* whether to look up the names of clients */
+static int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static int max_requests = DEFAULT_MAX_REQUESTS;
+static int header_timeout = DEFAULT_HEADER_TIMEOUT;
+static int read_timeout = DEFAULT_READ_TIMEOUT;
+static int write_timeout = DEFAULT_WRITE_TIMEOUT;
+static persist_t *persist;   /* NULL unless the graph is kept on disk */
+static cache_t *friends_cache;  /* NULL if caching is turned off */
+static peer_pool_t *peers;
+static admit_t *admission;   /* NULL unless requests are limited */
+static int queue_deadline;   /* milliseconds; 0 for none */
+static unsigned long expired;   /* connections that waited too long */
+
+/* Bodies of bulk /befriend and /unfriend requests are streamed: */
+static const body_stream_t bulk_streams = { bulk_open, bulk_write, bulk_close };
+
+/* In event-loop mode, requests are checked and admitted by their
+   heads: */
+static const request_gate_t el_gate = { el_enter, el_leave };
+
+/* Methods that a route accepts: */
+#define ROUTE_GET  1
+#define ROUTE_POST 2
+
+/* A route says what a request needs before its handler runs, so that
+   nothing else is parsed. Arguments are taken from the query string
+   and, if `body` is set, from a form body; only the ones named in
+   `params` are kept, and with no `params`, nothing is parsed. */
+typedef struct route_t {
+  const char *prefix;
+  int methods;
+  const char * const *params;   /* NULL-terminated */
+  int body;
+  int stream;      /* whether the form body is streamed (as bulk_t) */
+  int stat;        /* the STATS_ route that requests count under */
+  void (*handler)(conn_t *conn, dictionary_t *query);
+} route_t;
+
+static const char * const sum_params[] = { "x", "y", NULL };
+static const char * const user_params[] = { "user", NULL };
+static const char * const friends_params[] = { "user", "friends", NULL };
+static const char * const mutual_params[] = { "user", "other", NULL };
+static const char * const introduce_params[] =
+  { "user", "friend", "host", "port", NULL };
+static const char * const distance_params[] = { "user", "other", "max", NULL };
+
+#define ANY (ROUTE_GET | ROUTE_POST)
+
+static const route_t routes[] = {
+  { "/sum",       ANY, sum_params,       1, 0, STATS_SUM,      serve_sum },
+  { "/friends",   ANY, user_params,      1, 0, STATS_FRIENDS,  serve_friends },
+  { "/befriend",  ANY, friends_params,   1, 1, STATS_BEFRIEND, serve_befriend },
+  { "/unfriend",  ANY, friends_params,   1, 1, STATS_UNFRIEND, serve_unfriend },
+  { "/mutual",    ANY, mutual_params,    1, 0, STATS_MUTUAL,   serve_mutual },
+  { "/introduce", ANY, introduce_params, 1, 0, STATS_INTRODUCE,
+    serve_introduce },
+  { "/distance",  ANY, distance_params,  1, 0, STATS_DISTANCE,
+    serve_distance },
+  { "/stats",     ROUTE_GET, NULL,       0, 0, STATS_OTHER,    serve_stats }
+};
+
+/* For a URI that matches no route: */
+static const route_t default_route =
+  { "", ANY, NULL, 0, 0, STATS_OTHER, serve_request };
+
+#undef ANY
+
+static router_t *router;
 
 int main(int argc, char **argv) 
 {
-  int listenfd, connfd;
-  char hostname[MAXLINE], port[MAXLINE];
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr;
+  int event_loop = 0, reuseport = 0, queue_len = DEFAULT_QUEUE;
+  char *listen_port = NULL, *data_dir = NULL;
+  int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL, cache_mb = DEFAULT_CACHE_MB;
+  int peer_timeout = DEFAULT_PEER_TIMEOUT, level = LOG_INFO;
+  int max_inflight = 0, target_latency = DEFAULT_TARGET_LATENCY;
+  int *cpus = NULL;
+  int i, j;
 
   /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(1);
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--event-loop"))
+      event_loop = 1;
+    else if (!strcmp(argv[i], "--reuseport"))
+      reuseport = 1;
+    else if (!strcmp(argv[i], "--reverse-dns"))
+      reverse_dns = 1;
+    else if (!strcmp(argv[i], "--workers") && (i + 1 < argc))
+      workers = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--queue") && (i + 1 < argc))
+      queue_len = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--idle-timeout") && (i + 1 < argc))
+      idle_timeout = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--max-requests") && (i + 1 < argc))
+      max_requests = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--header-timeout") && (i + 1 < argc))
+      header_timeout = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--read-timeout") && (i + 1 < argc))
+      read_timeout = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--write-timeout") && (i + 1 < argc))
+      write_timeout = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--data-dir") && (i + 1 < argc))
+      data_dir = argv[++i];
+    else if (!strcmp(argv[i], "--snapshot-interval") && (i + 1 < argc))
+      snapshot_interval = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--cache-mb") && (i + 1 < argc))
+      cache_mb = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--peer-timeout") && (i + 1 < argc))
+      peer_timeout = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--max-inflight") && (i + 1 < argc))
+      max_inflight = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--target-latency") && (i + 1 < argc))
+      target_latency = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--queue-deadline") && (i + 1 < argc))
+      queue_deadline = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--log-level") && (i + 1 < argc)) {
+      if ((level = parse_log_level(argv[++i])) < 0)
+        usage(argv[0]);
+    }
+    else if (!listen_port && (argv[i][0] != '-'))
+      listen_port = argv[i];
+    else
+      usage(argv[0]);
+  }
+  if (!listen_port || (queue_len < 1) || (cache_mb < 0) || (peer_timeout < 1)
+      || (max_inflight < 0) || (target_latency < 1) || (queue_deadline < 0)
+      || (header_timeout < 1) || (read_timeout < 1) || (write_timeout < 1)
+      || (event_loop && reuseport))
+    usage(argv[0]);
+
+  /* With --reuseport, each core that we may run on gets a socket on
+     the same port, and the kernel spreads connections over them */
+  if (reuseport)
+    nlisteners = allowed_cpus(&cpus);
+  if (nlisteners < 1) {
+    nlisteners = 1;
+    reuseport = 0;
+  }
+  if (reuseport && (workers < 1))
+    workers = DEFAULT_CORE_WORKERS;
+
+  listeners = calloc(nlisteners, sizeof(listener_t));
+  for (i = 0; i < nlisteners; i++) {
+    if (reuseport) {
+      listeners[i].listenfd = open_reuseport_listenfd(listen_port);
+      listeners[i].cpu = cpus[i];
+    } else {
+      listeners[i].listenfd = Open_listenfd(listen_port);
+      listeners[i].cpu = -1;
+    }
+    if (listeners[i].listenfd < 0)
+      unix_error("Open_listenfd error");
   }
-
-  listenfd = Open_listenfd(argv[1]);
 
   /* Don't kill the server if there's an error, because
      we want to survive errors due to a client. But we
@@ -51,515 +316,1516 @@ int main(int argc, char **argv)
   /* Also, don't stop on broken connections: */
   Signal(SIGPIPE, SIG_IGN);
 
-  /* Create the friends dictionary */
-  users = make_dictionary(1,free);
+  /* Give up on clients that stop reading their responses */
+  response_set_timeout(write_timeout * 1000);
+
+  /* Log from a background thread, so that requests never wait on
+     output */
+  start_log(level, STDOUT_FILENO);
+
+  /* Create the friend graph */
+  init_routes();
+  users = make_graph(GRAPH_SHARDS);
+
+  /* Load it from disk, and keep it there, if asked to */
+  if (data_dir)
+    persist = start_persist(users, data_dir, snapshot_interval);
+
+  /* Keep serialized /friends responses until the friends change */
+  if (cache_mb > 0)
+    friends_cache = make_cache((size_t)cache_mb << 20);
+
+  /* Keep connections open to the servers that /introduce asks */
+  peers = make_peer_pool(PEER_MAX_IDLE, peer_timeout);
+
+  /* Turn requests away when too many are being served */
+  if (max_inflight > 0)
+    admission = make_admit(max_inflight, target_latency * 1000L);
+
+  /* In event-loop mode, one thread per core serves every connection */
+  if (event_loop) {
+    deadlines_t deadlines;
+
+    deadlines.idle = idle_timeout * 1000;
+    deadlines.head = header_timeout * 1000;
+    deadlines.body = read_timeout * 1000;
+    deadlines.write = write_timeout * 1000;
+    run_event_loop(listeners[0].listenfd, 0, el_doit, &bulk_streams,
+                   &el_gate, &deadlines);
+  }
+
+  for (i = 0; i < nlisteners; i++) {
+    pthread_t th;
+
+    /* With a worker pool, accepted connections wait in a bounded queue */
+    if (workers > 0) {
+      sbuf_init(&listeners[i].queue, queue_len);
+      for (j = 0; j < workers; j++) {
+        Pthread_create(&th, NULL, worker, &listeners[i]);
+        Pthread_detach(th);
+      }
+    }
+
+    /* This thread accepts for the first listener */
+    if (i > 0) {
+      Pthread_create(&th, NULL, accept_loop, &listeners[i]);
+      Pthread_detach(th);
+    }
+  }
+
+  accept_loop(&listeners[0]);
+  return 0;
+}
+
+/*
+ * accept_loop - accept connections on a listener and hand them off
+ */
+static void *accept_loop(void *vl)
+{
+  listener_t *l = vl;
+  char hostname[MAXLINE], port[MAXLINE];
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+  int connfd;
+
+  pin_thread(l->cpu);
 
   while (1) {
     clientlen = sizeof(clientaddr);
-    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+    connfd = Accept(l->listenfd, (SA *)&clientaddr, &clientlen);
     if (connfd >= 0) {
-      Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                  port, MAXLINE, 0);
-      printf("Accepted connection from (%s, %s)\n", hostname, port);
-
-      int *connfdp;
-      pthread_t th;
-      connfdp = malloc(sizeof(int));
-      *connfdp = connfd;
-      Pthread_create(&th, NULL, t_doit, connfdp);
-      Pthread_detach(th);
+      /* A reverse lookup can take a long time, so it's optional */
+      if (log_enabled(LOG_DEBUG)) {
+        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
+                    port, MAXLINE,
+                    reverse_dns ? 0 : (NI_NUMERICHOST | NI_NUMERICSERV));
+        log_msg(LOG_DEBUG, "Accepted connection from (%s, %s)\n",
+                hostname, port);
+      }
+
+      if (workers > 0) {
+        if (!sbuf_tryinsert(&l->queue, connfd)) {
+          reject_busy(connfd);
+          close(connfd);
+        }
+      } else {
+        int *connfdp;
+        pthread_t th;
+        connfdp = malloc(sizeof(int));
+        *connfdp = connfd;
+        Pthread_create(&th, NULL, t_doit, connfdp);
+        Pthread_detach(th);
+      }
     }
   }
+  return NULL;
+}
+
+/*
+ * open_reuseport_listenfd - like Open_listenfd(), but lets other
+ *   sockets listen on the same port, with the kernel spreading new
+ *   connections over them
+ */
+static int open_reuseport_listenfd(char *port)
+{
+  struct addrinfo hints, *listp, *p;
+  int listenfd = -1, optval = 1;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV | AI_ADDRCONFIG;
+  Getaddrinfo(NULL, port, &hints, &listp);
+
+  for (p = listp; p; p = p->ai_next) {
+    if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+    if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    Close(listenfd);
+  }
+  Freeaddrinfo(listp);
+
+  if (!p || (listen(listenfd, LISTENQ) < 0))
+    return -1;
+  return listenfd;
+}
+
+static void usage(char *prog)
+{
+  fprintf(stderr, "usage: %s [--event-loop | --reuseport] [--workers <n>]\n"
+          "          [--queue <n>] [--reverse-dns]\n"
+          "          [--idle-timeout <secs>] [--max-requests <n>]\n"
+          "          [--header-timeout <secs>] [--read-timeout <secs>]\n"
+          "          [--write-timeout <secs>]\n"
+          "          [--data-dir <dir>] [--snapshot-interval <secs>]\n"
+          "          [--cache-mb <n>] [--peer-timeout <msecs>]\n"
+          "          [--max-inflight <n>] [--target-latency <msecs>]\n"
+          "          [--queue-deadline <msecs>]\n"
+          "          [--log-level none|error|warn|info|debug] <port>\n",
+          prog);
+  exit(1);
+}
+
+/*
+ * parse_log_level - returns the level named by `s`, or -1
+ */
+static int parse_log_level(const char *s)
+{
+  static const char *names[] = { "none", "error", "warn", "info", "debug" };
+  int i;
+
+  for (i = 0; i <= LOG_DEBUG; i++)
+    if (!strcmp(s, names[i]))
+      return i;
+  return -1;
 }
 
 void *t_doit(void *connfdp)
 {
   int connfd = *(int *)connfdp;
   free(connfdp);
-  doit(connfd);
+  serve_connection(connfd);
   close(connfd);
   return NULL;
 }
 
 /*
- * doit - handle one HTTP request/response transaction
+ * worker - serve connections from a listener's queue, one at a time
  */
-void doit(int fd) 
+void *worker(void *vl)
 {
-  char buf[MAXLINE], *method, *uri, *version;
+  listener_t *l = vl;
+
+  pin_thread(l->cpu);
+  while (1) {
+    long waited_ms;
+    int connfd = sbuf_remove_aged(&l->queue, &waited_ms);
+
+    /* A client that has waited this long has likely given up, and
+       serving it would make the ones behind it wait too */
+    if (queue_deadline && (waited_ms > queue_deadline)) {
+      reject_busy(connfd);
+      __atomic_add_fetch(&expired, 1, __ATOMIC_RELAXED);
+    } else
+      serve_connection(connfd);
+    close(connfd);
+  }
+  return NULL;
+}
+
+/*
+ * reject_busy - reply to a connection that does not fit in the queue,
+ *   or a request turned away by admission control, before closing it
+ */
+static void reject_busy(int fd)
+{
+  static char busy[] = "HTTP/1.0 503 Service Unavailable\r\n"
+                       "Retry-After: 1\r\n"
+                       "Content-length: 0\r\n"
+                       "Connection: close\r\n\r\n";
+  response_t *r = make_response();
+
+  response_set_header(r, busy, sizeof(busy) - 1);
+  response_send(r, fd);
+  free_response(r);
+}
+
+/*
+ * usec_since - microseconds elapsed since a CLOCK_MONOTONIC time
+ */
+static long usec_since(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000L
+         + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * serve_connection - handle requests on a connection until the client
+ *   or the keep-alive policy closes it
+ */
+static void serve_connection(int fd)
+{
+  struct timeval rcv = { read_timeout, 0 }, snd = { write_timeout, 0 };
   rio_t rio;
-  dictionary_t *headers, *query;
+  int nrequest;
+  struct pollfd pfd;
+
+  stats_conn_opened();
+
+  /* A blocked read or write gives up after a while, instead of
+     holding this thread for as long as the client likes */
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rcv, sizeof(rcv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &snd, sizeof(snd));
 
-  /* Read request line and headers */
   Rio_readinitb(&rio, fd);
-  if (Rio_readlineb(&rio, buf, MAXLINE) <= 0)
-    return;
-  printf("%s", buf);
-  
-  if (!parse_request_line(buf, &method, &uri, &version)) {
-    clienterror(fd, method, "400", "Bad Request",
-                "Friendlist did not recognize the request");
-  } else {
-    if (strcasecmp(version, "HTTP/1.0")
-        && strcasecmp(version, "HTTP/1.1")) {
-      clienterror(fd, version, "501", "Not Implemented",
-                  "Friendlist does not implement that version");
-    } else if (strcasecmp(method, "GET")
-               && strcasecmp(method, "POST")) {
-      clienterror(fd, method, "501", "Not Implemented",
-                  "Friendlist does not implement that method");
-    } else {
-      headers = read_requesthdrs(&rio);
-
-      /* Parse all query arguments into a dictionary */
-      query = make_dictionary(COMPARE_CASE_SENS, free);
-      parse_uriquery(uri, query);
-      if (!strcasecmp(method, "POST"))
-        read_postquery(&rio, headers, query);
-
-      /* For debugging, print the dictionary */
-      print_stringdictionary(query);
-
-      /* You'll want to handle different queries here,
-         but the intial implementation always returns
-         nothing: */
-      //printf("uri: %s \n", uri);
-      //printf("starts with /friends? %d \n", starts_with("/friends",uri));
-      if (starts_with("/sum",uri))
-      	serve_sum(fd, query);
-      else if (starts_with("/friends",uri))
-      	serve_friends(fd, query);
-      else if (starts_with("/befriend",uri))
-      	serve_befriend(fd, query);
-      else if (starts_with("/unfriend",uri))
-      	serve_unfriend(fd,query);
-      else
-      {
-      	serve_request(fd, query);
-      }
+  for (nrequest = 1; doit(&rio, nrequest); nrequest++) {
+    /* Pipelined requests are already buffered; otherwise give
+       the client a limited time to send the next one */
+    if (rio.rio_cnt <= 0) {
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, idle_timeout * 1000) <= 0)
+        break;
+    }
+  }
+  rio_freeb(&rio);
+  stats_conn_closed();
+}
 
-      /* Clean up */
-      free_dictionary(query);
-      free_dictionary(headers);
+/*
+ * doit - handle one HTTP request/response transaction, returning 1
+ *   if the connection should stay open for another request
+ */
+int doit(rio_t *rp, int nrequest) 
+{
+  char *body = NULL;
+  size_t body_len = 0, used = 0;
+  void *stream;
+  http_request_t req;
+  conn_t conn;
+  struct timespec start;
+  struct pollfd pfd;
+  long left;
+  int keep_alive, complete = 1, no_memory = 0;
+
+  conn.fd = rp->rio_fd;
+  conn.keep_alive = 0;
+  conn.http11 = 0;
+
+  /* Read the request line and headers into the connection's buffer,
+     and parse them there. However slowly they trickle in, they must
+     all arrive by the deadline. */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  http_request_init(&req);
+  while (http_parse(&req, rp->rio_bufptr, rp->rio_cnt) == HTTP_PARSE_MORE) {
+    pfd.fd = rp->rio_fd;
+    pfd.events = POLLIN;
+    left = header_timeout * 1000L - usec_since(&start) / 1000;
+    if ((left <= 0) || (poll(&pfd, 1, left) <= 0)
+        || (rio_fillb(rp, HTTP_MAX_HEAD_BYTES + 1) <= 0)) {
+      log_msg(LOG_DEBUG, "Closing connection %d: %s\n", rp->rio_fd,
+              (left <= 0) ? "header timed out" : "header unfinished");
+      return 0;
     }
+  }
+
+  stats_bytes_in(req.pos);
 
-    /* Clean up status line */
-    free(method);
-    free(uri);
-    free(version);
+  if (!check_request(&conn, &req))
+    return 0;
+
+  /* Turn the request away before reading its body */
+  if (admission && !admit_enter(admission)) {
+    reject_busy(conn.fd);
+    return 0;
   }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if ((stream = bulk_open(&req))) {
+    if (detach_head(rp, &req))
+      complete = read_stream(rp, &req, stream);
+    else
+      no_memory = 1;
+  } else if (http_content_length(&req) <= MAX_BUFFERED_BODY) {
+    /* Use the body in place, after the head; reading may move the
+       buffer, so parse the head again to find it */
+    body_len = http_content_length(&req);
+    while (rp->rio_cnt < req.pos + body_len)
+      if (rio_fillb(rp, req.pos + body_len) <= 0) {
+        body_len = rp->rio_cnt - req.pos;
+        complete = 0;
+        break;
+      }
+    http_parse(&req, rp->rio_bufptr, rp->rio_cnt);
+    body = rp->rio_bufptr + req.pos;
+    used = req.pos + body_len;
+    stats_bytes_in(body_len);
+  } else if (detach_head(rp, &req)
+             && (body = read_body(rp, &req, &body_len))) {
+    complete = (body_len == http_content_length(&req));
+    stats_bytes_in(body_len);
+  } else
+    no_memory = 1;
+
+  /* After a body that was cut short, by a timeout or otherwise, or
+     left unread, the next request's place is unknown */
+  conn.keep_alive = complete && !no_memory && want_keep_alive(&req, nrequest);
+  conn.http11 = view_equals(http_version(&req), "HTTP/1.1");
+  if (no_memory)
+    out_of_memory(&conn);
+  else
+    serve(&conn, &req, body, body_len, stream);
+  keep_alive = conn.keep_alive;
+
+  if (admission)
+    admit_leave(admission, usec_since(&start));
+
+  /* Clean up */
+  rio_consumeb(rp, used);
+  if (stream)
+    bulk_close(stream);
+  arena_reset(thread_arena());
+
+  return keep_alive;
+}
+
+/*
+ * detach_head - copy a parsed request head out of the connection's
+ *   buffer, so that reading the body can reuse the buffer, or return
+ *   0 (leaving the head in place) if there is no memory for it
+ */
+static int detach_head(rio_t *rp, http_request_t *req)
+{
+  size_t len = req->pos;
+  char *head = arena_alloc(thread_arena(), len);
+
+  if (!head)
+    return 0;
+  memcpy(head, rp->rio_bufptr, len);
+  rio_consumeb(rp, len);
+
+  http_request_init(req);
+  http_parse(req, head, len);
+  return 1;
 }
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * el_enter - check and admit a request whose head the event loop has
+ *   parsed, before its body is read or streamed into the graph
  */
-dictionary_t *read_requesthdrs(rio_t *rp) 
+static int el_enter(int fd, http_request_t *req)
 {
-  char buf[MAXLINE];
-  dictionary_t *d = make_dictionary(COMPARE_CASE_INSENS, free);
+  conn_t conn;
+
+  conn.fd = fd;
+  conn.keep_alive = 0;
+  conn.http11 = 0;
+
+  if (!check_request(&conn, req))
+    return 0;
 
-  Rio_readlineb(rp, buf, MAXLINE);
-  printf("%s", buf);
-  while(strcmp(buf, "\r\n")) {
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    parse_header_line(buf, d);
+  if (admission && !admit_enter(admission)) {
+    reject_busy(fd);
+    return 0;
   }
-  
-  return d;
+
+  return 1;
 }
 
-void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *dest)
+/*
+ * el_leave - finish a request that el_enter() admitted
+ */
+static void el_leave(long usec)
 {
-  char *len_str, *type, *buffer;
-  int len;
-  
-  len_str = dictionary_get(headers, "Content-Length");
-  len = (len_str ? atoi(len_str) : 0);
+  if (admission)
+    admit_leave(admission, usec);
+}
+
+/*
+ * el_doit - handle one HTTP request that the event loop has
+ *   already read completely
+ */
+int el_doit(int fd, http_request_t *req, char *body, size_t body_len,
+            void *stream, int nrequest)
+{
+  conn_t conn;
+
+  conn.fd = fd;
+  conn.keep_alive = 0;
+  conn.http11 = 0;
+
+  /* A request that parsed was checked and admitted by el_enter() */
+  if ((req->result != HTTP_PARSE_DONE) && !check_request(&conn, req))
+    return 0;
+
+  conn.keep_alive = want_keep_alive(req, nrequest);
+  conn.http11 = view_equals(http_version(req), "HTTP/1.1");
+  serve(&conn, req, body, body_len, stream);
+
+  return conn.keep_alive;
+}
+
+/*
+ * want_keep_alive - decide whether a connection stays open after
+ *   its `nrequest`th request
+ */
+static int want_keep_alive(http_request_t *req, int nrequest)
+{
+  view_t connection = http_header(req, "Connection");
+
+  if (nrequest >= max_requests)
+    return 0;
+
+  /* We can't find the end of a chunked request body */
+  if (http_header(req, "Transfer-Encoding").s)
+    return 0;
+
+  if (view_equals(http_version(req), "HTTP/1.1"))
+    return !view_equals(connection, "close");
+  else
+    return view_equals(connection, "keep-alive");
+}
 
-  type = dictionary_get(headers, "Content-Type");
+/*
+ * check_request - check a parsed request head, returning 1 if it
+ *   is a request that we handle or replying with an error and
+ *   returning 0 otherwise
+ */
+static int check_request(conn_t *conn, http_request_t *req)
+{
+  char cause[MAXLINE];
+  view_t line = http_line(req);
+
+  if ((req->result == HTTP_PARSE_DONE) && log_enabled(LOG_DEBUG))
+    log_msg(LOG_DEBUG, "%.*s", (int)req->pos, req->buf);
+  else
+    log_msg(LOG_INFO, "%.*s", (int)line.len, line.s);
   
-  buffer = malloc(len+1);
-  Rio_readnb(rp, buffer, len);
-  buffer[len] = 0;
+  if (req->result == HTTP_PARSE_BAD) {
+    clienterror(conn, "?", "400", "Bad Request",
+                "Friendlist did not recognize the request");
+    return 0;
+  }
+
+  if (req->result == HTTP_PARSE_TOO_LARGE) {
+    clienterror(conn, "?", "431", "Request Header Fields Too Large",
+                "Friendlist did not accept the request");
+    return 0;
+  }
 
-  if (!strcasecmp(type, "application/x-www-form-urlencoded")) {
-    parse_query(buffer, dest);
+  /* Refuse to collect a body that would take too much memory */
+  if ((http_content_length(req) > HTTP_MAX_BODY_BYTES)
+      && !streams_body(req)) {
+    clienterror(conn, "?", "413", "Payload Too Large",
+                "Friendlist did not accept the request body");
+    return 0;
   }
 
-  free(buffer);
+  if (!view_equals(http_version(req), "HTTP/1.0")
+      && !view_equals(http_version(req), "HTTP/1.1")) {
+    view_t v = http_version(req);
+    snprintf(cause, sizeof(cause), "%.*s", (int)v.len, v.s);
+    clienterror(conn, cause, "501", "Not Implemented",
+                "Friendlist does not implement that version");
+  } else if (!view_equals(http_method(req), "GET")
+             && !view_equals(http_method(req), "POST")) {
+    view_t v = http_method(req);
+    snprintf(cause, sizeof(cause), "%.*s", (int)v.len, v.s);
+    clienterror(conn, cause, "501", "Not Implemented",
+                "Friendlist does not implement that method");
+  } else
+    return 1;
+
+  return 0;
 }
 
-static char *ok_header(size_t len, const char *content_type) {
-  char *len_str, *header;
-  
-  header = append_strings("HTTP/1.0 200 OK\r\n",
-                          "Server: Friendlist Web Server\r\n",
-                          "Connection: close\r\n",
-                          "Content-length: ", len_str = to_string(len), "\r\n",
-                          "Content-type: ", content_type, "\r\n\r\n",
-                          NULL);
-  free(len_str);
+/*
+ * init_routes - compile the route table
+ */
+static void init_routes(void)
+{
+  size_t i;
 
-  return header;
+  router = make_router();
+  for (i = 0; i < sizeof(routes) / sizeof(routes[0]); i++)
+    router_add(router, routes[i].prefix, &routes[i]);
+  router_compile(router);
 }
 
 /*
- * serve_request - example request handler
+ * find_route - find the route for a request's URI
+ */
+static const route_t *find_route(http_request_t *req)
+{
+  view_t uri = http_uri(req);
+  const route_t *route = router_match(router, uri.s, uri.len);
+
+  return route ? route : &default_route;
+}
+
+/*
+ * serve - dispatch a request to its handler
+ */
+static void serve(conn_t *conn, http_request_t *req,
+                  char *body, size_t body_len, void *stream)
+{
+  arena_t *a = thread_arena();
+  const route_t *route = find_route(req);
+  dictionary_t *query;
+  view_t uri = http_uri(req);
+  const char *q;
+  struct timespec start;
+  int method;
+
+  method = view_equals(http_method(req), "GET") ? ROUTE_GET : ROUTE_POST;
+  if (!(route->methods & method)) {
+    view_t v = http_method(req);
+    char cause[MAXLINE];
+
+    snprintf(cause, sizeof(cause), "%.*s", (int)v.len, v.s);
+    clienterror(conn, cause, "405", "Method Not Allowed",
+                "Friendlist does not allow that method here");
+    return;
+  }
+
+  if (stream) {
+    /* The arguments have been collected as the body streamed in */
+    if (!(query = bulk_query(stream))) {
+      clienterror(conn, "?", "400", "Bad Request",
+                  "Please provide the user before a long list of friends");
+      return;
+    }
+  } else {
+    /* Parse the route's arguments into a dictionary; everything lives
+       in the thread's arena until the request is done */
+    if (!(query = make_arena_dictionary(a, COMPARE_CASE_SENS, NULL))) {
+      out_of_memory(conn);
+      return;
+    }
+    if (route->params
+        && (((q = memchr(uri.s, '?', uri.len))
+             && !arena_parse_query_fields(a, q + 1, uri.s + uri.len - (q + 1),
+                                          query, route->params))
+            || (route->body && is_form_post(req)
+                && !arena_parse_query_fields(a, body, body_len, query,
+                                             route->params)))) {
+      out_of_memory(conn);
+      return;
+    }
+  }
+
+  /* For debugging, print the dictionary */
+  if (log_enabled(LOG_DEBUG))
+    print_stringdictionary(query);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  route->handler(conn, query);
+  stats_request(route->stat, usec_since(&start));
+}
+
+/*
+ * read_body - read the Content-Length bytes of a request body, so
+ *   that the next request on the connection starts after it, or
+ *   return NULL if there is no memory for them
+ */
+char *read_body(rio_t *rp, http_request_t *req, size_t *len_p)
+{
+  size_t len = http_content_length(req);
+  char *buffer;
+  ssize_t n;
+
+  if (!(buffer = arena_alloc(thread_arena(), len+1))) {
+    *len_p = 0;
+    return NULL;
+  }
+  n = Rio_readnb(rp, buffer, len);
+  if (n < 0)
+    n = 0;
+  buffer[n] = 0;
+  *len_p = n;
+
+  return buffer;
+}
+
+/*
+ * read_stream - pass the Content-Length bytes of a request body to a
+ *   stream, a buffer at a time, without copying, returning 1 if they
+ *   all arrived
+ */
+static int read_stream(rio_t *rp, http_request_t *req, void *stream)
+{
+  size_t len = http_content_length(req);
+  char *slice;
+  ssize_t got;
+
+  while (len > 0) {
+    if ((got = rio_sliceb(rp, len, &slice)) <= 0)
+      break;
+    bulk_write(stream, slice, got);
+    stats_bytes_in(got);
+    len -= got;
+  }
+
+  return (len == 0);
+}
+
+/* A bulk request is a /befriend or /unfriend request whose form body
+   is decoded as it streams in. Each name in the `friends` list is
+   applied to the graph as soon as it arrives, so memory use does not
+   grow with the size of the body. Names that arrive before the `user`
+   argument wait until it shows up, up to BULK_MAX_WAITING bytes of
+   them; past that, the request applies nothing and gets a 400. */
+typedef struct {
+  int unfriend;
+  dictionary_t *query;   /* arguments other than `friends` */
+  form_t *form;
+  int nfriends;          /* friends seen so far */
+  char **waiting;        /* friends that arrived before `user` */
+  size_t nwaiting, alloc;
+  size_t waiting_bytes;
+  int overflow;          /* too many friends arrived before `user` */
+} bulk_t;
+
+/*
+ * streams_body - returns 1 if the body of `req` is streamed to a bulk
+ *   request rather than collected first
+ */
+static int streams_body(http_request_t *req)
+{
+  const route_t *route;
+
+  return ((req->result == HTTP_PARSE_DONE)
+          && (view_equals(http_version(req), "HTTP/1.0")
+              || view_equals(http_version(req), "HTTP/1.1"))
+          && is_form_post(req)
+          && http_content_length(req)
+          && (route = find_route(req))->stream
+          && (route->methods & ROUTE_POST));
+}
+
+static int is_form_post(http_request_t *req)
+{
+  return (view_equals(http_method(req), "POST")
+          && view_equals(http_header(req, "Content-Type"),
+                         "application/x-www-form-urlencoded"));
+}
+
+static void bulk_apply(bulk_t *b, const char *user, const char *friend)
+{
+  if (b->unfriend)
+    graph_unfriend(users, user, friend);
+  else
+    graph_befriend(users, user, friend);
+}
+
+/*
+ * bulk_apply_waiting - apply the friends waiting for `user`, or just
+ *   drop them if `user` is NULL
+ */
+static void bulk_apply_waiting(bulk_t *b, const char *user)
+{
+  size_t i;
+
+  for (i = 0; i < b->nwaiting; i++) {
+    if (user)
+      bulk_apply(b, user, b->waiting[i]);
+    free(b->waiting[i]);
+  }
+  b->nwaiting = 0;
+  b->waiting_bytes = 0;
+}
+
+static void bulk_field(const char *name, const char *value, void *vb)
+{
+  bulk_t *b = vb;
+
+  dictionary_set(b->query, name, strdup(value));
+  if (!strcmp(name, "user") && !b->overflow)
+    bulk_apply_waiting(b, value);
+}
+
+static void bulk_friend(const char *friend, void *vb)
+{
+  bulk_t *b = vb;
+  const char *user = dictionary_get(b->query, "user");
+  size_t len = strlen(friend) + 1;
+
+  if (b->overflow)
+    return;
+
+  b->nfriends++;
+  if (user)
+    bulk_apply(b, user, friend);
+  else if (b->waiting_bytes + len > BULK_MAX_WAITING) {
+    b->overflow = 1;
+    bulk_apply_waiting(b, NULL);
+  } else {
+    b->waiting_bytes += len;
+    if (b->nwaiting == b->alloc) {
+      b->alloc = 2 * (b->alloc + 8);
+      b->waiting = realloc(b->waiting, b->alloc * sizeof(char *));
+    }
+    b->waiting[b->nwaiting++] = strdup(friend);
+  }
+}
+
+/*
+ * bulk_open - start streaming the body of `req` if it is a bulk request
  */
-static void serve_request(int fd, dictionary_t *query)
+static void *bulk_open(http_request_t *req)
+{
+  view_t uri = http_uri(req);
+  const char *q;
+  bulk_t *b;
+
+  if (!streams_body(req))
+    return NULL;
+
+  b = calloc(1, sizeof(bulk_t));
+  b->unfriend = (find_route(req)->stat == STATS_UNFRIEND);
+  b->query = make_dictionary(COMPARE_CASE_SENS, free);
+  if ((q = memchr(uri.s, '?', uri.len)))
+    parse_query_n(q + 1, uri.s + uri.len - (q + 1), b->query);
+  b->form = make_form("friends", bulk_field, bulk_friend, b);
+
+  return b;
+}
+
+static void bulk_write(void *stream, const char *data, size_t len)
 {
-  printf("serve request\n");
-  size_t len;
-  char *body, *header;
+  form_add(((bulk_t *)stream)->form, data, len);
+}
+
+/*
+ * bulk_query - finish a bulk request's body, returning its arguments
+ *   for the handler, or NULL if too many friends came before `user`;
+ *   the friends have already been applied, so they appear as an empty
+ *   `friends` argument
+ */
+static dictionary_t *bulk_query(void *stream)
+{
+  bulk_t *b = stream;
+
+  form_finish(b->form);
+  if (b->overflow)
+    return NULL;
+  if (b->nfriends)
+    dictionary_set(b->query, "friends", strdup(""));
+  return b->query;
+}
+
+static void bulk_close(void *stream)
+{
+  bulk_t *b = stream;
+
+  /* Without a user, waiting friends go nowhere */
+  bulk_apply_waiting(b, NULL);
+  free_form(b->form);
+  free_dictionary(b->query);
+  free(b->waiting);
+  free(b);
+}
+
+static const char *connection_header(conn_t *conn) {
+  return (conn->keep_alive
+          ? "Connection: keep-alive\r\n"
+          : "Connection: close\r\n");
+}
+
+/*
+ * start_ok - starts a 200 response whose body may be too large to
+ *   collect first; for an HTTP/1.1 client, the body is sent in chunks
+ *   as it is added. Finish the response with send_ok().
+ */
+static response_t *start_ok(conn_t *conn, const char *content_type) {
+  response_t *r = make_response();
+
+  if (conn->http11)
+    stream_ok(conn, r, content_type);
+
+  return r;
+}
 
-  body = strdup("alice\nbob");
+/*
+ * stream_ok - switches `r`, which may already have some of its body,
+ *   to a chunked 200 response for an HTTP/1.1 client
+ */
+static void stream_ok(conn_t *conn, response_t *r, const char *content_type) {
+  char header[MAXLINE];
+  int len;
 
-  len = strlen(body);
+  len = snprintf(header, sizeof(header),
+                 "HTTP/1.1 200 OK\r\n"
+                 "Server: Friendlist Web Server\r\n"
+                 "%s"
+                 "Transfer-Encoding: chunked\r\n"
+                 "Content-type: %s\r\n\r\n",
+                 connection_header(conn),
+                 content_type);
+  response_set_header(r, header, len);
+  log_msg(LOG_DEBUG, "Response headers:\n%s", header);
+  response_stream(r, conn->fd);
+}
 
-  /* Send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
-  printf("Response headers:\n");
-  printf("%s", header);
+/*
+ * send_ok - sends a 200 response whose body has been collected in `r`
+ *   (or the rest of one from start_ok())
+ */
+static void send_ok(conn_t *conn, response_t *r, const char *content_type) {
+  char header[MAXLINE];
+  int len;
 
-  free(header);
+  if (response_is_streamed(r)) {
+    response_send(r, conn->fd);
+    return;
+  }
 
-  /* Send response body to client */
-  Rio_writen(fd, body, len);
+  len = ok_header(conn, r, content_type, header, sizeof(header));
+  response_set_header(r, header, len);
+  log_msg(LOG_DEBUG, "Response headers:\n%s", header);
 
-  //free(body);
+  response_send(r, conn->fd);
+}
+
+/*
+ * ok_header - formats the header of a 200 response whose whole body
+ *   is in `r`, returning its length
+ */
+static int ok_header(conn_t *conn, response_t *r, const char *content_type,
+                     char *header, size_t size) {
+  return snprintf(header, size,
+                 "HTTP/1.1 200 OK\r\n"
+                 "Server: Friendlist Web Server\r\n"
+                 "%s"
+                 "Content-length: %lu\r\n"
+                 "Content-type: %s\r\n\r\n",
+                 connection_header(conn),
+                 (unsigned long)response_length(r),
+                 content_type);
+}
+
+/*
+ * add_friend_line - adds one friend and its terminator to a response
+ */
+static void add_friend_line(const char *friend, void *r)
+{
+  response_add(r, friend, strlen(friend));
+  response_add(r, "\n", 1);
+}
+
+/*
+ * serve_request - example request handler
+ */
+static void serve_request(conn_t *conn, dictionary_t *query)
+{
+  log_msg(LOG_DEBUG, "serve request\n");
+  response_t *r;
+
+  r = make_response();
+  response_addstr(r, "alice\nbob");
+
+  send_ok(conn, r, "text/html; charset=utf-8");
+  free_response(r);
 }
 
 /*
  * serve_sum - example request handler
  */
-static void serve_sum(int fd, dictionary_t *query)
+static void serve_sum(conn_t *conn, dictionary_t *query)
 {
-  printf("serve sum\n");
-  size_t len;
-  char *body, *header, *x, *y, *sum;
+  log_msg(LOG_DEBUG, "serve sum\n");
+  response_t *r;
+  char *x, *y, *sum;
 
   x = dictionary_get(query, "x");
   y = dictionary_get(query, "y");
   if (!x || !y)
   {
-  	clienterror(fd, "?", "400", "Bad Request", "Please provide two numbered arguments");
+  	clienterror(conn, "?", "400", "Bad Request", "Please provide two numbered arguments");
   	return;
   }
 
   Sleep(10);
-  sum = to_string(atoi(x) + atoi(y));
-  body = append_strings(sum, "\n", NULL);
-  free(sum);
-
-  len = strlen(body);
-
-  /* send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
-  printf("Response headers:\n");
-  printf("%s", header);
-
-  free(header);
+  if (!(sum = arena_to_string(thread_arena(), atoi(x) + atoi(y)))) {
+    out_of_memory(conn);
+    return;
+  }
 
-  /* Send response body to client */
-  Rio_writen(fd, body, len);
+  r = make_response();
+  response_addstr(r, sum);
+  response_add(r, "\n", 1);
 
-  //free(body);
+  send_ok(conn, r, "text/html; charset=utf-8");
+  free_response(r);
 }
 
+/* A friend list being collected for the cache: */
+typedef struct {
+  conn_t *conn;
+  response_t *r;
+} collect_t;
+
 /*
  * serve_friends - reports the friends of a user in the query
  */
-static void serve_friends(int fd, dictionary_t *query)
+static void serve_friends(conn_t *conn, dictionary_t *query)
 {
-  printf("serve friends\n");
-  size_t len;
-  char *body, *header, *user;
+  log_msg(LOG_DEBUG, "serve friends\n");
+  response_t *r;
+  collect_t c;
+  cached_t *e;
+  char *user, *key, header[MAXLINE];
+  unsigned long version;
+  int len;
 
   user = dictionary_get(query, "user");
   if (!user)
   {
-  	clienterror(fd, "?", "400", "Bad Request", "Please provide a user");
+  	clienterror(conn, "?", "400", "Bad Request", "Please provide a user");
   	return;
   }
 
-  dictionary_t *friends = (dictionary_t *)dictionary_get(users, user);
-  if (friends != NULL)
-  {
-    const char **friends_list = dictionary_keys(friends);
-    body = join_strings(friends_list, '\n');
+  if (!friends_cache) {
+    r = start_ok(conn, "text/html; charset=utf-8");
+    graph_each_friend(users, user, add_friend_line, r);
 
-    free(friends_list);
+    send_ok(conn, r, "text/html; charset=utf-8");
+    free_response(r);
+    return;
   }
-  else
-  {
-  	dictionary_t *new_friends = make_dictionary(1,free);
-  	dictionary_set(users, user, new_friends);
-  	body = "";
+
+  /* The header depends on the connection, so it is part of the key */
+  if (!(key = arena_alloc(thread_arena(), strlen(user) + 2))) {
+    out_of_memory(conn);
+    return;
   }
-  free(friends);
+  key[0] = (conn->keep_alive ? '+' : '-');
+  strcpy(key + 1, user);
 
+  if ((e = cache_get(friends_cache, key, graph_version(users, user)))) {
+    log_msg(LOG_DEBUG, "Response cached\n");
+    send_cached(conn, e);
+    return;
+  }
 
-  len = strlen(body);
+  /* Collect the list, unless it gets too big to cache */
+  c.conn = conn;
+  c.r = make_response();
+  version = graph_each_friend(users, user, collect_friend_line, &c);
 
-  /* send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
-  printf("Response headers:\n");
-  printf("%s", header);
+  if (response_is_streamed(c.r) || (response_length(c.r) > CACHE_MAX_ENTRY)) {
+    send_ok(conn, c.r, "text/html; charset=utf-8");
+    free_response(c.r);
+    return;
+  }
 
-  free(header);
+  len = ok_header(conn, c.r, "text/html; charset=utf-8",
+                  header, sizeof(header));
+  e = make_cached(len + response_length(c.r));
+  memcpy(cached_data(e), header, len);
+  response_copy_body(c.r, cached_data(e) + len);
+  free_response(c.r);
 
-  /* Send response body to client */
-  Rio_writen(fd, body, len);
+  cache_put(friends_cache, key, version, e);
+  send_cached(conn, e);
+}
 
-  //free(body);
+/*
+ * send_cached - sends a whole cached response in one write (waiting
+ *   as needed on a non-blocking socket) and releases it
+ */
+static void send_cached(conn_t *conn, cached_t *e)
+{
+  response_t *r = make_response();
+
+  response_addref(r, cached_data(e), cached_length(e));
+  response_send(r, conn->fd);
+  free_response(r);
+  cached_release(e);
 }
 
 /*
- * serve_befriend - friends some users and reports the friends of a user defined in the query
+ * collect_friend_line - adds a friend to a list being collected, which
+ *   switches to streaming once it's too big to cache
  */
-static void serve_befriend(int fd, dictionary_t *query)
+static void collect_friend_line(const char *friend, void *data)
 {
-  printf("serve befreind\n");
-  size_t len;
-  char *body, *header, *user, *friends;
+  collect_t *c = data;
 
-  user = (char *)dictionary_get(query, "user");
-  friends = (char *)dictionary_get(query, "friends");
-  if (!user || !friends)
-  {
-  	clienterror(fd, "?", "400", "Bad Request", "Please provide two valid arguments");
-  	return;
-  }
+  add_friend_line(friend, c->r);
+  if (c->conn->http11 && !response_is_streamed(c->r)
+      && (response_length(c->r) > CACHE_MAX_ENTRY))
+    stream_ok(c->conn, c->r, "text/html; charset=utf-8");
+}
 
-  dictionary_t *userz_friends = (dictionary_t *)dictionary_get(users, user);
-  if (userz_friends == NULL)
-  {
-  	dictionary_t *new_user = make_dictionary(1,free);
-  	dictionary_set(users, user, new_user);
-  	userz_friends = (dictionary_t *)dictionary_get(users, user);
+/* A reply that waits for changes to reach the disk, in event-loop
+   mode: */
+typedef struct {
+  conn_t conn;
+  void *hold;
+  int status;       /* from persist_commit() */
+  char user[];      /* whose friends to report */
+} change_t;
+
+/*
+ * finish_change - reply to a request that changed `user`'s friends
+ *   with the user's friends once the changes are on disk, or with an
+ *   error if they cannot be saved. In event-loop mode, the loop thread
+ *   serves other connections while the log is written.
+ */
+static void finish_change(conn_t *conn, const char *user)
+{
+  change_t *ch;
+
+  if (persist && (ch = malloc(sizeof(change_t) + strlen(user) + 1))) {
+    if ((ch->hold = el_hold())) {
+      ch->conn = *conn;
+      strcpy(ch->user, user);
+      persist_commit_async(persist, change_committed, ch);
+      return;
+    }
+    free(ch);
   }
 
-  char **new_friends = split_string(friends, '\n');
-  int i;
-  for(i = 0; new_friends[i] != NULL; i++)
-  {
-  	dictionary_set(userz_friends, new_friends[i], NULL);
-  	dictionary_t *friendz_friends = (dictionary_t *)dictionary_get(users, new_friends[i]);
-  	if (friendz_friends != NULL)
-  	{
-  		dictionary_set(friendz_friends, user, NULL);
-  	}
-  	else
-  	{
-  		dictionary_t *new_user = make_dictionary(1,free);
-  		dictionary_set(new_user, user, NULL);
-  		dictionary_set(users, new_friends[i], new_user);
-  	}
+  if (persist && (persist_commit(persist) < 0)) {
+    clienterror(conn, "?", "500", "Internal Server Error",
+                "Friendlist could not save the changes");
+    return;
   }
 
-  const char **friends_list= dictionary_keys(userz_friends);
-  body = join_strings(friends_list, '\n');
+  send_friends(conn, user);
+}
 
-  free(friends_list);
+/*
+ * change_committed - called by the log's writer once a held change
+ *   is on disk (or cannot be)
+ */
+static void change_committed(int status, void *data)
+{
+  change_t *ch = data;
+
+  ch->status = status;
+  el_resume(ch->hold, change_resume, ch);
+}
+
+/*
+ * change_resume - reply to a held change, back on its loop thread
+ */
+static int change_resume(int fd, void *data)
+{
+  change_t *ch = data;
+  int keep_alive;
 
-  len = strlen(body);
+  if (ch->status < 0)
+    clienterror(&ch->conn, "?", "500", "Internal Server Error",
+                "Friendlist could not save the changes");
+  else
+    send_friends(&ch->conn, ch->user);
+  keep_alive = ch->conn.keep_alive;
 
-  /* send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
-  printf("Response headers:\n");
-  printf("%s", header);
+  free(ch);
+  return keep_alive;
+}
 
-  free(header);
+/*
+ * send_friends - reports the friends of `user`
+ */
+static void send_friends(conn_t *conn, const char *user)
+{
+  response_t *r;
 
-  /* Send response body to client */
-  Rio_writen(fd, body, len);
+  r = start_ok(conn, "text/html; charset=utf-8");
+  graph_each_friend(users, user, add_friend_line, r);
 
-  //free(body);
+  send_ok(conn, r, "text/html; charset=utf-8");
+  free_response(r);
 }
 
 /*
- * serve_unfriend - unfriends some users and reports the friends of a user defined in the query
+ * serve_befriend - friends some users and reports the friends of a user defined in the query
  */
-static void serve_unfriend(int fd, dictionary_t *query)
+static void serve_befriend(conn_t *conn, dictionary_t *query)
 {
-  printf("serve unfriend\n");
-  size_t len;
-  char *body, *header, *user, *friends;
+  log_msg(LOG_DEBUG, "serve befreind\n");
+  char *user, *friends;
 
   user = (char *)dictionary_get(query, "user");
   friends = (char *)dictionary_get(query, "friends");
   if (!user || !friends)
   {
-  	clienterror(fd, "?", "400", "Bad Request", "Please provide two valid arguments");
+  	clienterror(conn, "?", "400", "Bad Request", "Please provide two valid arguments");
   	return;
   }
 
-  dictionary_t *userz_friends = (dictionary_t *)dictionary_get(users, user);
-  if (userz_friends == NULL)
+  char **new_friends = arena_split_string(thread_arena(), friends, '\n');
+  int i;
+  if (!new_friends)
   {
-  	dictionary_t *new_user = make_dictionary(1,free);
-  	dictionary_set(users, user, new_user);
-  	userz_friends = (dictionary_t *)dictionary_get(users, user);
+    out_of_memory(conn);
+    return;
   }
-  else
+  for(i = 0; new_friends[i] != NULL; i++)
   {
-  	char **new_friends = split_string(friends, '\n');
-  	int i;
-  	for(i = 0; new_friends[i] != NULL; i++)
-  	{
-  	  dictionary_remove(userz_friends, new_friends[i]);
-  	  dictionary_t *friendz_friends = (dictionary_t *)dictionary_get(users, new_friends[i]);
-  	  if (friendz_friends != NULL)
-  	  {
-  		dictionary_remove(friendz_friends, user);
-  	  }
-  	  else
-  	  {
-  		dictionary_t *new_user = make_dictionary(1,free);
-  		dictionary_set(new_user, user, NULL);
-  	  }
-    }
+  	graph_befriend(users, user, new_friends[i]);
   }
+  finish_change(conn, user);
+}
 
-  const char **friends_list= dictionary_keys(userz_friends);
-  body = join_strings(friends_list, '\n');
+/*
+ * serve_unfriend - unfriends some users and reports the friends of a user defined in the query
+ */
+static void serve_unfriend(conn_t *conn, dictionary_t *query)
+{
+  log_msg(LOG_DEBUG, "serve unfriend\n");
+  char *user, *friends;
 
-  free(friends_list);
+  user = (char *)dictionary_get(query, "user");
+  friends = (char *)dictionary_get(query, "friends");
+  if (!user || !friends)
+  {
+  	clienterror(conn, "?", "400", "Bad Request", "Please provide two valid arguments");
+  	return;
+  }
 
-  len = strlen(body);
+  char **new_friends = arena_split_string(thread_arena(), friends, '\n');
+  int i;
+  if (!new_friends)
+  {
+    out_of_memory(conn);
+    return;
+  }
+  for(i = 0; new_friends[i] != NULL; i++)
+  {
+  	graph_unfriend(users, user, new_friends[i]);
+  }
+  finish_change(conn, user);
+}
 
-  /* send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
-  printf("Response headers:\n");
-  printf("%s", header);
+/*
+ * serve_mutual - reports the friends that two users in the query have in common
+ */
+static void serve_mutual(conn_t *conn, dictionary_t *query)
+{
+  log_msg(LOG_DEBUG, "serve mutual\n");
+  response_t *r;
+  char *user, *other;
 
-  free(header);
+  user = dictionary_get(query, "user");
+  other = dictionary_get(query, "other");
+  if (!user || !other)
+  {
+  	clienterror(conn, "?", "400", "Bad Request", "Please provide two users");
+  	return;
+  }
 
-  /* Send response body to client */
-  Rio_writen(fd, body, len);
+  r = start_ok(conn, "text/html; charset=utf-8");
+  graph_each_mutual(users, user, other, add_friend_line, r);
 
-  //free(body);
+  send_ok(conn, r, "text/html; charset=utf-8");
+  free_response(r);
 }
 
+/* The names that an introduction adds to `user`'s friends: */
+typedef struct {
+  arena_t *arena;   /* where the names are kept */
+  const char *user;
+  char **names;
+  size_t count, alloc;
+  int no_memory;    /* set if some names could not be kept */
+} introduce_t;
+
+/* An introduction whose peer is asked from a thread of its own, in
+   event-loop mode; it lives in its own arena, `in.arena`: */
+typedef struct {
+  conn_t conn;
+  void *hold;
+  char *friend, *host, *port;
+  int status;       /* from peer_get_friends() */
+  introduce_t in;
+} introduction_t;
+
 /*
- * serve_introduce - introduces a user A to another user B and all of B's friends
+ * serve_introduce - introduces a user A to another user B and all of B's friends.
+ *   In event-loop mode, B's server is asked from another thread, so
+ *   that the loop thread serves other connections meanwhile.
  */
-static void serve_introduce(int fd, dictionary_t *query)
+static void serve_introduce(conn_t *conn, dictionary_t *query)
 {
-  printf("serve introduce\n");
-  size_t len;
-  char *body, *header, *user, *host, *port, *request, response[MAXLINE], *status;
-  int client;
-  rio_t rio;
+  log_msg(LOG_DEBUG, "serve introduce\n");
+  char *user, *friend, *host, *port;
+  introduce_t in;
 
   user = dictionary_get(query, "user");
+  friend = dictionary_get(query, "friend");
   host = dictionary_get(query, "host");
   port = dictionary_get(query, "port");
-  if (!user || !host || !port)
+  if (!user || !friend || !host || !port)
   {
-  	clienterror(fd, "?", "400", "Bad Request", "Please provide a user");
+  	clienterror(conn, "?", "400", "Bad Request", "Please provide a user, friend, host, and port");
   	return;
   }
 
-  dictionary_t *friends = (dictionary_t *)dictionary_get(users, user);
-  if (friends == NULL)
-  {
-  	dictionary_t *new_friends = make_dictionary(1,free);
-  	dictionary_set(users, user, new_friends);
-  	friends = (dictionary_t *)dictionary_get(users, user);
-  }
-  //request = append_strings(host,port,"/friends?user=",user);
-  //struct addrinfo hints;
-  //struct addrinfo *addrs;
-  //memset(&hints, 0, sizeof(struct addrinfo));
-  //hints.ai_family = AF_INET;
-  //hints.ai_socktype = 0;
-  //Getaddrinfo(host, port, &hints, &addrs);
-
-  //s = Socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
-  //Connect(s, addrs->ai_addr, addrs->ai_addrlen);
-  //Freeaddrinfo(addrs);
-  //struct sockaddr server_addr;
-  //int addrlen = sizeof(sockaddr);
-  request = "GET /friends/ HTTP/1.0\r\n\r\n";     // make the request header
-  len = strlen(request);                          // 
-  client = Open_clientfd(host,port);              // client = the connection file descriptor
-  Rio_writen(client, request, len);               // write the request header to the client file descriptor
-
-  Rio_readinitb(&rio, client);
-  if (Rio_readlineb(&rio, response, MAXLINE) <= 0)
+  if (start_introduction(conn, user, friend, host, port))
+    return;
+
+  /* Collect the friend and the friend's friends from the peer */
+  in.arena = thread_arena();
+  in.user = user;
+  in.count = 0;
+  in.alloc = 16;
+  in.no_memory = 0;
+  if (!(in.names = arena_alloc(thread_arena(), in.alloc * sizeof(char *))))
   {
-    printf("didn't receive any response headers from Rio_readlineb");
+    out_of_memory(conn);
     return;
   }
-  if (!parse_status_line(response, NULL, &status, NULL))
+  add_introduced(friend, &in);
+
+  if (peer_get_friends(peers, host, port, friend, add_introduced, &in) < 0)
   {
-    printf("status line didn't parse correctly ]:");
+  	clienterror(conn, host, "502", "Bad Gateway", "Could not get friends from the other server");
+  	return;
+  }
+  if (in.no_memory)
+  {
+    out_of_memory(conn);
     return;
   }
+
+  /* ... and add them to the user's friends all at once */
+  graph_befriend_all(users, user, (const char * const *)in.names, in.count);
+  finish_change(conn, user);
+}
+
+/*
+ * start_introduction - hold an event-loop request for /introduce
+ *   and ask the peer from a new thread, returning 1, or return 0 to
+ *   have the caller ask the peer itself
+ */
+static int start_introduction(conn_t *conn, const char *user,
+                              const char *friend, const char *host,
+                              const char *port)
+{
+  arena_t *a = make_arena(4096);
+  introduction_t *x;
+  pthread_t tid;
+
+  x = arena_alloc(a, sizeof(introduction_t));
+  if (!x)
+    goto fail;
+  x->in.arena = a;
+  x->in.user = arena_strndup(a, user, strlen(user));
+  x->friend = arena_strndup(a, friend, strlen(friend));
+  x->host = arena_strndup(a, host, strlen(host));
+  x->port = arena_strndup(a, port, strlen(port));
+  x->in.count = 0;
+  x->in.alloc = 16;
+  x->in.no_memory = 0;
+  x->in.names = arena_alloc(a, x->in.alloc * sizeof(char *));
+  if (!x->in.user || !x->friend || !x->host || !x->port || !x->in.names
+      || !(x->hold = el_hold()))
+    goto fail;
+  x->conn = *conn;
+  add_introduced(x->friend, &x->in);
+
+  /* Without a thread, ask here; the reply still comes by el_resume() */
+  if (pthread_create(&tid, NULL, introduce_thread, x) == 0)
+    pthread_detach(tid);
   else
-  {
-    if (strcasecmp(status, "200"))
-    {
-      printf("status was not OK ]: ; %s",status);
+    introduce_thread(x);
+  return 1;
+
+ fail:
+  free_arena(a);
+  return 0;
+}
+
+/*
+ * introduce_thread - ask the peer for a held introduction, then hand
+ *   it back to its loop thread
+ */
+static void *introduce_thread(void *data)
+{
+  introduction_t *x = data;
+
+  x->status = peer_get_friends(peers, x->host, x->port, x->friend,
+                               add_introduced, &x->in);
+  el_resume(x->hold, introduce_resume, x);
+  return NULL;
+}
+
+/*
+ * introduce_resume - finish a held introduction, back on its loop
+ *   thread
+ */
+static int introduce_resume(int fd, void *data)
+{
+  introduction_t *x = data;
+  int keep_alive;
+
+  if (x->status < 0)
+    clienterror(&x->conn, x->host, "502", "Bad Gateway",
+                "Could not get friends from the other server");
+  else if (x->in.no_memory)
+    out_of_memory(&x->conn);
+  else {
+    graph_befriend_all(users, x->in.user, (const char * const *)x->in.names,
+                       x->in.count);
+    finish_change(&x->conn, x->in.user);
+  }
+  keep_alive = x->conn.keep_alive;
+
+  free_arena(x->in.arena);
+  return keep_alive;
+}
+
+/*
+ * add_introduced - collects a name for serve_introduce(), except for
+ *   the user being introduced
+ */
+static void add_introduced(const char *name, void *data)
+{
+  introduce_t *in = data;
+  char **names, *copy;
+
+  if (in->no_memory || !strcmp(name, in->user))
+    return;
+
+  if (in->count == in->alloc) {
+    if (!(names = arena_realloc(in->arena, in->names,
+                                in->alloc * sizeof(char *),
+                                2 * in->alloc * sizeof(char *)))) {
+      in->no_memory = 1;
       return;
     }
-    
+    in->names = names;
+    in->alloc *= 2;
   }
-  
-  
+  if (!(copy = arena_strndup(in->arena, name, strlen(name)))) {
+    in->no_memory = 1;
+    return;
+  }
+  in->names[in->count++] = copy;
+}
+
+/*
+ * serve_distance - reports how many friendships apart two users are,
+ *   up to a maximum, and how much of the graph the search looked at
+ */
+static void serve_distance(conn_t *conn, dictionary_t *query)
+{
+  log_msg(LOG_DEBUG, "serve distance\n");
+  response_t *r;
+  char *user, *other, *max, line[128];
+  graph_distance_t d;
+  int limit = DEFAULT_MAX_DISTANCE;
+
+  user = dictionary_get(query, "user");
+  other = dictionary_get(query, "other");
+  max = dictionary_get(query, "max");
+  if (max)
+    limit = atoi(max);
+  if (!user || !other || (limit < 0))
+  {
+  	clienterror(conn, "?", "400", "Bad Request", "Please provide two users and an optional maximum");
+  	return;
+  }
+
+  graph_distance(users, user, other, limit, &d);
 
-  len = strlen(body);
+  r = make_response();
+  if (d.distance < 0)
+    response_addstr(r, "distance none\n");
+  else {
+    snprintf(line, sizeof(line), "distance %d\n", d.distance);
+    response_addstr(r, line);
+  }
+  snprintf(line, sizeof(line),
+           "expanded %lu\nedges %lu\nlevels %d\nbottom_up %d\n",
+           d.expanded, d.edges, d.levels, d.bottom_up);
+  response_addstr(r, line);
 
-  /* send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
-  printf("Response headers:\n");
-  printf("%s", header);
+  send_ok(conn, r, "text/html; charset=utf-8");
+  free_response(r);
+}
 
-  free(header);
+/*
+ * serve_stats - reports request counts, latencies, and traffic as JSON
+ */
+static void serve_stats(conn_t *conn, dictionary_t *query)
+{
+  response_t *r;
+  stats_gauge_t gauges[7];
+  struct tcp_info info;
+  socklen_t len;
+  char *json;
+  int i;
 
-  /* Send response body to client */
-  Rio_writen(fd, body, len);
+  /* For a listening socket, Linux reports the length of the accept
+     queue as the "unacked" count */
+  gauges[0].name = "accept_queue";
+  gauges[0].value = 0;
+  gauges[1].name = "worker_queue";
+  gauges[1].value = 0;
+  for (i = 0; i < nlisteners; i++) {
+    len = sizeof(info);
+    if (!getsockopt(listeners[i].listenfd, IPPROTO_TCP, TCP_INFO, &info, &len))
+      gauges[0].value += info.tcpi_unacked;
+    if (workers > 0)
+      gauges[1].value += sbuf_count(&listeners[i].queue);
+  }
 
-  //free(body);
+  gauges[2].name = "log_dropped";
+  gauges[2].value = log_dropped();
+
+  /* Admission control */
+  gauges[3].name = "inflight_limit";
+  gauges[3].value = admission ? admit_limit(admission) : 0;
+  gauges[4].name = "inflight";
+  gauges[4].value = admission ? admit_inflight(admission) : 0;
+  gauges[5].name = "shed";
+  gauges[5].value = admission ? admit_rejected(admission) : 0;
+  gauges[6].name = "queue_expired";
+  gauges[6].value = __atomic_load_n(&expired, __ATOMIC_RELAXED);
+
+  json = stats_json(gauges, 7);
+  r = make_response();
+  response_addstr(r, json);
+
+  send_ok(conn, r, "application/json");
+  free_response(r);
+  free(json);
 }
 
 /*
  * clienterror - returns an error message to the client
  */
-void clienterror(int fd, char *cause, char *errnum, 
+void clienterror(conn_t *conn, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
-  size_t len;
-  char *header, *body, *len_str;
+  char header[MAXLINE];
+  response_t *r;
+  int len;
 
-  body = append_strings("<html><title>Friendlist Error</title>",
-                        "<body bgcolor=""ffffff"">\r\n",
-                        errnum, " ", shortmsg,
-                        "<p>", longmsg, ": ", cause,
-                        "<hr><em>Friendlist Server</em>\r\n",
-                        NULL);
-  len = strlen(body);
+  r = make_response();
+  response_addstr(r, "<html><title>Friendlist Error</title>"
+                     "<body bgcolor=""ffffff"">\r\n");
+  response_addstr(r, errnum);
+  response_addstr(r, " ");
+  response_addstr(r, shortmsg);
+  response_addstr(r, "<p>");
+  response_addstr(r, longmsg);
+  response_addstr(r, ": ");
+  response_addstr(r, cause);
+  response_addstr(r, "<hr><em>Friendlist Server</em>\r\n");
 
   /* Print the HTTP response */
-  header = append_strings("HTTP/1.0 ", errnum, " ", shortmsg, "\r\n",
-                          "Content-type: text/html; charset=utf-8\r\n",
-                          "Content-length: ", len_str = to_string(len), "\r\n\r\n",
-                          NULL);
-  free(len_str);
-  
-  Rio_writen(fd, header, strlen(header));
-  Rio_writen(fd, body, len);
+  len = snprintf(header, sizeof(header),
+                 "HTTP/1.1 %s %s\r\n"
+                 "%s"
+                 "Content-type: text/html; charset=utf-8\r\n"
+                 "Content-length: %lu\r\n\r\n",
+                 errnum, shortmsg,
+                 connection_header(conn),
+                 (unsigned long)response_length(r));
+  response_set_header(r, header, len);
+
+  response_send(r, conn->fd);
+  free_response(r);
+}
 
-  free(header);
-  free(body);
+/*
+ * out_of_memory - answers a request that there was no memory for
+ */
+static void out_of_memory(conn_t *conn)
+{
+  clienterror(conn, "?", "500", "Internal Server Error",
+              "Friendlist ran out of memory for the request");
 }
 
 static void print_stringdictionary(dictionary_t *d)
@@ -568,9 +1834,9 @@ static void print_stringdictionary(dictionary_t *d)
 
   count = dictionary_count(d);
   for (i = 0; i < count; i++) {
-    printf("%s=%s\n",
-           dictionary_key(d, i),
-           (const char *)dictionary_value(d, i));
+    log_msg(LOG_DEBUG, "%s=%s\n",
+            dictionary_key(d, i),
+            (const char *)dictionary_value(d, i));
   }
-  printf("\n");
+  log_msg(LOG_DEBUG, "\n");
 }
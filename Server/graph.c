@@ -0,0 +1,665 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "symtab.h"
+#include "intset.h"
+#include "graph.h"
+
+/* User names are interned in a symbol table, and each user's
+   friends are an integer set of IDs, so a friendship costs a few
+   bytes per direction rather than a copy of each name. A user's
+   friend set lives in shard (ID % nshards), at index (ID / nshards),
+   and is guarded by that shard's lock, as is the version number
+   next to it that counts changes to the set. */
+typedef struct {
+  pthread_rwlock_t lock;
+  intset_t *friends;
+  unsigned long *versions;
+  size_t count;         /* entries in `friends` and `versions` */
+} shard_t;
+
+struct graph_t {
+  int nshards;
+  shard_t *shards;
+  symtab_t *names;
+  graph_log_proc_t log;
+  void *log_data;
+};
+
+/* A snapshot starts with this, followed by the number of users, the
+   name of each user (as a length and bytes) in ID order, and then
+   each user's friends (as a count and IDs). Numbers are 32-bit
+   unsigned integers in host byte order. */
+#define SNAPSHOT_MAGIC "FLGRAPH1"
+
+graph_t *make_graph(int nshards) {
+  graph_t *g = malloc(sizeof(graph_t));
+  int i;
+
+  if (nshards < 1)
+    nshards = 1;
+
+  g->nshards = nshards;
+  g->shards = malloc(nshards * sizeof(shard_t));
+  for (i = 0; i < nshards; i++) {
+    pthread_rwlock_init(&g->shards[i].lock, NULL);
+    g->shards[i].friends = NULL;
+    g->shards[i].versions = NULL;
+    g->shards[i].count = 0;
+  }
+  g->names = make_symtab();
+  g->log = NULL;
+  g->log_data = NULL;
+
+  return g;
+}
+
+static int shard_index(graph_t *g, unsigned int id) {
+  return id % g->nshards;
+}
+
+/* Locks the shards for two users, for writing or else for reading,
+   always in index order so that two threads locking the same pair
+   cannot deadlock: */
+static void lock_pair(graph_t *g, int a, int b, int write) {
+  if (a > b) {
+    int t = a; a = b; b = t;
+  }
+  if (write) {
+    pthread_rwlock_wrlock(&g->shards[a].lock);
+    if (b != a)
+      pthread_rwlock_wrlock(&g->shards[b].lock);
+  } else {
+    pthread_rwlock_rdlock(&g->shards[a].lock);
+    if (b != a)
+      pthread_rwlock_rdlock(&g->shards[b].lock);
+  }
+}
+
+static void unlock_pair(graph_t *g, int a, int b) {
+  pthread_rwlock_unlock(&g->shards[a].lock);
+  if (b != a)
+    pthread_rwlock_unlock(&g->shards[b].lock);
+}
+
+/* Returns the friend set of user `id`, or NULL if the user has never
+   had one; the user's shard must be locked: */
+static intset_t *user_friends(graph_t *g, unsigned int id) {
+  shard_t *shard = &g->shards[shard_index(g, id)];
+  size_t i = id / g->nshards;
+
+  return (i < shard->count) ? &shard->friends[i] : NULL;
+}
+
+/* Returns the friend set of user `id`, creating it if needed; the
+   user's shard must be write-locked: */
+static intset_t *ensure_user(graph_t *g, unsigned int id) {
+  shard_t *shard = &g->shards[shard_index(g, id)];
+  size_t i = id / g->nshards;
+
+  if (i >= shard->count) {
+    size_t count = shard->count ? shard->count : 16;
+    while (count <= i)
+      count *= 2;
+    shard->friends = realloc(shard->friends, count * sizeof(intset_t));
+    memset(shard->friends + shard->count, 0,
+           (count - shard->count) * sizeof(intset_t));
+    shard->versions = realloc(shard->versions,
+                              count * sizeof(unsigned long));
+    memset(shard->versions + shard->count, 0,
+           (count - shard->count) * sizeof(unsigned long));
+    shard->count = count;
+  }
+
+  return &shard->friends[i];
+}
+
+/* Returns the version of user `id`'s friend set; the user's shard
+   must be locked: */
+static unsigned long user_version(graph_t *g, unsigned int id) {
+  shard_t *shard = &g->shards[shard_index(g, id)];
+  size_t i = id / g->nshards;
+
+  return (i < shard->count) ? shard->versions[i] : 0;
+}
+
+/* Notes a change to the friend set of user `id`, which must exist;
+   the user's shard must be write-locked: */
+static void bump_version(graph_t *g, unsigned int id) {
+  g->shards[shard_index(g, id)].versions[id / g->nshards]++;
+}
+
+unsigned long graph_version(graph_t *g, const char *user) {
+  long id = symtab_lookup(g->names, user);
+  shard_t *shard;
+  unsigned long version;
+
+  if (id < 0)
+    return 0;
+
+  shard = &g->shards[shard_index(g, id)];
+  pthread_rwlock_rdlock(&shard->lock);
+  version = user_version(g, id);
+  pthread_rwlock_unlock(&shard->lock);
+
+  return version;
+}
+
+typedef struct {
+  unsigned int *ids;
+  size_t count;
+} id_copy_t;
+
+static void copy_id(unsigned int id, void *vc) {
+  id_copy_t *c = vc;
+  c->ids[c->count++] = id;
+}
+
+unsigned long graph_each_friend(graph_t *g, const char *user,
+                                friend_proc_t proc, void *data) {
+  long id = symtab_lookup(g->names, user);
+  shard_t *shard;
+  intset_t *friends;
+  id_copy_t c;
+  unsigned long version;
+  size_t i;
+
+  if (id < 0)
+    return 0;
+
+  /* Copy the IDs under the lock, and look up names after it: */
+  c.ids = NULL;
+  c.count = 0;
+  shard = &g->shards[shard_index(g, id)];
+  pthread_rwlock_rdlock(&shard->lock);
+  if ((friends = user_friends(g, id))) {
+    c.ids = malloc(friends->count * sizeof(unsigned int));
+    intset_each(friends, copy_id, &c);
+  }
+  version = user_version(g, id);
+  pthread_rwlock_unlock(&shard->lock);
+
+  for (i = 0; i < c.count; i++)
+    proc(symtab_name(g->names, c.ids[i]), data);
+  free(c.ids);
+
+  return version;
+}
+
+void graph_each_mutual(graph_t *g, const char *user, const char *other,
+                       friend_proc_t proc, void *data) {
+  long u = symtab_lookup(g->names, user);
+  long o = symtab_lookup(g->names, other);
+  intset_t *a, *b;
+  unsigned int *common = NULL;
+  size_t i, n = 0;
+  int sa, sb;
+
+  if ((u < 0) || (o < 0))
+    return;
+
+  sa = shard_index(g, u);
+  sb = shard_index(g, o);
+
+  lock_pair(g, sa, sb, 0);
+  if ((a = user_friends(g, u)) && (b = user_friends(g, o))) {
+    common = malloc(((a->count < b->count) ? a->count : b->count)
+                    * sizeof(unsigned int));
+    n = intset_intersect(a, b, common);
+  }
+  unlock_pair(g, sa, sb);
+
+  for (i = 0; i < n; i++)
+    proc(symtab_name(g->names, common[i]), data);
+
+  free(common);
+}
+
+/* A thread's state for graph_distance(), kept between searches. Each
+   side of a search has a bitmap of the users it has reached and a
+   queue of them in the order reached, where the current level is the
+   range [start, end). Only the words of the bitmaps that a search
+   touched are cleared afterward, so a search costs time in proportion
+   to what it reaches rather than to the size of the graph. */
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+typedef struct {
+  unsigned long *reached[2];
+  unsigned long *frontier;    /* the level being extended bottom-up */
+  unsigned int *queue[2];
+  size_t nusers;              /* users that the arrays have room for */
+} search_t;
+
+typedef struct {
+  unsigned int *queue;
+  size_t start, end, tail;
+  int depth;
+} side_t;
+
+/* A level is extended bottom-up once its frontier holds more than
+   1/BOTTOM_UP_FACTOR of the users that its side hasn't reached (the
+   switching point suggested for direction-optimizing BFS): */
+#define BOTTOM_UP_FACTOR 14
+
+static pthread_key_t search_key;
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+
+static void free_search(void *v) {
+  search_t *s = v;
+
+  free(s->reached[0]);
+  free(s->reached[1]);
+  free(s->frontier);
+  free(s->queue[0]);
+  free(s->queue[1]);
+  free(s);
+}
+
+static void make_search_key(void) {
+  pthread_key_create(&search_key, free_search);
+}
+
+static unsigned long *grow_bitmap(unsigned long *b, size_t from, size_t to) {
+  size_t old = (from + WORD_BITS - 1) / WORD_BITS;
+  size_t words = (to + WORD_BITS - 1) / WORD_BITS;
+
+  b = realloc(b, words * sizeof(unsigned long));
+  memset(b + old, 0, (words - old) * sizeof(unsigned long));
+  return b;
+}
+
+/* Returns this thread's search state, with room for `nusers` users: */
+static search_t *my_search(size_t nusers) {
+  search_t *s;
+  size_t n;
+  int i;
+
+  pthread_once(&search_once, make_search_key);
+  if (!(s = pthread_getspecific(search_key))) {
+    s = calloc(1, sizeof(search_t));
+    pthread_setspecific(search_key, s);
+  }
+
+  if (nusers > s->nusers) {
+    n = s->nusers ? s->nusers : 1024;
+    while (n < nusers)
+      n *= 2;
+    for (i = 0; i < 2; i++) {
+      s->reached[i] = grow_bitmap(s->reached[i], s->nusers, n);
+      s->queue[i] = realloc(s->queue[i], n * sizeof(unsigned int));
+    }
+    s->frontier = grow_bitmap(s->frontier, s->nusers, n);
+    s->nusers = n;
+  }
+
+  return s;
+}
+
+static int test_bit(const unsigned long *b, unsigned int id) {
+  return (b[id / WORD_BITS] >> (id % WORD_BITS)) & 1;
+}
+
+static void set_bit(unsigned long *b, unsigned int id) {
+  b[id / WORD_BITS] |= 1UL << (id % WORD_BITS);
+}
+
+/* Clears the words holding the bits of the `n` IDs at `ids`: */
+static void clear_bits(unsigned long *b, const unsigned int *ids, size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    b[ids[i] / WORD_BITS] = 0;
+}
+
+/* Extending one level of one side of a search: */
+typedef struct {
+  search_t *s;
+  side_t *side;
+  int x;                  /* which side */
+  unsigned int nusers;    /* IDs at or above this are left out */
+  unsigned long edges;
+} extend_t;
+
+/* Adds `id` to the side's next level if it is new, returning 1 if the
+   other side has reached it too: */
+static int reach(unsigned int id, void *ve) {
+  extend_t *e = ve;
+
+  e->edges++;
+  if ((id >= e->nusers) || test_bit(e->s->reached[e->x], id))
+    return 0;
+  set_bit(e->s->reached[e->x], id);
+  e->side->queue[e->side->tail++] = id;
+  return test_bit(e->s->reached[!e->x], id);
+}
+
+static int in_frontier(unsigned int id, void *ve) {
+  extend_t *e = ve;
+
+  e->edges++;
+  return (id < e->nusers) && test_bit(e->s->frontier, id);
+}
+
+/* Extends a level by visiting the friends of each user in it,
+   returning 1 if the two sides meet: */
+static int extend_top_down(graph_t *g, extend_t *e, graph_distance_t *r) {
+  side_t *side = e->side;
+  shard_t *shard;
+  intset_t *friends;
+  unsigned int id;
+  size_t i;
+  int met = 0;
+
+  for (i = side->start; (i < side->end) && !met; i++) {
+    id = side->queue[i];
+    shard = &g->shards[shard_index(g, id)];
+    pthread_rwlock_rdlock(&shard->lock);
+    if ((friends = user_friends(g, id)))
+      met = (intset_find(friends, reach, e) != INTSET_NONE);
+    pthread_rwlock_unlock(&shard->lock);
+    r->expanded++;
+  }
+
+  return met;
+}
+
+/* Extends a level by having each user that the side hasn't reached
+   look for a friend in the level, a shard at a time, returning 1 if
+   the two sides meet: */
+static int extend_bottom_up(graph_t *g, extend_t *e, graph_distance_t *r) {
+  side_t *side = e->side;
+  shard_t *shard;
+  unsigned int id;
+  size_t i;
+  int sh, met = 0;
+
+  for (i = side->start; i < side->end; i++)
+    set_bit(e->s->frontier, side->queue[i]);
+
+  for (sh = 0; (sh < g->nshards) && !met; sh++) {
+    shard = &g->shards[sh];
+    pthread_rwlock_rdlock(&shard->lock);
+    for (i = 0; (i < shard->count) && !met; i++) {
+      id = i * g->nshards + sh;
+      if (id >= e->nusers)
+        break;
+      if (test_bit(e->s->reached[e->x], id) || !shard->friends[i].count)
+        continue;
+      r->expanded++;
+      if (intset_find(&shard->friends[i], in_frontier, e) != INTSET_NONE) {
+        set_bit(e->s->reached[e->x], id);
+        side->queue[side->tail++] = id;
+        met = test_bit(e->s->reached[!e->x], id);
+      }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+  }
+
+  clear_bits(e->s->frontier, side->queue + side->start,
+             side->end - side->start);
+  return met;
+}
+
+void graph_distance(graph_t *g, const char *user, const char *other,
+                    int max, graph_distance_t *r) {
+  long u = symtab_lookup(g->names, user);
+  long o = symtab_lookup(g->names, other);
+  size_t nusers = symtab_count(g->names);
+  side_t sides[2];
+  extend_t e;
+  search_t *s;
+  int x, met = 0;
+
+  memset(r, 0, sizeof(graph_distance_t));
+  r->distance = -1;
+  if ((u < 0) || (o < 0))
+    return;
+  if (u == o) {
+    r->distance = 0;
+    return;
+  }
+
+  s = my_search(nusers);
+  for (x = 0; x < 2; x++) {
+    sides[x].queue = s->queue[x];
+    sides[x].queue[0] = (x ? o : u);
+    sides[x].start = 0;
+    sides[x].end = sides[x].tail = 1;
+    sides[x].depth = 0;
+    set_bit(s->reached[x], sides[x].queue[0]);
+  }
+
+  while (!met && (sides[0].depth + sides[1].depth < max)) {
+    size_t width[2];
+
+    width[0] = sides[0].end - sides[0].start;
+    width[1] = sides[1].end - sides[1].start;
+    x = (width[1] < width[0]);
+    if (!width[x])
+      break;   /* nothing left to reach on that side */
+
+    e.s = s;
+    e.side = &sides[x];
+    e.x = x;
+    e.nusers = nusers;
+    e.edges = 0;
+    if (width[x] * BOTTOM_UP_FACTOR > nusers - sides[x].tail) {
+      met = extend_bottom_up(g, &e, r);
+      r->bottom_up++;
+    } else
+      met = extend_top_down(g, &e, r);
+    r->edges += e.edges;
+    r->levels++;
+
+    sides[x].depth++;
+    sides[x].start = sides[x].end;
+    sides[x].end = sides[x].tail;
+  }
+
+  /* The sides met one friendship past the frontier that was being
+     extended, so the path is as long as the two depths now add up to */
+  if (met)
+    r->distance = sides[0].depth + sides[1].depth;
+
+  for (x = 0; x < 2; x++)
+    clear_bits(s->reached[x], sides[x].queue, sides[x].tail);
+}
+
+void graph_befriend(graph_t *g, const char *user, const char *friend) {
+  unsigned int u = symtab_intern(g->names, user);
+  unsigned int f = symtab_intern(g->names, friend);
+  int a = shard_index(g, u), b = shard_index(g, f);
+
+  lock_pair(g, a, b, 1);
+  if (intset_add(ensure_user(g, u), f))
+    bump_version(g, u);
+  if (intset_add(ensure_user(g, f), u))
+    bump_version(g, f);
+  if (g->log)
+    g->log(GRAPH_BEFRIEND, user, friend, g->log_data);
+  unlock_pair(g, a, b);
+}
+
+void graph_befriend_all(graph_t *g, const char *user,
+                        const char * const *friends, size_t n) {
+  unsigned int u = symtab_intern(g->names, user);
+  unsigned int *ids = malloc(n * sizeof(unsigned int));
+  char *locked = calloc(g->nshards, 1);
+  size_t i;
+  int s;
+
+  for (i = 0; i < n; i++) {
+    ids[i] = symtab_intern(g->names, friends[i]);
+    locked[shard_index(g, ids[i])] = 1;
+  }
+  locked[shard_index(g, u)] = 1;
+
+  /* Lock every shard involved, in index order like lock_pair() */
+  for (s = 0; s < g->nshards; s++)
+    if (locked[s])
+      pthread_rwlock_wrlock(&g->shards[s].lock);
+
+  for (i = 0; i < n; i++) {
+    if (intset_add(ensure_user(g, u), ids[i]))
+      bump_version(g, u);
+    if (intset_add(ensure_user(g, ids[i]), u))
+      bump_version(g, ids[i]);
+    if (g->log)
+      g->log(GRAPH_BEFRIEND, user, friends[i], g->log_data);
+  }
+
+  for (s = 0; s < g->nshards; s++)
+    if (locked[s])
+      pthread_rwlock_unlock(&g->shards[s].lock);
+
+  free(locked);
+  free(ids);
+}
+
+void graph_unfriend(graph_t *g, const char *user, const char *friend) {
+  long u = symtab_lookup(g->names, user);
+  long f = symtab_lookup(g->names, friend);
+  int a, b;
+  intset_t *friends;
+
+  if ((u < 0) || (f < 0))
+    return;
+
+  a = shard_index(g, u);
+  b = shard_index(g, f);
+
+  lock_pair(g, a, b, 1);
+  if ((friends = user_friends(g, u)) && intset_remove(friends, f))
+    bump_version(g, u);
+  if ((friends = user_friends(g, f)) && intset_remove(friends, u))
+    bump_version(g, f);
+  if (g->log)
+    g->log(GRAPH_UNFRIEND, user, friend, g->log_data);
+  unlock_pair(g, a, b);
+}
+
+void graph_set_log(graph_t *g, graph_log_proc_t proc, void *data) {
+  g->log = proc;
+  g->log_data = data;
+}
+
+typedef struct {
+  unsigned int *ids;
+  size_t count, alloc;
+  unsigned int limit;   /* IDs at or above this are left out */
+} id_list_t;
+
+static void add_id(unsigned int id, void *vl) {
+  id_list_t *l = vl;
+
+  if (id >= l->limit)
+    return;
+  if (l->count == l->alloc) {
+    l->alloc = 2 * (l->alloc + 8);
+    l->ids = realloc(l->ids, l->alloc * sizeof(unsigned int));
+  }
+  l->ids[l->count++] = id;
+}
+
+static int write_u32(FILE *f, unsigned int n) {
+  return (fwrite(&n, sizeof(n), 1, f) == 1) ? 0 : -1;
+}
+
+int graph_write_snapshot(graph_t *g, FILE *f) {
+  unsigned int n = symtab_count(g->names), id;
+  id_list_t l;
+  int result = 0;
+
+  /* Users interned after this point, and friendships with them, are
+     left out of the snapshot: */
+  l.ids = NULL;
+  l.count = l.alloc = 0;
+  l.limit = n;
+
+  if ((fwrite(SNAPSHOT_MAGIC, 8, 1, f) != 1) || write_u32(f, n))
+    return -1;
+
+  for (id = 0; id < n; id++) {
+    const char *name = symtab_name(g->names, id);
+    unsigned int len = strlen(name);
+    if (write_u32(f, len) || (fwrite(name, 1, len, f) != len))
+      return -1;
+  }
+
+  /* Copy each user's friends under the lock, but write them after
+     releasing it: */
+  for (id = 0; (id < n) && !result; id++) {
+    shard_t *shard = &g->shards[shard_index(g, id)];
+    intset_t *friends;
+
+    l.count = 0;
+    pthread_rwlock_rdlock(&shard->lock);
+    if ((friends = user_friends(g, id)))
+      intset_each(friends, add_id, &l);
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (write_u32(f, l.count)
+        || (fwrite(l.ids, sizeof(unsigned int), l.count, f) != l.count))
+      result = -1;
+  }
+
+  free(l.ids);
+  return result;
+}
+
+/* Reads a number from a snapshot, advancing `*pos`; returns -1 if
+   the snapshot ends first: */
+static int read_u32(const char *data, size_t len, size_t *pos,
+                    unsigned int *n) {
+  if (len - *pos < sizeof(unsigned int))
+    return -1;
+  memcpy(n, data + *pos, sizeof(unsigned int));
+  *pos += sizeof(unsigned int);
+  return 0;
+}
+
+int graph_read_snapshot(graph_t *g, const char *data, size_t len) {
+  size_t pos = 8, alloc = 0;
+  unsigned int n, id, count, i, friend;
+  char *name = NULL;
+  int result = -1;
+
+  if ((len < 8) || memcmp(data, SNAPSHOT_MAGIC, 8)
+      || read_u32(data, len, &pos, &n))
+    return -1;
+
+  for (id = 0; id < n; id++) {
+    if (read_u32(data, len, &pos, &count) || (len - pos < count))
+      goto done;
+    if (count + 1 > alloc) {
+      alloc = 2 * (count + 1);
+      name = realloc(name, alloc);
+    }
+    memcpy(name, data + pos, count);
+    name[count] = 0;
+    pos += count;
+
+    /* The graph is empty, so IDs are handed out in the same order: */
+    if (symtab_intern(g->names, name) != id)
+      goto done;
+  }
+
+  for (id = 0; id < n; id++) {
+    intset_t *friends;
+
+    if (read_u32(data, len, &pos, &count))
+      goto done;
+    friends = ensure_user(g, id);
+    for (i = 0; i < count; i++) {
+      if (read_u32(data, len, &pos, &friend) || (friend >= n))
+        goto done;
+      intset_add(friends, friend);
+    }
+  }
+
+  result = 0;
+ done:
+  free(name);
+  return result;
+}
@@ -0,0 +1,96 @@
+/* A friend graph maps each user name to the set of that user's
+   friends. Friendship is symmetric: befriending or unfriending
+   updates both users.
+
+   The graph is safe to use from multiple threads. Users are split
+   into shards, and each shard has its own reader-writer lock, so
+   lookups run in parallel and updates only contend when they touch
+   the same shards. */
+
+/* Opaque type for a graph instance: */
+typedef struct graph_t graph_t;
+
+/* Creates an empty graph with `nshards` shards (at least 1): */
+graph_t *make_graph(int nshards);
+
+/* Calls `proc` with each friend of `user` (none for an unknown
+   user). The friends are collected under the user's shard lock, but
+   `proc` is called after the lock is released, so it can take its
+   time (for example, to send each friend to a client). Friend
+   strings stay valid as long as the graph. Returns the version (see
+   graph_version()) of the friends that were passed to `proc`. */
+typedef void (*friend_proc_t)(const char *friend, void *data);
+unsigned long graph_each_friend(graph_t *g, const char *user,
+                                friend_proc_t proc, void *data);
+
+/* Returns the version of the friends of `user`, a number that
+   changes whenever they do, so that anything built from them can be
+   cached until then: */
+unsigned long graph_version(graph_t *g, const char *user);
+
+/* Calls `proc` with each user who is a friend of both `user` and
+   `other`, under the same conditions as graph_each_friend(): */
+void graph_each_mutual(graph_t *g, const char *user, const char *other,
+                       friend_proc_t proc, void *data);
+
+/* What graph_distance() found, and how much work it took: */
+typedef struct {
+  int distance;             /* friendships apart, or -1 */
+  unsigned long expanded;   /* users whose friends were examined */
+  unsigned long edges;      /* friendships examined */
+  int levels;               /* levels of the search expanded */
+  int bottom_up;            /* how many of them bottom-up */
+} graph_distance_t;
+
+/* Finds the fewest friendships that connect `user` to `other`, up to
+   `max`; the distance is -1 if either user is unknown or they are
+   further apart than that. The search runs from both users at once,
+   a level at a time, extending whichever side has the smaller
+   frontier. A frontier that covers a large part of the graph is
+   extended bottom-up: each user not yet reached looks for a friend
+   in the frontier, and stops at the first one, instead of the
+   frontier visiting all of its friends.
+
+   Each user's friends are read under that user's shard lock, so a
+   search doesn't hold up updates for long, but it may see some of
+   the changes made while it runs and not others. Each thread keeps
+   its search state between calls, so a search allocates nothing
+   unless the graph has grown. */
+void graph_distance(graph_t *g, const char *user, const char *other,
+                    int max, graph_distance_t *result);
+
+/* Makes `user` and `friend` friends of each other, creating either
+   user if needed: */
+void graph_befriend(graph_t *g, const char *user, const char *friend);
+
+/* Makes each of the `n` `friends` a friend of `user` in one update:
+   every shard involved stays locked until all of the friendships
+   are added, so other threads see all of them or none. */
+void graph_befriend_all(graph_t *g, const char *user,
+                        const char * const *friends, size_t n);
+
+/* Removes any friendship between `user` and `friend`: */
+void graph_unfriend(graph_t *g, const char *user, const char *friend);
+
+/* Kinds of change passed to a graph_log_proc_t: */
+#define GRAPH_BEFRIEND 1
+#define GRAPH_UNFRIEND 2
+
+/* Arranges for `proc` to be called with each befriend or unfriend
+   change to `g` while both users' shards are still write-locked, so
+   that the calls for any pair of users are in the same order as the
+   changes. `proc` must not use the graph. */
+typedef void (*graph_log_proc_t)(int change, const char *user,
+                                 const char *friend, void *data);
+void graph_set_log(graph_t *g, graph_log_proc_t proc, void *data);
+
+/* Writes a snapshot of `g` to `f`, returning 0 on success or -1 on
+   an I/O error. Users are read one at a time while the graph stays
+   in use, so changes made during the snapshot may or may not be
+   included; replaying those changes afterward fixes up the result. */
+int graph_write_snapshot(graph_t *g, FILE *f);
+
+/* Adds the friendships in the `len`-byte snapshot at `data` to `g`,
+   which must be empty and not yet used by other threads; returns 0
+   on success or -1 if the snapshot is malformed. */
+int graph_read_snapshot(graph_t *g, const char *data, size_t len);
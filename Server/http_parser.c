@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "http_parser.h"
+
+static int parse_line(http_request_t *req, const char *s, size_t len);
+static int parse_header(http_request_t *req, const char *s, size_t len);
+
+int view_equals(view_t v, const char *s) {
+  return (v.s
+          && (strlen(s) == v.len)
+          && !strncasecmp(v.s, s, v.len));
+}
+
+int view_starts_with(view_t v, const char *prefix) {
+  size_t len = strlen(prefix);
+
+  return (v.s
+          && (v.len >= len)
+          && !memcmp(v.s, prefix, len));
+}
+
+long view_to_long(view_t v) {
+  long n = 0;
+  size_t i;
+
+  if (!v.s || !v.len || !isdigit((unsigned char)v.s[0]))
+    return -1;
+
+  for (i = 0; (i < v.len) && isdigit((unsigned char)v.s[i]); i++) {
+    if (n > (LONG_MAX - 9) / 10)
+      return LONG_MAX;
+    n = n * 10 + (v.s[i] - '0');
+  }
+
+  return n;
+}
+
+void http_request_init(http_request_t *req) {
+  memset(req, 0, sizeof(http_request_t));
+}
+
+int http_parse(http_request_t *req, const char *buf, size_t len) {
+  const char *nl;
+
+  req->buf = buf;
+
+  while ((req->result == HTTP_PARSE_MORE)
+         && (nl = memchr(buf + req->pos, '\n', len - req->pos))) {
+    const char *s = buf + req->pos;
+    size_t n = nl + 1 - s;
+
+    if (!req->line.len)
+      req->result = parse_line(req, s, n);
+    else if ((n == 1) || ((n == 2) && (s[0] == '\r')))
+      req->result = HTTP_PARSE_DONE;
+    else
+      req->result = parse_header(req, s, n);
+
+    req->pos += n;
+  }
+
+  if ((req->result == HTTP_PARSE_MORE) && (len > HTTP_MAX_HEAD_BYTES))
+    req->result = HTTP_PARSE_TOO_LARGE;
+
+  return req->result;
+}
+
+/* Splits "method uri version\r\n" at its two spaces: */
+static int parse_line(http_request_t *req, const char *s, size_t len) {
+  const char *s1, *s2, *end;
+  size_t off = s - req->buf;
+
+  req->line.off = off;
+  req->line.len = len;
+
+  if ((len < 2) || (s[len-2] != '\r'))
+    return HTTP_PARSE_BAD;
+  end = s + len - 2;
+
+  if (!(s1 = memchr(s, ' ', end - s))
+      || !(s2 = memchr(s1 + 1, ' ', end - (s1 + 1)))
+      || memchr(s2 + 1, ' ', end - (s2 + 1)))
+    return HTTP_PARSE_BAD;
+
+  req->method.off = off;
+  req->method.len = s1 - s;
+  req->uri.off = off + (s1 + 1 - s);
+  req->uri.len = s2 - (s1 + 1);
+  req->version.off = off + (s2 + 1 - s);
+  req->version.len = end - (s2 + 1);
+
+  return HTTP_PARSE_MORE;
+}
+
+/* Records "name: value", ignoring lines without a colon: */
+static int parse_header(http_request_t *req, const char *s, size_t len) {
+  const char *colon = memchr(s, ':', len);
+  const char *v, *end = s + len;
+  size_t off = s - req->buf;
+
+  if (!colon)
+    return HTTP_PARSE_MORE;
+
+  if (req->nheaders == HTTP_MAX_HEADERS)
+    return HTTP_PARSE_TOO_LARGE;
+
+  /* skip leading whitespace and strip trailing whitespace */
+  for (v = colon + 1; (v < end) && isspace((unsigned char)*v); v++)
+    ;
+  while ((end > v) && isspace(((unsigned char *)end)[-1]))
+    --end;
+
+  req->names[req->nheaders].off = off;
+  req->names[req->nheaders].len = colon - s;
+  req->values[req->nheaders].off = off + (v - s);
+  req->values[req->nheaders].len = end - v;
+  req->nheaders++;
+
+  return HTTP_PARSE_MORE;
+}
+
+static view_t span_view(http_request_t *req, http_span_t span) {
+  view_t v;
+
+  v.s = req->buf + span.off;
+  v.len = span.len;
+
+  return v;
+}
+
+view_t http_line(http_request_t *req) {
+  return span_view(req, req->line);
+}
+
+view_t http_method(http_request_t *req) {
+  return span_view(req, req->method);
+}
+
+view_t http_uri(http_request_t *req) {
+  return span_view(req, req->uri);
+}
+
+view_t http_version(http_request_t *req) {
+  return span_view(req, req->version);
+}
+
+view_t http_header(http_request_t *req, const char *name) {
+  view_t v;
+  int i;
+
+  for (i = 0; i < req->nheaders; i++) {
+    if (view_equals(span_view(req, req->names[i]), name))
+      return span_view(req, req->values[i]);
+  }
+
+  v.s = NULL;
+  v.len = 0;
+  return v;
+}
+
+size_t http_content_length(http_request_t *req) {
+  long n = view_to_long(http_header(req, "Content-Length"));
+
+  return (n > 0 ? n : 0);
+}
@@ -0,0 +1,82 @@
+/* An incremental parser for the head (request line and headers) of
+   an HTTP request. The parser never copies or allocates: it records
+   where each part lies in the caller's buffer, and the caller sees
+   each part as a view (a pointer and a length) into that buffer.
+
+   Parsing is resumable. The caller can pass a buffer with only part
+   of a request, append more bytes as they arrive (moving the buffer
+   if needed), and call http_parse() again on the whole buffer; the
+   parser continues where it left off. */
+
+/* A view is a string that is not NUL-terminated: */
+typedef struct {
+  const char *s;
+  size_t len;
+} view_t;
+
+/* Returns 1 if `v` equals `s`, ignoring ASCII case: */
+int view_equals(view_t v, const char *s);
+
+/* Returns 1 if `v` starts with `prefix`: */
+int view_starts_with(view_t v, const char *prefix);
+
+/* Returns the decimal number at the start of `v`, or -1 if `v` does
+   not start with a digit: */
+long view_to_long(view_t v);
+
+/* Limits on the head of a request; a request over either limit is
+   rejected as too large: */
+#define HTTP_MAX_HEADERS    100
+#define HTTP_MAX_HEAD_BYTES 65536
+
+/* Limit on a request body that is collected in memory before it is
+   handled; a longer one is rejected (with 413) before any of it is
+   read. Bodies that are streamed as they arrive have no limit. */
+#define HTTP_MAX_BODY_BYTES (8 << 20)
+
+/* Results of http_parse(): */
+#define HTTP_PARSE_MORE       0   /* need more bytes */
+#define HTTP_PARSE_DONE       1   /* the head is complete */
+#define HTTP_PARSE_BAD       -1   /* the request line is malformed */
+#define HTTP_PARSE_TOO_LARGE -2   /* too many headers or bytes */
+
+/* Where a part lies in the buffer: */
+typedef struct {
+  size_t off, len;
+} http_span_t;
+
+typedef struct {
+  int result;                 /* most recent http_parse() result */
+  size_t pos;                 /* bytes consumed so far */
+  const char *buf;            /* most recently parsed buffer */
+  http_span_t line;           /* request line, including "\r\n" */
+  http_span_t method, uri, version;
+  int nheaders;
+  http_span_t names[HTTP_MAX_HEADERS], values[HTTP_MAX_HEADERS];
+} http_request_t;
+
+/* Prepares `req` to parse a new request: */
+void http_request_init(http_request_t *req);
+
+/* Parses the first `len` bytes of `buf`, which must start with the
+   bytes passed to any earlier calls for the same request, and
+   returns one of the HTTP_PARSE_... results. Once the result is
+   HTTP_PARSE_DONE, req->pos is the length of the head, so that any
+   body starts at buf + req->pos. Views returned by the functions
+   below point into `buf`, so after moving the buffer, call
+   http_parse() again to refresh them. */
+int http_parse(http_request_t *req, const char *buf, size_t len);
+
+/* Parts of a parsed request line: */
+view_t http_line(http_request_t *req);
+view_t http_method(http_request_t *req);
+view_t http_uri(http_request_t *req);
+view_t http_version(http_request_t *req);
+
+/* Returns the value of the first header named `name` (ignoring
+   case), with surrounding whitespace removed; the result has a NULL
+   `s` if there is no such header. */
+view_t http_header(http_request_t *req, const char *name);
+
+/* Returns the Content-Length of the request, or 0 if there is none: */
+size_t http_content_length(http_request_t *req);
@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "intset.h"
+
+#define SLOT_EMPTY 0xFFFFFFFFu
+
+/* Intersect by galloping through the longer array when it is at least
+   this many times longer than the shorter one: */
+#define GALLOP_RATIO 32
+
+#define IS_TABLE(s) ((s)->alloc > INTSET_SMALL)
+
+static size_t home_slot(const intset_t *s, unsigned int x);
+static size_t table_slot(const intset_t *s, unsigned int x);
+static void rebuild_table(intset_t *s, unsigned int alloc);
+static void table_to_array(intset_t *s);
+static const unsigned int *sorted_view(const intset_t *s);
+static void drop_view(intset_t *s);
+
+void intset_init(intset_t *s) {
+  memset(s, 0, sizeof(intset_t));
+}
+
+void intset_clear(intset_t *s) {
+  free(s->items);
+  free(s->sorted);
+  intset_init(s);
+}
+
+/* Returns the position of `x` in a sorted array, or the position
+   where `x` would be inserted: */
+static unsigned int array_find(const intset_t *s, unsigned int x) {
+  unsigned int lo = 0, hi = s->count;
+
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
+    if (s->items[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+int intset_add(intset_t *s, unsigned int x) {
+  if (!IS_TABLE(s)) {
+    unsigned int i = array_find(s, x);
+
+    if ((i < s->count) && (s->items[i] == x))
+      return 0;
+
+    if (s->count == s->alloc) {
+      if (s->alloc == INTSET_SMALL) {
+        /* Too big for an array; switch to a table: */
+        rebuild_table(s, 2 * INTSET_SMALL);
+        return intset_add(s, x);
+      }
+      s->alloc = (s->alloc ? 2 * s->alloc : 4);
+      s->items = realloc(s->items, s->alloc * sizeof(unsigned int));
+    }
+
+    memmove(s->items + i + 1, s->items + i,
+            (s->count - i) * sizeof(unsigned int));
+    s->items[i] = x;
+    s->count++;
+    return 1;
+  } else {
+    size_t i = table_slot(s, x);
+
+    if (s->items[i] == x)
+      return 0;
+    drop_view(s);
+
+    /* Keep the table at most 3/4 full: */
+    if ((s->count + 1) * 4 > s->alloc * 3) {
+      rebuild_table(s, 2 * s->alloc);
+      i = table_slot(s, x);
+    }
+
+    s->items[i] = x;
+    s->count++;
+    return 1;
+  }
+}
+
+int intset_remove(intset_t *s, unsigned int x) {
+  if (!IS_TABLE(s)) {
+    unsigned int i = array_find(s, x);
+
+    if ((i == s->count) || (s->items[i] != x))
+      return 0;
+
+    memmove(s->items + i, s->items + i + 1,
+            (s->count - i - 1) * sizeof(unsigned int));
+    s->count--;
+    return 1;
+  } else {
+    size_t mask = s->alloc - 1, i = table_slot(s, x), j, home;
+
+    if (s->items[i] != x)
+      return 0;
+    drop_view(s);
+
+    /* Shift later members of the probe run back into the hole, so
+       that the table needs no deletion markers: */
+    for (j = (i + 1) & mask; s->items[j] != SLOT_EMPTY; j = (j + 1) & mask) {
+      home = home_slot(s, s->items[j]);
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        s->items[i] = s->items[j];
+        i = j;
+      }
+    }
+    s->items[i] = SLOT_EMPTY;
+    s->count--;
+
+    if (s->count < INTSET_SMALL / 2)
+      table_to_array(s);
+    return 1;
+  }
+}
+
+int intset_contains(const intset_t *s, unsigned int x) {
+  if (!IS_TABLE(s)) {
+    unsigned int i = array_find(s, x);
+    return (i < s->count) && (s->items[i] == x);
+  } else
+    return s->items[table_slot(s, x)] == x;
+}
+
+void intset_each(const intset_t *s, intset_proc_t proc, void *data) {
+  unsigned int i;
+
+  if (!IS_TABLE(s)) {
+    for (i = 0; i < s->count; i++)
+      proc(s->items[i], data);
+  } else {
+    for (i = 0; i < s->alloc; i++) {
+      if (s->items[i] != SLOT_EMPTY)
+        proc(s->items[i], data);
+    }
+  }
+}
+
+unsigned int intset_find(const intset_t *s, intset_pred_t pred, void *data) {
+  unsigned int i;
+
+  if (!IS_TABLE(s)) {
+    for (i = 0; i < s->count; i++)
+      if (pred(s->items[i], data))
+        return s->items[i];
+  } else {
+    for (i = 0; i < s->alloc; i++) {
+      if ((s->items[i] != SLOT_EMPTY) && pred(s->items[i], data))
+        return s->items[i];
+    }
+  }
+
+  return INTSET_NONE;
+}
+
+size_t intset_intersect(const intset_t *a, const intset_t *b,
+                        unsigned int *out) {
+  const unsigned int *sa = IS_TABLE(a) ? sorted_view(a) : a->items;
+  const unsigned int *sb = IS_TABLE(b) ? sorted_view(b) : b->items;
+
+  /* Without memory for a view, probe the other set with each member
+     of the one that has no view: */
+  if (!sa || !sb) {
+    const intset_t *t = sa ? b : a, *o = sa ? a : b;
+    size_t n = 0;
+    unsigned int i;
+
+    for (i = 0; i < t->alloc; i++) {
+      if ((t->items[i] != SLOT_EMPTY) && intset_contains(o, t->items[i]))
+        out[n++] = t->items[i];
+    }
+    return n;
+  }
+
+  return intset_intersect_sorted(sa, a->count, sb, b->count, out);
+}
+
+/* Intersects a short array with a much longer one by searching for
+   each member of `a` in `b`, doubling the step from the previous
+   match before a binary search: */
+static size_t intersect_gallop(const unsigned int *a, size_t na,
+                               const unsigned int *b, size_t nb,
+                               unsigned int *out) {
+  size_t i, j = 0, n = 0, step, lo, hi;
+
+  for (i = 0; (i < na) && (j < nb); i++) {
+    for (step = 1, lo = j, hi = j; (hi < nb) && (b[hi] < a[i]); step *= 2) {
+      lo = hi + 1;
+      hi = j + step;
+    }
+    if (hi > nb)
+      hi = nb;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (b[mid] < a[i])
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    j = lo;
+    if ((j < nb) && (b[j] == a[i]))
+      out[n++] = b[j++];
+  }
+
+  return n;
+}
+
+size_t intset_intersect_sorted(const unsigned int *a, size_t na,
+                               const unsigned int *b, size_t nb,
+                               unsigned int *out) {
+  size_t i = 0, j = 0, n = 0;
+
+  if (na > nb)
+    return intset_intersect_sorted(b, nb, a, na, out);
+  if (nb / GALLOP_RATIO > na)
+    return intersect_gallop(a, na, b, nb, out);
+
+#ifdef __SSE2__
+  /* Compare four members of `a` against four of `b` at once, by
+     testing `a`'s block against every rotation of `b`'s block. The
+     block with the smaller maximum cannot match anything later in
+     the other array, so it is the one to advance. */
+  while ((i + 4 <= na) && (j + 4 <= nb)) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+    __m128i eq;
+    unsigned int a_max = a[i + 3], b_max = b[j + 3];
+    int mask;
+
+    eq = _mm_or_si128(
+           _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                        _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x39))),
+           _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x4E)),
+                        _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x93))));
+    mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+    while (mask) {
+      out[n++] = a[i + __builtin_ctz(mask)];
+      mask &= mask - 1;
+    }
+
+    if (a_max <= b_max)
+      i += 4;
+    if (b_max <= a_max)
+      j += 4;
+  }
+#endif
+
+  while ((i < na) && (j < nb)) {
+    if (a[i] < b[j])
+      i++;
+    else if (a[i] > b[j])
+      j++;
+    else {
+      out[n++] = a[i];
+      i++;
+      j++;
+    }
+  }
+
+  return n;
+}
+
+/* Returns the slot where the probe for `x` starts in a table. The
+   slot comes from the low bits of a well-mixed hash, so that members
+   copied out of one table in slot order land spread out over another
+   table, rather than piling up in one run: */
+static size_t home_slot(const intset_t *s, unsigned int x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35u;
+  x ^= x >> 16;
+  return x & (s->alloc - 1);
+}
+
+/* Returns the slot that holds `x` in a table, or else the empty slot
+   where `x` should go: */
+static size_t table_slot(const intset_t *s, unsigned int x) {
+  size_t mask = s->alloc - 1;
+  size_t i = home_slot(s, x);
+
+  while ((s->items[i] != SLOT_EMPTY) && (s->items[i] != x))
+    i = (i + 1) & mask;
+
+  return i;
+}
+
+/* Moves the members of `s` (an array or a table) into a new table
+   with `alloc` slots: */
+static void rebuild_table(intset_t *s, unsigned int alloc) {
+  unsigned int *old = s->items, old_alloc = s->alloc, i;
+  int was_table = IS_TABLE(s);
+
+  drop_view(s);
+  s->items = malloc(alloc * sizeof(unsigned int));
+  memset(s->items, 0xFF, alloc * sizeof(unsigned int));
+  s->alloc = alloc;
+
+  if (!was_table) {
+    for (i = 0; i < s->count; i++)
+      s->items[table_slot(s, old[i])] = old[i];
+  } else {
+    for (i = 0; i < old_alloc; i++) {
+      if (old[i] != SLOT_EMPTY)
+        s->items[table_slot(s, old[i])] = old[i];
+    }
+  }
+
+  free(old);
+}
+
+/* Sorts `n` IDs, none greater than `max`, by radix, a byte at a
+   time, using `tmp` (with room for `n` IDs) as scratch space. IDs
+   are interned in order, so high bytes are usually all zero and
+   need no pass. */
+static void radix_sort(unsigned int *ids, unsigned int *tmp, size_t n,
+                       unsigned int max) {
+  size_t count[256], i, pos, c;
+  unsigned int *from = ids, *to = tmp, *t;
+  int shift;
+
+  for (shift = 0; (shift < 32) && (max >> shift); shift += 8) {
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+      count[(from[i] >> shift) & 0xFF]++;
+    for (i = 0, pos = 0; i < 256; i++) {
+      c = count[i];
+      count[i] = pos;
+      pos += c;
+    }
+    for (i = 0; i < n; i++)
+      to[count[(from[i] >> shift) & 0xFF]++] = from[i];
+    t = from; from = to; to = t;
+  }
+
+  if (from != ids)
+    memcpy(ids, from, n * sizeof(unsigned int));
+}
+
+/* Returns the members of a table in increasing order, or NULL if
+   there is no memory for them. The sorted members are kept until the
+   set next changes. Readers that share a set (under a read lock, say)
+   may all call this at once: each builds a view if there is none, and
+   the first one to publish its view wins. Only a change, which can't
+   overlap a reader, frees a view. */
+static const unsigned int *sorted_view(const intset_t *s) {
+  unsigned int *view = __atomic_load_n(&s->sorted, __ATOMIC_ACQUIRE);
+  unsigned int *tmp, *expected = NULL;
+  unsigned int i, n = 0, max = 0;
+
+  if (view)
+    return view;
+
+  view = malloc(s->count * sizeof(unsigned int));
+  tmp = malloc(s->count * sizeof(unsigned int));
+  if (!view || !tmp) {
+    free(view);
+    free(tmp);
+    return NULL;
+  }
+  for (i = 0; i < s->alloc; i++) {
+    if (s->items[i] != SLOT_EMPTY) {
+      view[n++] = s->items[i];
+      if (s->items[i] > max)
+        max = s->items[i];
+    }
+  }
+  radix_sort(view, tmp, n, max);
+  free(tmp);
+
+  if (!__atomic_compare_exchange_n(&((intset_t *)s)->sorted, &expected, view,
+                                   0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(view);
+    view = expected;
+  }
+  return view;
+}
+
+/* Forgets a set's sorted view when the set changes: */
+static void drop_view(intset_t *s) {
+  free(s->sorted);
+  s->sorted = NULL;
+}
+
+static int compare_ids(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+  return (x > y) - (x < y);
+}
+
+/* Turns a table that has become small back into a sorted array: */
+static void table_to_array(intset_t *s) {
+  unsigned int *items = malloc(INTSET_SMALL / 2 * sizeof(unsigned int));
+  unsigned int i, n = 0;
+
+  for (i = 0; i < s->alloc; i++) {
+    if (s->items[i] != SLOT_EMPTY)
+      items[n++] = s->items[i];
+  }
+  qsort(items, n, sizeof(unsigned int), compare_ids);
+
+  drop_view(s);
+  free(s->items);
+  s->items = items;
+  s->alloc = INTSET_SMALL / 2;
+}
@@ -0,0 +1,62 @@
+/* An integer set holds distinct 32-bit IDs (any value except
+   0xFFFFFFFF) compactly. A small set is a sorted array; once it grows
+   past INTSET_SMALL members it becomes an open-addressing hash table
+   (linear probing), and it shrinks back to a sorted array when it
+   falls well below that size. Either way, a member costs 4 to 8
+   bytes. A table that is intersected also keeps its members sorted,
+   at 4 bytes more per member, until it next changes.
+
+   An integer set is not thread-safe, except that any number of
+   threads may read the same sets at once (including with
+   intset_intersect()) as long as none changes them. */
+
+#define INTSET_SMALL 64
+
+/* A zero-filled intset_t is an empty set: */
+typedef struct {
+  unsigned int count;   /* number of members */
+  unsigned int alloc;   /* capacity of `items`; a table if > INTSET_SMALL */
+  unsigned int *items;  /* sorted members, or hash table slots */
+  unsigned int *sorted; /* a table's sorted members, or NULL */
+} intset_t;
+
+/* Makes `s` an empty set: */
+void intset_init(intset_t *s);
+
+/* Frees the members of `s`, leaving it empty: */
+void intset_clear(intset_t *s);
+
+/* Adds `x` to `s`, returning 1 if it was not already a member: */
+int intset_add(intset_t *s, unsigned int x);
+
+/* Removes `x` from `s`, returning 1 if it was a member: */
+int intset_remove(intset_t *s, unsigned int x);
+
+/* Returns 1 if `x` is a member of `s`: */
+int intset_contains(const intset_t *s, unsigned int x);
+
+/* Calls `proc` with each member of `s`, in increasing order if the
+   set is small and in no particular order otherwise: */
+typedef void (*intset_proc_t)(unsigned int x, void *data);
+void intset_each(const intset_t *s, intset_proc_t proc, void *data);
+
+/* Returns the first member of `s` (in the order of intset_each())
+   for which `pred` returns nonzero, without looking further, or
+   INTSET_NONE if there is none: */
+#define INTSET_NONE 0xFFFFFFFFu
+typedef int (*intset_pred_t)(unsigned int x, void *data);
+unsigned int intset_find(const intset_t *s, intset_pred_t pred, void *data);
+
+/* Stores the members common to `a` and `b` in `out`, which must have
+   room for the smaller set, in increasing order, and returns how many
+   there are. The first intersection of a table after it changes sorts
+   its members, and later ones reuse them. */
+size_t intset_intersect(const intset_t *a, const intset_t *b,
+                        unsigned int *out);
+
+/* Stores the IDs common to the sorted arrays `a` and `b` in `out`,
+   which must have room for the shorter array, in increasing order,
+   and returns how many there are: */
+size_t intset_intersect_sorted(const unsigned int *a, size_t na,
+                               const unsigned int *b, size_t nb,
+                               unsigned int *out);
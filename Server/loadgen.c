@@ -0,0 +1,710 @@
+/*
+ * loadgen.c - a load generator for friendlist that reports
+ *   throughput and latency percentiles.
+ *
+ * Usage: loadgen [options] <host> <port>
+ *
+ *   -t <n>      threads (default 4)
+ *   -c <n>      keep-alive connections, spread over the threads
+ *               (default 16); each has one request outstanding
+ *   -d <secs>   how long to run (default 10)
+ *   -r <n>      open loop: start <n> requests per second in total,
+ *               whether or not earlier ones have finished; without
+ *               -r, each connection sends its next request as soon
+ *               as the last one finishes (closed loop)
+ *   -m <mix>    relative weights of the routes, such as
+ *               "friends=70,befriend=10,unfriend=10,sum=10"; routes
+ *               left out get no requests (the default leaves out
+ *               /sum, which the server answers after 10 seconds)
+ *   -u <n>      users to befriend and unfriend (default 4)
+ *   -f <n>      friends per /befriend or /unfriend (default 100)
+ *   -j <n>      up to this many junk headers per request (default 5)
+ *   -e <usecs>  closed loop: the interval expected between requests,
+ *               for coordinated-omission correction (default: the
+ *               mean latency)
+ *
+ * Like stress.rkt, requests use the user names "%%one%%" and
+ * "\">two?" (then "u2", "u3", ...), friend names like
+ * "f[0,1,2,3]**********", and random "x-junk-<i>: garbage" headers.
+ *
+ * Requests that the server turns away with a 503 are reported as
+ * "shed" rather than as errors, and their latency is not recorded.
+ *
+ * Latency and coordinated omission: a closed-loop client that waits
+ * on a slow response doesn't send the requests it would have sent
+ * meanwhile, so the stall shows up as one slow sample instead of
+ * many. In open-loop mode, each request has an intended start time
+ * on a fixed schedule, and its latency is measured from that time,
+ * so time spent waiting for a free connection counts. In closed-loop
+ * mode, the "corrected" row back-fills the samples that a stall
+ * hid, assuming requests were meant to go out every -e microseconds
+ * on each connection (as HdrHistogram does).
+ */
+#define _GNU_SOURCE   /* for ppoll() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+enum { FRIENDS, BEFRIEND, UNFRIEND, SUM, ROUTES };
+static const char *route_names[ROUTES] = {
+  "friends", "befriend", "unfriend", "sum"
+};
+
+/* Latency histogram, in microseconds, with 32 buckets per power of
+   two (so within about 3%), up to 2^36 us: */
+#define SUB_BITS 5
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS ((37 - SUB_BITS) * SUB_BUCKETS)
+#define MAX_VALUE ((1UL << 36) - 1)
+
+typedef struct {
+  unsigned long buckets[BUCKETS];
+  unsigned long count, max;
+  double total;
+} hist_t;
+
+#define IN_INITIAL 16384
+
+typedef struct {
+  int fd;
+  int busy;               /* whether a request is outstanding */
+  int batch;              /* friend lists befriended so far */
+  int route;
+  long intended;          /* when the request should have started */
+
+  char *out;
+  size_t out_len, out_pos, out_alloc;
+
+  char *in;
+  size_t in_len, in_alloc;
+  size_t body_start;      /* 0 until the response head is complete */
+  long content_length;    /* -1 if chunked */
+  size_t chunk_pos;       /* next chunk-size line of a chunked body */
+  int status, close;
+} lconn_t;
+
+typedef struct {
+  int id;
+  pthread_t th;
+  int nconns;
+  lconn_t *conns;
+  double interval;        /* open loop: ns between requests, else 0 */
+  long next;              /* open loop: next intended start */
+  unsigned int seed;
+  hist_t hist[ROUTES];
+  unsigned long errors;
+  unsigned long shed;       /* requests turned away with a 503 */
+  unsigned long unfinished; /* requests outstanding at the end */
+  unsigned long scheduled; /* open loop: requests scheduled so far */
+} worker_t;
+
+/* Settings: */
+static const char *host, *port;
+static int nthreads = 4, nconns = 16, duration = 10, nusers = 4;
+static int nfriends = 100, max_junk = 5;
+static double rate;
+static long expected_us;
+static int weights[ROUTES] = { 80, 10, 10, 0 };
+static int total_weight;
+
+static long start_ns, end_ns;
+
+static long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int bucket_index(unsigned long v)
+{
+  int m;
+
+  if (v > MAX_VALUE)
+    v = MAX_VALUE;
+  if (v < SUB_BUCKETS)
+    return v;
+  m = 63 - __builtin_clzl(v);
+  return (m - SUB_BITS + 1) * SUB_BUCKETS
+         + ((v >> (m - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* The largest value that lands in bucket `i`: */
+static unsigned long bucket_top(int i)
+{
+  int m = i / SUB_BUCKETS + SUB_BITS - 1;
+  unsigned long next = SUB_BUCKETS + i % SUB_BUCKETS + 1;
+
+  if (i < SUB_BUCKETS)
+    return i;
+  return (next << (m - SUB_BITS)) - 1;
+}
+
+static void hist_add(hist_t *h, unsigned long v, unsigned long n)
+{
+  h->buckets[bucket_index(v)] += n;
+  h->count += n;
+  h->total += (double)v * n;
+  if (v > h->max)
+    h->max = v;
+}
+
+static void hist_merge(hist_t *to, hist_t *from)
+{
+  int i;
+
+  for (i = 0; i < BUCKETS; i++)
+    to->buckets[i] += from->buckets[i];
+  to->count += from->count;
+  to->total += from->total;
+  if (from->max > to->max)
+    to->max = from->max;
+}
+
+static unsigned long hist_percentile(hist_t *h, double fraction)
+{
+  unsigned long want = (unsigned long)(fraction * h->count + 0.5), seen = 0;
+  int i;
+
+  if (!want)
+    want = 1;
+  for (i = 0; i < BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= want)
+      return (bucket_top(i) < h->max) ? bucket_top(i) : h->max;
+  }
+  return h->max;
+}
+
+/* Adds the samples that a closed-loop client would have taken while
+   each recorded request stalled it, if it meant to start a request
+   every `interval` us: */
+static void hist_correct(hist_t *to, hist_t *from, unsigned long interval)
+{
+  unsigned long v, missing;
+  int i;
+
+  hist_merge(to, from);
+  if (!interval)
+    return;
+  for (i = 0; i < BUCKETS; i++) {
+    if (!from->buckets[i])
+      continue;
+    v = bucket_top(i);
+    if (v > from->max)
+      v = from->max;
+    for (missing = v; missing > interval; ) {
+      missing -= interval;
+      hist_add(to, missing, from->buckets[i]);
+    }
+  }
+}
+
+/* Percent-encodes every byte but letters and digits: */
+static size_t encode(char *dest, const char *s)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  size_t n = 0;
+
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z'))
+        || ((c >= '0') && (c <= '9')))
+      dest[n++] = c;
+    else {
+      dest[n++] = '%';
+      dest[n++] = hex[c >> 4];
+      dest[n++] = hex[c & 0xF];
+    }
+  }
+  dest[n] = 0;
+  return n;
+}
+
+static const char *user_name(int j, char *buf)
+{
+  if (j == 0)
+    return "%%one%%";
+  if (j == 1)
+    return "\">two?";
+  sprintf(buf, "u%d", j);
+  return buf;
+}
+
+static void out_reserve(lconn_t *c, size_t more)
+{
+  if (c->out_len + more > c->out_alloc) {
+    c->out_alloc = 2 * (c->out_len + more);
+    c->out = realloc(c->out, c->out_alloc);
+  }
+}
+
+static void out_add(lconn_t *c, const char *s, size_t len)
+{
+  out_reserve(c, len);
+  memcpy(c->out + c->out_len, s, len);
+  c->out_len += len;
+}
+
+static void out_str(lconn_t *c, const char *s)
+{
+  out_add(c, s, strlen(s));
+}
+
+static int pick_route(worker_t *w)
+{
+  int r, x = rand_r(&w->seed) % total_weight;
+
+  for (r = 0; r < ROUTES; r++) {
+    if (x < weights[r])
+      return r;
+    x -= weights[r];
+  }
+  return FRIENDS;
+}
+
+/* Writes the next request for `c` into its output buffer: */
+static void build_request(worker_t *w, lconn_t *c)
+{
+  char name[64], enc[3 * 64], line[256], *body = NULL;
+  size_t body_len = 0;
+  int i, junk, batch;
+
+  c->out_len = c->out_pos = 0;
+  c->route = pick_route(w);
+  encode(enc, user_name(rand_r(&w->seed) % nusers, name));
+
+  switch (c->route) {
+  case FRIENDS:
+    out_str(c, "GET /friends?user=");
+    out_str(c, enc);
+    break;
+  case SUM:
+    sprintf(line, "GET /sum?x=%d&y=%d", rand_r(&w->seed) % 1000,
+            rand_r(&w->seed) % 1000);
+    out_str(c, line);
+    break;
+  default:
+    /* /unfriend removes the list that this connection befriended
+       last, and /befriend adds a new one */
+    batch = (c->route == BEFRIEND) ? c->batch++ : c->batch - 1;
+    body = malloc(nfriends * 3 * 64 + 16);
+    body_len = sprintf(body, "friends=");
+    for (i = 0; i < nfriends; i++) {
+      sprintf(name, "f[%d,%ld,%d,%d]**********", w->id,
+              (long)(c - w->conns), batch, i);
+      body_len += encode(body + body_len, name);
+      if (i + 1 < nfriends)
+        body_len += encode(body + body_len, "\n");
+    }
+    out_str(c, (c->route == BEFRIEND) ? "POST /befriend?user="
+                                      : "POST /unfriend?user=");
+    out_str(c, enc);
+  }
+
+  sprintf(line, " HTTP/1.1\r\nHost: %s:%s\r\n", host, port);
+  out_str(c, line);
+  junk = max_junk ? rand_r(&w->seed) % (max_junk + 1) : 0;
+  for (i = 0; i < junk; i++) {
+    sprintf(line, "x-junk-%d: garbage\r\n", i);
+    out_str(c, line);
+  }
+  if (body) {
+    sprintf(line, "Content-Type: application/x-www-form-urlencoded\r\n"
+            "Content-Length: %lu\r\n", (unsigned long)body_len);
+    out_str(c, line);
+  }
+  out_str(c, "\r\n");
+  if (body) {
+    out_add(c, body, body_len);
+    free(body);
+  }
+}
+
+static int open_conn(void)
+{
+  struct addrinfo hints, *addrs, *a;
+  int fd = -1, on = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if (getaddrinfo(host, port, &hints, &addrs))
+    return -1;
+  for (a = addrs; a; a = a->ai_next) {
+    if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+      continue;
+    if (!connect(fd, a->ai_addr, a->ai_addrlen))
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+
+  if (fd >= 0) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  }
+  return fd;
+}
+
+static void reset_response(lconn_t *c)
+{
+  c->in_len = 0;
+  c->body_start = 0;
+  c->content_length = 0;
+  c->chunk_pos = 0;
+  c->status = 0;
+  c->close = 0;
+}
+
+/* Starts the request that should have started at `intended`: */
+static void start_request(worker_t *w, lconn_t *c, long intended)
+{
+  build_request(w, c);
+  reset_response(c);
+  c->intended = intended;
+  c->busy = 1;
+}
+
+/* Returns 1 if the header `line` is named `name`, with a value that
+   starts with `value` (if not NULL): */
+static int header_is(const char *line, const char *name, const char *value)
+{
+  size_t len = strlen(name);
+
+  if (strncasecmp(line, name, len))
+    return 0;
+  for (line += len; *line == ' '; line++)
+    ;
+  return !value || !strncasecmp(line, value, strlen(value));
+}
+
+/* Returns 1 once the whole response is in, 0 if more is needed, or
+   -1 if it's malformed: */
+static int response_done(lconn_t *c)
+{
+  char *end, *line, *nl;
+  long n;
+
+  if (!c->body_start) {
+    c->in[c->in_len] = 0;
+    if (!(end = strstr(c->in, "\r\n\r\n")))
+      return 0;
+    if (strncmp(c->in, "HTTP/1.", 7))
+      return -1;
+    c->status = atoi(c->in + 9);
+    for (line = strstr(c->in, "\r\n") + 2; line < end; line = nl + 2) {
+      nl = strstr(line, "\r\n");
+      if (header_is(line, "Content-length:", NULL))
+        c->content_length = atol(strchr(line, ':') + 1);
+      else if (header_is(line, "Transfer-Encoding:", "chunked"))
+        c->content_length = -1;
+      else if (header_is(line, "Connection:", "close"))
+        c->close = 1;
+    }
+    c->body_start = c->chunk_pos = end + 4 - c->in;
+  }
+
+  if (c->content_length >= 0)
+    return (c->in_len >= c->body_start + c->content_length);
+
+  while (1) {
+    c->in[c->in_len] = 0;
+    if (!(nl = strstr(c->in + c->chunk_pos, "\r\n")))
+      return 0;
+    n = strtol(c->in + c->chunk_pos, NULL, 16);
+    if (n < 0)
+      return -1;
+    if (c->in_len < (size_t)(nl + 2 - c->in) + n + 2)
+      return 0;
+    c->chunk_pos = nl + 2 - c->in + n + 2;
+    if (!n)
+      return 1;
+  }
+}
+
+/* Replaces a connection after an error: */
+static void reconnect(worker_t *w, lconn_t *c)
+{
+  if (c->fd >= 0)
+    close(c->fd);
+  c->fd = open_conn();
+  c->busy = 0;
+  if (c->fd < 0)
+    w->errors++;
+}
+
+/* Reads what's available, finishing the request if it's all in;
+   returns 0 if the connection failed: */
+static int conn_read(worker_t *w, lconn_t *c, long now)
+{
+  ssize_t n;
+  int done, eof = 0;
+
+  while (!eof) {
+    if (c->in_len + 1 >= c->in_alloc) {
+      c->in_alloc *= 2;
+      c->in = realloc(c->in, c->in_alloc);
+    }
+    n = read(c->fd, c->in + c->in_len, c->in_alloc - c->in_len - 1);
+    if (n > 0)
+      c->in_len += n;
+    else if ((n < 0) && (errno == EINTR))
+      continue;
+    else if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      break;
+    else
+      eof = 1;
+  }
+
+  /* The server may close the connection right after a response */
+  if (!(done = response_done(c)))
+    return !eof;
+  if ((done > 0) && (c->status == 503))
+    w->shed++;
+  else if ((done < 0) || (c->status != 200))
+    w->errors++;
+  else
+    hist_add(&w->hist[c->route], (now - c->intended) / 1000, 1);
+
+  c->busy = 0;
+  return (done > 0) && !c->close && !eof;
+}
+
+static void conn_write(lconn_t *c)
+{
+  ssize_t n;
+
+  while (c->out_pos < c->out_len) {
+    n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+    if (n < 0)
+      return;
+    c->out_pos += n;
+  }
+}
+
+static void *run_worker(void *vw)
+{
+  worker_t *w = vw;
+  struct pollfd *pfds = malloc(w->nconns * sizeof(struct pollfd));
+  struct timespec wait;
+  long now, until;
+  int i;
+
+  for (i = 0; i < w->nconns; i++) {
+    lconn_t *c = &w->conns[i];
+    c->fd = -1;
+    c->in_alloc = IN_INITIAL;
+    c->in = malloc(c->in_alloc);
+    reconnect(w, c);
+  }
+  w->next = start_ns;
+
+  while ((now = now_ns()) < end_ns) {
+    /* Start requests on idle connections */
+    for (i = 0; i < w->nconns; i++) {
+      lconn_t *c = &w->conns[i];
+      if (c->busy || (c->fd < 0))
+        continue;
+      if (!w->interval)
+        start_request(w, c, now);
+      else if (w->next <= now) {
+        start_request(w, c, w->next);
+        w->next = start_ns + (long)(++w->scheduled * w->interval);
+      } else
+        break;
+      conn_write(c);
+    }
+
+    for (i = 0; i < w->nconns; i++) {
+      lconn_t *c = &w->conns[i];
+      pfds[i].fd = c->busy ? c->fd : -1;
+      pfds[i].events = POLLIN
+                       | ((c->out_pos < c->out_len) ? POLLOUT : 0);
+      pfds[i].revents = 0;
+    }
+
+    /* Wake up for the next scheduled request, or now and then to
+       check the time */
+    until = now + 10000000;
+    if (w->interval && (w->next > now) && (w->next < until))
+      until = w->next;
+    wait.tv_sec = (until - now) / 1000000000;
+    wait.tv_nsec = (until - now) % 1000000000;
+    if (ppoll(pfds, w->nconns, &wait, NULL) <= 0)
+      continue;
+
+    now = now_ns();
+    for (i = 0; i < w->nconns; i++) {
+      lconn_t *c = &w->conns[i];
+      if (pfds[i].revents & POLLOUT)
+        conn_write(c);
+      if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+          && !conn_read(w, c, now)) {
+        if (c->busy)
+          w->errors++;
+        reconnect(w, c);
+      }
+    }
+  }
+
+  /* The open-loop schedule may also have run ahead of the requests */
+  for (i = 0; i < w->nconns; i++)
+    w->unfinished += w->conns[i].busy;
+  while (w->interval && (w->next < end_ns)) {
+    w->unfinished++;
+    w->next = start_ns + (long)(++w->scheduled * w->interval);
+  }
+
+  for (i = 0; i < w->nconns; i++) {
+    if (w->conns[i].fd >= 0)
+      close(w->conns[i].fd);
+    free(w->conns[i].in);
+    free(w->conns[i].out);
+  }
+  free(pfds);
+  return NULL;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-t <threads>] [-c <conns>] [-d <secs>]"
+          " [-r <reqs/sec>]\n"
+          "          [-m friends=<w>,befriend=<w>,unfriend=<w>,sum=<w>]\n"
+          "          [-u <users>] [-f <friends>] [-j <junk headers>]"
+          " [-e <usecs>]\n"
+          "          <host> <port>\n", prog);
+  exit(1);
+}
+
+static void parse_mix(const char *prog, char *mix)
+{
+  char *item, *eq;
+  int r;
+
+  memset(weights, 0, sizeof(weights));
+  for (item = strtok(mix, ","); item; item = strtok(NULL, ",")) {
+    if (!(eq = strchr(item, '=')))
+      usage(prog);
+    *eq = 0;
+    for (r = 0; r < ROUTES; r++)
+      if (!strcmp(item, route_names[r]))
+        break;
+    if ((r == ROUTES) || ((weights[r] = atoi(eq + 1)) < 0))
+      usage(prog);
+  }
+}
+
+static void print_row(const char *name, hist_t *h)
+{
+  if (!h->count) {
+    printf("  %-22s %9lu\n", name, 0UL);
+    return;
+  }
+  printf("  %-22s %9lu %8.0f %8lu %8lu %8lu %8lu %8lu\n", name, h->count,
+         h->total / h->count, hist_percentile(h, 0.5),
+         hist_percentile(h, 0.9), hist_percentile(h, 0.99),
+         hist_percentile(h, 0.999), h->max);
+}
+
+int main(int argc, char **argv)
+{
+  worker_t *workers;
+  hist_t *all = calloc(1, sizeof(hist_t)), *corrected, *routes;
+  unsigned long errors = 0, shed = 0, unfinished = 0, interval;
+  double secs;
+  char label[64];
+  int opt, i, r, c;
+
+  while ((opt = getopt(argc, argv, "t:c:d:r:m:u:f:j:e:")) != -1) {
+    switch (opt) {
+    case 't': nthreads = atoi(optarg); break;
+    case 'c': nconns = atoi(optarg); break;
+    case 'd': duration = atoi(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'm': parse_mix(argv[0], optarg); break;
+    case 'u': nusers = atoi(optarg); break;
+    case 'f': nfriends = atoi(optarg); break;
+    case 'j': max_junk = atoi(optarg); break;
+    case 'e': expected_us = atol(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  for (r = 0; r < ROUTES; r++)
+    total_weight += weights[r];
+  if ((argc - optind != 2) || (nthreads < 1) || (nconns < 1)
+      || (duration < 1) || (rate < 0) || (nusers < 1) || (nfriends < 1)
+      || (max_junk < 0) || (total_weight < 1))
+    usage(argv[0]);
+  host = argv[optind];
+  port = argv[optind + 1];
+  if (nthreads > nconns)
+    nthreads = nconns;
+
+  start_ns = now_ns();
+  end_ns = start_ns + duration * 1000000000L;
+
+  workers = calloc(nthreads, sizeof(worker_t));
+  for (i = c = 0; i < nthreads; i++) {
+    worker_t *w = &workers[i];
+    w->id = i;
+    w->nconns = nconns / nthreads + (i < nconns % nthreads);
+    w->conns = calloc(w->nconns, sizeof(lconn_t));
+    w->interval = rate ? 1e9 * nthreads / rate : 0;
+    w->seed = 12345 + i;
+    c += w->nconns;
+    pthread_create(&w->th, NULL, run_worker, w);
+  }
+
+  routes = calloc(ROUTES, sizeof(hist_t));
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(workers[i].th, NULL);
+    for (r = 0; r < ROUTES; r++)
+      hist_merge(&routes[r], &workers[i].hist[r]);
+    errors += workers[i].errors;
+    shed += workers[i].shed;
+    unfinished += workers[i].unfinished;
+  }
+  secs = (now_ns() - start_ns) / 1e9;
+  for (r = 0; r < ROUTES; r++)
+    hist_merge(all, &routes[r]);
+
+  if (rate)
+    printf("open loop at %.0f requests/s, %d connections, %d threads,"
+           " %.1f s\n", rate, c, nthreads, secs);
+  else
+    printf("closed loop, %d connections, %d threads, %.1f s\n",
+           c, nthreads, secs);
+  printf("requests: %lu (%.1f/s), errors: %lu, shed: %lu, unfinished: %lu\n",
+         all->count, all->count / secs, errors, shed, unfinished);
+  printf("  %-22s %9s %8s %8s %8s %8s %8s %8s  (usec)\n", "", "count",
+         "mean", "p50", "p90", "p99", "p99.9", "max");
+  for (r = 0; r < ROUTES; r++) {
+    sprintf(label, "/%s", route_names[r]);
+    if (weights[r])
+      print_row(label, &routes[r]);
+  }
+  print_row("all", all);
+
+  if (!rate && all->count) {
+    interval = expected_us ? expected_us : (unsigned long)(all->total / all->count);
+    corrected = calloc(1, sizeof(hist_t));
+    hist_correct(corrected, all, interval);
+    sprintf(label, "all, corrected (%lu)", interval);
+    print_row(label, corrected);
+  }
+
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "log.h"
+
+/* Bytes in each thread's ring, enough for a few of the longest
+   messages: */
+#define LOG_RING 16384
+
+/* Bytes that the writer drains from the rings for each write, enough
+   for a few of the longest messages, plus a drop notice: */
+#define LOG_OUT 65536
+#define NOTICE_MAX 64
+
+/* How long the writer sleeps when every ring is empty: */
+#define IDLE_NSEC 10000000
+
+int log_level = LOG_INFO;
+
+/* A thread's ring of messages, each stored as a 2-byte length and the
+   text. `head` and `tail` count bytes ever read and written, so the
+   ring holds `tail - head` bytes. Only the owning thread writes
+   `tail` and `dropped`, and only the writer thread writes `head`;
+   they're on separate cache lines so neither side's writes slow the
+   other's reads. */
+typedef struct ring_t {
+  struct ring_t *next;      /* guarded by rings_lock */
+  int closed;               /* set once the owning thread exits, with
+                               messages still to drain */
+  size_t tail __attribute__((aligned(64)));
+  unsigned long dropped;
+  size_t head __attribute__((aligned(64)));
+  unsigned long reported;   /* drops that the writer has reported */
+  char buf[LOG_RING] __attribute__((aligned(64)));
+} ring_t;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ring_t *rings;
+static unsigned long retired_drops;   /* from freed rings */
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+/* Returns 1 if the writer has drained and reported everything that
+   went into a ring; call with rings_lock held: */
+static int ring_empty(ring_t *r) {
+  return ((r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+          && (r->reported == __atomic_load_n(&r->dropped, __ATOMIC_RELAXED)));
+}
+
+/* Frees an exiting thread's ring right away if it is empty, or else
+   leaves it for the writer to free once it has been drained: */
+static void close_ring(void *vr) {
+  ring_t *r = vr, **rp;
+
+  pthread_mutex_lock(&rings_lock);
+  if (ring_empty(r)) {
+    for (rp = &rings; *rp != r; rp = &(*rp)->next)
+      ;
+    *rp = r->next;
+    retired_drops += r->dropped;
+    free(r);
+  } else
+    r->closed = 1;
+  pthread_mutex_unlock(&rings_lock);
+}
+
+static void make_ring_key(void) {
+  pthread_key_create(&ring_key, close_ring);
+}
+
+static ring_t *my_ring(void) {
+  ring_t *r;
+  void *p;
+
+  pthread_once(&ring_once, make_ring_key);
+  r = pthread_getspecific(ring_key);
+  if (!r) {
+    if (posix_memalign(&p, 64, sizeof(ring_t)))
+      abort();
+    r = memset(p, 0, sizeof(ring_t));
+    pthread_setspecific(ring_key, r);
+
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+  }
+
+  return r;
+}
+
+/* Copies between the ring at byte count `pos` and `s`, wrapping
+   around the end of the buffer: */
+static void ring_put(ring_t *r, size_t pos, const void *s, size_t len) {
+  size_t at = pos % LOG_RING, first = LOG_RING - at;
+
+  if (first > len)
+    first = len;
+  memcpy(r->buf + at, s, first);
+  memcpy(r->buf, (const char *)s + first, len - first);
+}
+
+static void ring_get(ring_t *r, size_t pos, void *s, size_t len) {
+  size_t at = pos % LOG_RING, first = LOG_RING - at;
+
+  if (first > len)
+    first = len;
+  memcpy(s, r->buf + at, first);
+  memcpy((char *)s + first, r->buf, len - first);
+}
+
+void log_write(int level, const char *fmt, ...) {
+  ring_t *r = my_ring();
+  char msg[LOG_MAX_MSG];
+  unsigned short len;
+  size_t tail, head;
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  len = ((size_t)n < sizeof(msg)) ? n : sizeof(msg) - 1;
+
+  tail = r->tail;
+  head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  if (LOG_RING - (tail - head) < sizeof(len) + len) {
+    __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  ring_put(r, tail, &len, sizeof(len));
+  ring_put(r, tail + sizeof(len), msg, len);
+  __atomic_store_n(&r->tail, tail + sizeof(len) + len, __ATOMIC_RELEASE);
+}
+
+static void write_all(int fd, const char *s, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, s, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    s += n;
+    len -= n;
+  }
+}
+
+/* Moves as many of a ring's messages to `out` as fit in `room`
+   bytes, returning the number of bytes moved: */
+static size_t drain(ring_t *r, char *out, size_t room) {
+  size_t head = r->head, tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  size_t n = 0;
+  unsigned short len;
+  unsigned long dropped;
+
+  while (head != tail) {
+    ring_get(r, head, &len, sizeof(len));
+    if (n + len > room)
+      break;
+    ring_get(r, head + sizeof(len), out + n, len);
+    head += sizeof(len) + len;
+    n += len;
+  }
+  __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+
+  dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  if ((dropped != r->reported) && (n + NOTICE_MAX <= room)) {
+    n += sprintf(out + n, "log: dropped %lu messages\n",
+                 dropped - r->reported);
+    r->reported = dropped;
+  }
+
+  return n;
+}
+
+/* Drains the rings into a buffer of LOG_OUT bytes under rings_lock,
+   then writes what it drained after releasing the lock, so that a
+   slow output never holds up a thread registering or freeing its
+   ring or a call to log_dropped(). A pass that fills the buffer
+   stops, and the rings it didn't reach go first in the next pass. */
+static void *log_writer(void *vfd) {
+  int fd = (int)(long)vfd;
+  struct timespec idle = { 0, IDLE_NSEC };
+  char *out = malloc(LOG_OUT);
+  ring_t **rp, *r, **last;
+  size_t n;
+
+  while (1) {
+    n = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    for (rp = &rings; (r = *rp); ) {
+      n += drain(r, out + n, LOG_OUT - n);
+
+      /* The thread is gone and everything it logged has been drained */
+      if (r->closed && ring_empty(r)) {
+        *rp = r->next;
+        retired_drops += r->dropped;
+        free(r);
+      } else
+        rp = &r->next;
+
+      /* Stop while any message still fits, so that every pass moves
+         something: */
+      if (LOG_OUT - n < LOG_MAX_MSG + NOTICE_MAX)
+        break;
+    }
+
+    /* Move the rings that were reached to the end of the list: */
+    if (*rp && (rp != &rings)) {
+      for (last = rp; *last; last = &(*last)->next)
+        ;
+      *last = rings;
+      rings = *rp;
+      *rp = NULL;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (n)
+      write_all(fd, out, n);
+    else
+      nanosleep(&idle, NULL);
+  }
+
+  return NULL;
+}
+
+void start_log(int level, int fd) {
+  pthread_t th;
+
+  log_level = level;
+  pthread_create(&th, NULL, log_writer, (void *)(long)fd);
+  pthread_detach(th);
+}
+
+unsigned long log_dropped(void) {
+  unsigned long n;
+  ring_t *r;
+
+  pthread_mutex_lock(&rings_lock);
+  n = retired_drops;
+  for (r = rings; r; r = r->next)
+    n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&rings_lock);
+
+  return n;
+}
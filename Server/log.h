@@ -0,0 +1,40 @@
+/* The log collects messages from every thread without making them
+   wait on each other or on output. Each thread formats its messages
+   into its own ring buffer, and a background thread copies them from
+   the rings to the output. A message that doesn't fit in its thread's
+   ring is dropped and counted instead of waiting for room.
+
+   Messages have a level, and a message above the current level is
+   skipped before its arguments are even evaluated. */
+
+/* Levels, from most to least important: */
+#define LOG_ERROR 1
+#define LOG_WARN  2
+#define LOG_INFO  3
+#define LOG_DEBUG 4
+
+/* Messages at levels above this one are skipped; 0 skips all: */
+extern int log_level;
+
+/* Returns 1 if messages at `level` are logged, for skipping work that
+   only produces a message: */
+#define log_enabled(level) ((level) <= log_level)
+
+/* Logs a printf()-style message (which includes its own newline) at
+   `level`. Messages longer than LOG_MAX_MSG bytes are cut short. */
+#define LOG_MAX_MSG 4096
+#define log_msg(level, ...)                     \
+  do {                                          \
+    if (log_enabled(level))                     \
+      log_write(level, __VA_ARGS__);            \
+  } while (0)
+
+void log_write(int level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+/* Sets the level and starts the thread that writes messages to the
+   file descriptor `fd`; messages logged earlier wait in the rings: */
+void start_log(int level, int fd);
+
+/* Returns the number of messages dropped so far: */
+unsigned long log_dropped(void);
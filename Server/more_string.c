@@ -3,8 +3,12 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "dictionary.h"
 #include "more_string.h"
+#include "arena.h"
 
 char *append_strings(const char *s, ...)
 {
@@ -186,38 +190,37 @@ void parse_header_line(char *buf, dictionary_t *d) {
 #define IS_END(c)  (((c) == 0) || ((c) == '#'))
 
 void parse_query(const char *buf, dictionary_t *d) {
-  const char *name_start;
-  char *name, *d_name;
+  parse_query_n(buf, strlen(buf), d);
+}
+
+void parse_query_n(const char *buf, size_t len, dictionary_t *d) {
+  const char *name_start, *end = buf + len;
+  char *name, *data;
   const char *data_start;
-  char *data, *d_data;
-  
-  while (!IS_END(*buf)) {
+
+  while ((buf < end) && !IS_END(*buf)) {
     name_start = buf;
 
-    while (!IS_END(*buf) && (*buf != '=') && !IS_QSEP(*buf))
+    while ((buf < end) && !IS_END(*buf) && (*buf != '=') && !IS_QSEP(*buf))
       buf++;
 
     name = strndup(name_start, buf - name_start);
 
-    if (!IS_END(*buf) && !IS_QSEP(*buf))
+    if ((buf < end) && !IS_END(*buf) && !IS_QSEP(*buf))
       buf++;
     data_start = buf;
 
-    while (!IS_END(*buf) && !IS_QSEP(*buf))
+    while ((buf < end) && !IS_END(*buf) && !IS_QSEP(*buf))
       buf++;
 
-    data = strndup(data_start, buf - data_start);
-
-    d_name = query_decode(name);
-    d_data = query_decode(data);
+    data = malloc(buf - data_start + 1);
+    query_decode_into(data, data_start, buf - data_start);
 
-    dictionary_set(d, name, d_data);
+    dictionary_set(d, name, data);
 
-    free(d_name);
     free(name);
-    free(data);
 
-    if (!IS_END(*buf))
+    if ((buf < end) && !IS_END(*buf))
       buf++;
   }
 }
@@ -245,34 +248,101 @@ static int hex_value(int v) {
     return v - 'a' + 10;
 }
 
-char *query_decode(const char *data) {
-  int i, j;
-  char *dest = NULL;
+/* The encoders and decoders below look for the bytes that need work
+   16 at a time when SSE2 is available, and copy the runs of bytes
+   between them as they are. Each *_mask() function returns a bit for
+   each of the 16 bytes at `p` that needs work. */
+#ifdef __SSE2__
+#define BLOCK 16
 
-  /* two passes: one to size, then one to fill */
-  while (1) {
-    for (i = j = 0; data[i]; i++, j++) {
-      if ((data[i] == '%')
-          && (ishexdigit(data[i+1]))
-          && (ishexdigit(data[i+2]))) {
-        if (dest)
-          dest[j] = hex_value(data[i+1]) * 16 + hex_value(data[i+2]);
-        i += 2;
-      } else if (dest) {
-        if (data[i] == '+')
-          dest[j] = ' ';
-        else
-          dest[j] = data[i];
+static int decode_mask(const char *p) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+
+  return _mm_movemask_epi8(_mm_or_si128(
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('%')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('+'))));
+}
+
+/* Bytes other than ASCII letters and digits. Setting the 0x20 bit
+   maps upper-case letters to lower-case ones and no other byte to a
+   letter; bytes from 0x80 on are negative, so they fail the signed
+   range checks. */
+static int encode_mask(const char *p) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                 _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+
+  return ~_mm_movemask_epi8(_mm_or_si128(letter, digit)) & 0xFFFF;
+}
+
+/* Sets `*lt_gt`, `*amp`, and `*quot` to the masks for each kind of
+   byte that entity_encode() expands, returning their union: */
+static int entity_masks(const char *p, int *lt_gt, int *amp, int *quot) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+
+  *lt_gt = _mm_movemask_epi8(_mm_or_si128(
+                               _mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+                               _mm_cmpeq_epi8(v, _mm_set1_epi8('>'))));
+  *amp = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+  *quot = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+
+  return *lt_gt | *amp | *quot;
+}
+#endif
+
+size_t query_decode_into(char *dest, const char *data, size_t len) {
+  size_t i = 0, j = 0;
+  int mask;
+
+  while (i < len) {
+#ifdef __SSE2__
+    /* Copy whole blocks, then the run up to the next '%' or '+'; the
+       block is loaded before it is stored, so decoding in place is
+       fine */
+    while (i + BLOCK <= len) {
+      if ((mask = decode_mask(data + i))) {
+        memmove(dest + j, data + i, __builtin_ctz(mask));
+        i += __builtin_ctz(mask);
+        j += __builtin_ctz(mask);
+        break;
       }
+      _mm_storeu_si128((__m128i *)(dest + j),
+                       _mm_loadu_si128((const __m128i *)(data + i)));
+      i += BLOCK;
+      j += BLOCK;
     }
+    if (i == len)
+      break;
+#endif
+
+    if ((data[i] == '%')
+        && (i + 2 < len)
+        && (ishexdigit(data[i+1]))
+        && (ishexdigit(data[i+2]))) {
+      dest[j++] = hex_value(data[i+1]) * 16 + hex_value(data[i+2]);
+      i += 3;
+    } else if (data[i] == '+') {
+      dest[j++] = ' ';
+      i++;
+    } else
+      dest[j++] = data[i++];
+  }
+  dest[j] = 0;
 
-    if (dest) {
-      dest[j] = 0;
-      return dest;
-    }
+  return j;
+}
 
-    dest = malloc(j + 1);
-  }
+char *query_decode(const char *data) {
+  size_t len = strlen(data);
+  char *dest = malloc(len + 1);
+
+  /* decoding never grows the string, so one pass is enough */
+  query_decode_into(dest, data, len);
+
+  return dest;
 }
 
 static int hex_digit(int v) {
@@ -282,84 +352,225 @@ static int hex_digit(int v) {
     return 'a' + (v - 10);
 }
 
+static int is_alnum(int c) {
+  return (((c >= 'a') && (c <= 'z'))
+          || ((c >= 'A') && (c <= 'Z'))
+          || ((c >= '0') && (c <= '9')));
+}
+
+/* Writes the "%" encoding of `c` to `dest`, returning its length: */
+static size_t put_percent(char *dest, int c) {
+  dest[0] = '%';
+  dest[1] = hex_digit((unsigned char)c >> 4);
+  dest[2] = hex_digit((unsigned char)c & 0xF);
+  return 3;
+}
+
 char *query_encode(const char *data) {
-  int i, j;
-  char *dest = NULL;
+  size_t len = strlen(data), extra = 0, i = 0, j = 0;
+  char *dest;
+#ifdef __SSE2__
+  size_t done, k;
+  int mask;
+#endif
 
   /* two passes: one to size, then one to fill */
-  while (1) {
-    for (i = j = 0; data[i]; i++, j++) {
-      if (((data[i] >= 'a') && (data[i] <= 'z'))
-          || ((data[i] >= 'A') && (data[i] <= 'Z'))
-          || ((data[i] >= '0') && (data[i] <= '9'))) {
-        if (dest)
-          dest[j] = data[i];
-      } else {
-        if (dest) {
-          dest[j] = '%';
-          dest[j+1] = hex_digit(((unsigned char *)data)[i] >> 4);
-          dest[j+2] = hex_digit(((unsigned char *)data)[i] & 0xF);
-        }
-        j += 2;
-      }
+#ifdef __SSE2__
+  for (; i + BLOCK <= len; i += BLOCK)
+    if ((mask = encode_mask(data + i)))
+      extra += 2 * __builtin_popcount(mask);
+#endif
+  for (; i < len; i++)
+    if (!is_alnum(data[i]))
+      extra += 2;
+
+  dest = malloc(len + extra + 1);
+
+  i = 0;
+#ifdef __SSE2__
+  for (; i + BLOCK <= len; i += BLOCK) {
+    mask = encode_mask(data + i);
+    for (done = 0; mask; mask &= mask - 1, done = k + 1) {
+      k = __builtin_ctz(mask);
+      memcpy(dest + j, data + i + done, k - done);
+      j += k - done;
+      j += put_percent(dest + j, data[i + k]);
     }
+    memcpy(dest + j, data + i + done, BLOCK - done);
+    j += BLOCK - done;
+  }
+#endif
+  for (; i < len; i++) {
+    if (is_alnum(data[i]))
+      dest[j++] = data[i];
+    else
+      j += put_percent(dest + j, data[i]);
+  }
+  dest[j] = 0;
 
-    if (dest) {
-      dest[j] = 0;
-      return dest;
-    }
+  return dest;
+}
 
-    dest = malloc(j + 1);
+/* Returns the entity for `c`, or NULL if `c` stands for itself: */
+static const char *entity(int c) {
+  switch (c) {
+  case '<': return "&lt;";
+  case '>': return "&gt;";
+  case '&': return "&amp;";
+  case '"': return "&quot;";
+  default: return NULL;
   }
 }
 
+/* Writes the entity `e` to `dest`, returning its length: */
+static size_t put_entity(char *dest, const char *e) {
+  size_t n = strlen(e);
+
+  memcpy(dest, e, n);
+  return n;
+}
+
 char *entity_encode(const char *data) {
-  int i, j;
-  char *dest = NULL;
+  size_t len = strlen(data), extra = 0, i = 0, j = 0;
+  const char *e;
+  char *dest;
+#ifdef __SSE2__
+  size_t done, k;
+  int mask, lt_gt, amp, quot;
+#endif
 
   /* two passes: one to size, then one to fill */
-  while (1) {
-    for (i = j = 0; data[i]; i++, j++) {
-      if ((data[i] == '<')
-          || (data[i] == '>')) {
-        if (dest) {
-          dest[j] = '&';
-          dest[j+1] = ((data[i] == '<') ? 'l' : 'g');
-          dest[j+2] = 't';
-          dest[j+3] = ';';
-        }
-        j += 3;
-        
-      } else if (data[i] == '&') {
-        if (dest) {
-          dest[j] = '&';
-          dest[j+1] = 'a';
-          dest[j+2] = 'm';
-          dest[j+3] = 'p';
-          dest[j+4] = ';';
-        }
-        j += 4;
-      } else if (data[i] == '"') {
-        if (dest) {
-          dest[j] = '&';
-          dest[j+1] = 'q';
-          dest[j+2] = 'u';
-          dest[j+3] = 'o';
-          dest[j+4] = 't';
-          dest[j+5] = ';';
-        }
-        j += 5;
-      } else {
-        if (dest)
-          dest[j] = data[i];
-      }
+#ifdef __SSE2__
+  for (; i + BLOCK <= len; i += BLOCK)
+    if (entity_masks(data + i, &lt_gt, &amp, &quot))
+      extra += (3 * __builtin_popcount(lt_gt) + 4 * __builtin_popcount(amp)
+                + 5 * __builtin_popcount(quot));
+#endif
+  for (; i < len; i++)
+    if ((e = entity(data[i])))
+      extra += strlen(e) - 1;
+
+  dest = malloc(len + extra + 1);
+
+  i = 0;
+#ifdef __SSE2__
+  for (; i + BLOCK <= len; i += BLOCK) {
+    mask = entity_masks(data + i, &lt_gt, &amp, &quot);
+    for (done = 0; mask; mask &= mask - 1, done = k + 1) {
+      k = __builtin_ctz(mask);
+      memcpy(dest + j, data + i + done, k - done);
+      j += k - done;
+      j += put_entity(dest + j, entity(data[i + k]));
     }
+    memcpy(dest + j, data + i + done, BLOCK - done);
+    j += BLOCK - done;
+  }
+#endif
+  for (; i < len; i++) {
+    if ((e = entity(data[i])))
+      j += put_entity(dest + j, e);
+    else
+      dest[j++] = data[i];
+  }
+  dest[j] = 0;
 
-    if (dest) {
-      dest[j] = 0;
-      return dest;
+  return dest;
+}
+
+char *arena_to_string(arena_t *a, long v) {
+  char buffer[64];
+  int len = snprintf(buffer, sizeof(buffer), "%ld", v);
+  return arena_strndup(a, buffer, len);
+}
+
+char **arena_split_string(arena_t *a, const char *str, char sep)
+{
+  int len = strlen(str);
+  int i, j, k;
+  int count = 1;
+  char **strs;
+  
+  for (i = 0; i < len; i++) {
+    if (str[i] == sep)
+      count++;
+  }
+  if (len && (str[len-1] == sep))
+    --count; /* because `sep` is acting as a terminator */
+
+  strs = arena_alloc(a, sizeof(char *) * (count + 1));
+  if (!strs)
+    return NULL;
+  
+  for (i = 0, j = 0, k = 0; i < len; i++) {
+    if (str[i] == sep) {
+      if (!(strs[j++] = arena_strndup(a, str + k, i - k)))
+        return NULL;
+      k = i+1;
+    }
+  }
+  if ((k != len) && !(strs[j++] = arena_strndup(a, str + k, len - k)))
+    return NULL;
+  strs[j] = NULL;
+
+  return strs;
+}
+
+int arena_parse_query(arena_t *a, const char *buf, size_t len,
+                      dictionary_t *d) {
+  return arena_parse_query_fields(a, buf, len, d, NULL);
+}
+
+/* Returns 1 if the `len` bytes at `name` are one of `names`: */
+static int is_wanted(const char *name, size_t len, const char * const *names) {
+  if (!names)
+    return 1;
+  for (; *names; names++)
+    if (!strncmp(*names, name, len) && !(*names)[len])
+      return 1;
+  return 0;
+}
+
+int arena_parse_query_fields(arena_t *a, const char *buf, size_t len,
+                             dictionary_t *d, const char * const *names) {
+  const char *name_start, *name_end, *data_start, *end = buf + len;
+  char *name, *value;
+
+  while ((buf < end) && !IS_END(*buf)) {
+    name_start = buf;
+
+    while ((buf < end) && !IS_END(*buf) && (*buf != '=') && !IS_QSEP(*buf))
+      buf++;
+    name_end = buf;
+
+    if ((buf < end) && !IS_END(*buf) && !IS_QSEP(*buf))
+      buf++;
+    data_start = buf;
+
+    while ((buf < end) && !IS_END(*buf) && !IS_QSEP(*buf))
+      buf++;
+
+    if (is_wanted(name_start, name_end - name_start, names)) {
+      name = arena_strndup(a, name_start, name_end - name_start);
+      value = arena_query_decode(a, data_start, buf - data_start);
+      if (!name || !value || !dictionary_set(d, name, value))
+        return 0;
     }
 
-    dest = malloc(j + 1);
-  }  
+    if ((buf < end) && !IS_END(*buf))
+      buf++;
+  }
+
+  return 1;
+}
+
+char *arena_query_decode(arena_t *a, const char *data, size_t len) {
+  char *dest = arena_alloc(a, len + 1);
+
+  if (!dest)
+    return NULL;
+
+  /* decoding never grows the string, so one pass is enough */
+  query_decode_into(dest, data, len);
+
+  return dest;
 }
@@ -57,6 +57,10 @@ void parse_header_line(char *buf, dictionary_t *d);
    string), recognizing both "&" and ";" as query separators: */
 void parse_query(const char *buf, dictionary_t *d);
 
+/* Like parse_query(), but parses only the first `len` bytes of `buf`,
+   which need not be NUL-terminated: */
+void parse_query_n(const char *buf, size_t len, dictionary_t *d);
+
 /* Parses the query part, if any, of a URL (i.e., the part after the
    first "?") into the dictionarty `d`: */
 void parse_uriquery(const char *buf, dictionary_t *d);
@@ -71,7 +75,30 @@ char *query_encode(const char *);
    and "+" is converted to a space: */
 char *query_decode(const char *);
 
+/* Like query_decode(), but decodes the `len` bytes at `data` (which
+   need not be NUL-terminated) into `dest`, which must have room for
+   `len` + 1 bytes and may be `data` itself. Returns the length of the
+   result, which is NUL-terminated: */
+size_t query_decode_into(char *dest, const char *data, size_t len);
+
 /* Returns a freshly allocated string that is like the given one,
    except that each `<`, `>`, `&`, and `"` character is converted to
    its `&lt;`, `&gt;`, `&amp;`, and `&quot;` encoding, respectively: */
 char *entity_encode(const char *);
+
+/* Variants of the above that allocate their results (including
+   strings stored in `d`) from the arena `a`, so that nothing needs to
+   be freed individually. If the arena runs out of memory, they return
+   NULL, or 0 for the query parsers (which return 1 otherwise): */
+struct arena_t;
+char *arena_to_string(struct arena_t *a, long v);
+char **arena_split_string(struct arena_t *a, const char *str, char sep);
+int arena_parse_query(struct arena_t *a, const char *buf, size_t len,
+                      dictionary_t *d);
+char *arena_query_decode(struct arena_t *a, const char *data, size_t len);
+
+/* Like arena_parse_query(), but skips (without decoding) every field
+   whose name is not in the NULL-terminated `names`; a NULL `names`
+   keeps every field: */
+int arena_parse_query_fields(struct arena_t *a, const char *buf, size_t len,
+                             dictionary_t *d, const char * const *names);
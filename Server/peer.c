@@ -0,0 +1,412 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "dictionary.h"
+#include "more_string.h"
+#include "peer.h"
+
+/* Bytes read from a peer at a time: */
+#define PEER_BUF 16384
+
+/* Longest status, header, or chunk-size line accepted from a peer: */
+#define PEER_MAX_LINE 8192
+
+/* Friend names longer than this are skipped: */
+#define PEER_MAX_NAME 65536
+
+/* Idle connections to one peer, used last-in first-out: */
+typedef struct {
+  int *fds;
+  int count;
+} idle_t;
+
+struct peer_pool_t {
+  pthread_mutex_t lock;
+  dictionary_t *peers;    /* "host:port" -> idle_t */
+  int max_idle, timeout_ms;
+};
+
+/* A connection while one request uses it: */
+typedef struct {
+  int fd;
+  long deadline;          /* in now_ms() terms */
+  char buf[PEER_BUF];
+  size_t pos, len;
+  int got_any;            /* whether any response bytes arrived */
+} link_t;
+
+/* Splits a response body into friends at newlines: */
+typedef struct {
+  char *s;
+  size_t len, alloc;
+  int too_long;
+  peer_friend_proc_t proc;
+  void *data;
+} lines_t;
+
+static void free_idle(void *v) {
+  idle_t *idle = v;
+  int i;
+
+  for (i = 0; i < idle->count; i++)
+    close(idle->fds[i]);
+  free(idle->fds);
+  free(idle);
+}
+
+peer_pool_t *make_peer_pool(int max_idle, int timeout_ms) {
+  peer_pool_t *p = malloc(sizeof(peer_pool_t));
+
+  pthread_mutex_init(&p->lock, NULL);
+  p->peers = make_dictionary(COMPARE_CASE_INSENS, free_idle);
+  p->max_idle = max_idle;
+  p->timeout_ms = timeout_ms;
+
+  return p;
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Waits until `fd` is ready for `events`, returning 0, or -1 if the
+   deadline passes first: */
+static int wait_fd(int fd, short events, long deadline) {
+  struct pollfd pfd;
+  long left;
+  int n;
+
+  while (1) {
+    if ((left = deadline - now_ms()) <= 0)
+      return -1;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    if ((n = poll(&pfd, 1, left)) > 0)
+      return 0;
+    if ((n == 0) || (errno != EINTR))
+      return -1;
+  }
+}
+
+static int take_idle(peer_pool_t *p, const char *key) {
+  idle_t *idle;
+  int fd = -1;
+
+  pthread_mutex_lock(&p->lock);
+  idle = dictionary_get(p->peers, key);
+  if (idle && idle->count)
+    fd = idle->fds[--idle->count];
+  pthread_mutex_unlock(&p->lock);
+
+  return fd;
+}
+
+static void put_idle(peer_pool_t *p, const char *key, int fd) {
+  idle_t *idle;
+
+  pthread_mutex_lock(&p->lock);
+  if (!(idle = dictionary_get(p->peers, key)) && (p->max_idle > 0)) {
+    idle = malloc(sizeof(idle_t));
+    idle->fds = malloc(p->max_idle * sizeof(int));
+    idle->count = 0;
+    dictionary_set(p->peers, key, idle);
+  }
+  if (idle && (idle->count < p->max_idle)) {
+    idle->fds[idle->count++] = fd;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  if (fd >= 0)
+    close(fd);
+}
+
+/* Connects to the peer without blocking past the deadline (except
+   for the name lookup), returning a non-blocking socket or -1: */
+static int open_conn(const char *host, const char *port, long deadline) {
+  struct addrinfo hints, *addrs, *a;
+  int fd = -1, err, on = 1;
+  socklen_t len;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if (getaddrinfo(host, port, &hints, &addrs))
+    return -1;
+
+  for (a = addrs; a; a = a->ai_next) {
+    if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+      continue;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (!connect(fd, a->ai_addr, a->ai_addrlen))
+      break;
+    if ((errno == EINPROGRESS) && !wait_fd(fd, POLLOUT, deadline)) {
+      len = sizeof(err);
+      if (!getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) && !err)
+        break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+
+  /* The request is one small write that shouldn't wait for an ACK */
+  if (fd >= 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  return fd;
+}
+
+static int send_all(link_t *l, const char *s, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = send(l->fd, s, len, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (((errno == EAGAIN) || (errno == EWOULDBLOCK))
+          && !wait_fd(l->fd, POLLOUT, l->deadline))
+        continue;
+      return -1;
+    }
+    s += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Refills the (empty) buffer, returning the number of bytes read, 0
+   at the end of the stream, or -1 on an error or timeout: */
+static int fill(link_t *l) {
+  ssize_t n;
+
+  while (1) {
+    if (wait_fd(l->fd, POLLIN, l->deadline))
+      return -1;
+    if ((n = recv(l->fd, l->buf, sizeof(l->buf), 0)) >= 0)
+      break;
+    if ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+      return -1;
+  }
+
+  l->pos = 0;
+  l->len = n;
+  if (n > 0)
+    l->got_any = 1;
+
+  return n;
+}
+
+/* Reads a line without its CRLF, returning its length or -1: */
+static int read_line(link_t *l, char *line, size_t size) {
+  size_t n = 0;
+  char c;
+
+  while (1) {
+    if ((l->pos == l->len) && (fill(l) <= 0))
+      return -1;
+    if ((c = l->buf[l->pos++]) == '\n')
+      break;
+    if (n + 1 == size)
+      return -1;
+    line[n++] = c;
+  }
+
+  if (n && (line[n-1] == '\r'))
+    n--;
+  line[n] = 0;
+
+  return n;
+}
+
+static void end_line(lines_t *l) {
+  if (l->len && !l->too_long) {
+    l->s[l->len] = 0;
+    l->proc(l->s, l->data);
+  }
+  l->len = 0;
+  l->too_long = 0;
+}
+
+static void lines_add(lines_t *l, const char *s, size_t n) {
+  const char *nl;
+  size_t take;
+
+  while (n > 0) {
+    nl = memchr(s, '\n', n);
+    take = (nl ? (size_t)(nl - s) : n);
+
+    if (!l->too_long) {
+      if (l->len + take > PEER_MAX_NAME)
+        l->too_long = 1;
+      else {
+        if (l->len + take + 1 > l->alloc) {
+          l->alloc = 2 * (l->len + take + 1);
+          l->s = realloc(l->s, l->alloc);
+        }
+        memcpy(l->s + l->len, s, take);
+        l->len += take;
+      }
+    }
+
+    if (!nl)
+      return;
+    end_line(l);
+    s = nl + 1;
+    n -= take + 1;
+  }
+}
+
+/* Passes the next `n` body bytes (or, if `n` is negative, the rest
+   of the stream) to `lines`, returning 0 or -1: */
+static int read_body(link_t *l, long n, lines_t *lines) {
+  size_t take;
+  int got;
+
+  while (n != 0) {
+    if (l->pos == l->len) {
+      if ((got = fill(l)) < 0)
+        return -1;
+      if (!got)
+        return (n < 0) ? 0 : -1;
+    }
+    take = l->len - l->pos;
+    if ((n > 0) && (take > (size_t)n))
+      take = n;
+    lines_add(lines, l->buf + l->pos, take);
+    l->pos += take;
+    if (n > 0)
+      n -= take;
+  }
+
+  return 0;
+}
+
+/* Returns 1 if the header `line` is named `name` (which ends in a
+   colon), with a value that starts with `value`: */
+static int header_is(const char *line, const char *name, const char *value) {
+  size_t len = strlen(name);
+
+  if (strncasecmp(line, name, len))
+    return 0;
+  for (line += len; (*line == ' ') || (*line == '\t'); line++)
+    ;
+  return !value || !strncasecmp(line, value, strlen(value));
+}
+
+/* Sends `request` and reads the response into `lines`, returning 0
+   or -1; sets `*keep_p` to whether the connection can be reused: */
+static int exchange(link_t *l, const char *request, lines_t *lines,
+                    int *keep_p) {
+  char line[PEER_MAX_LINE];
+  long length = -1, n;
+  int chunked = 0, keep;
+
+  if (send_all(l, request, strlen(request)))
+    return -1;
+
+  if ((read_line(l, line, sizeof(line)) < 12)
+      || strncmp(line, "HTTP/1.", 7) || strncmp(line + 8, " 200", 4))
+    return -1;
+  keep = (line[7] == '1');
+
+  while (1) {
+    if (read_line(l, line, sizeof(line)) < 0)
+      return -1;
+    if (!line[0])
+      break;
+    if (header_is(line, "Content-length:", NULL))
+      length = strtol(strchr(line, ':') + 1, NULL, 10);
+    else if (header_is(line, "Transfer-Encoding:", "chunked"))
+      chunked = 1;
+    else if (header_is(line, "Connection:", "close"))
+      keep = 0;
+    else if (header_is(line, "Connection:", "keep-alive"))
+      keep = 1;
+  }
+
+  if (chunked) {
+    while (1) {
+      if (read_line(l, line, sizeof(line)) < 0)
+        return -1;
+      if ((n = strtol(line, NULL, 16)) < 0)
+        return -1;
+      if (!n)
+        break;
+      if (read_body(l, n, lines) || (read_line(l, line, sizeof(line)) != 0))
+        return -1;
+    }
+    /* Trailers end with an empty line */
+    do {
+      if (read_line(l, line, sizeof(line)) < 0)
+        return -1;
+    } while (line[0]);
+  } else if (length >= 0) {
+    if (read_body(l, length, lines))
+      return -1;
+  } else {
+    /* The body runs until the peer closes the connection */
+    if (read_body(l, -1, lines))
+      return -1;
+    keep = 0;
+  }
+
+  end_line(lines);
+  *keep_p = keep && (l->pos == l->len);
+  return 0;
+}
+
+int peer_get_friends(peer_pool_t *p, const char *host, const char *port,
+                     const char *user, peer_friend_proc_t proc, void *data) {
+  char *key = append_strings(host, ":", port, NULL);
+  char *enc = query_encode(user);
+  char *request = append_strings("GET /friends?user=", enc, " HTTP/1.1\r\n"
+                                 "Host: ", host, ":", port, "\r\n\r\n", NULL);
+  link_t *l = malloc(sizeof(link_t));
+  lines_t lines = { NULL, 0, 0, 0, proc, data };
+  int attempt, reused, keep = 0, result = -1;
+
+  l->deadline = now_ms() + p->timeout_ms;
+
+  for (attempt = 0; attempt < 2; attempt++) {
+    reused = ((l->fd = take_idle(p, key)) >= 0);
+    if (!reused && ((l->fd = open_conn(host, port, l->deadline)) < 0))
+      break;
+    l->pos = l->len = 0;
+    l->got_any = 0;
+
+    result = exchange(l, request, &lines, &keep);
+    if (!result && keep)
+      put_idle(p, key, l->fd);
+    else
+      close(l->fd);
+
+    /* A pooled connection that the peer closed while it sat idle
+       fails before any of the response arrives; try a fresh one */
+    if (!result || !reused || l->got_any)
+      break;
+  }
+
+  free(lines.s);
+  free(l);
+  free(request);
+  free(enc);
+  free(key);
+
+  return result;
+}
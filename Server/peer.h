@@ -0,0 +1,25 @@
+/* A peer pool asks other friendlist servers for friend lists. It
+   keeps idle keep-alive connections to each peer (by host and port),
+   so that a request usually skips the connection setup, and each
+   request must finish within the pool's timeout so that a slow or
+   dead peer can't hold a thread for long.
+
+   The pool is safe to use from multiple threads. A connection is
+   used by one request at a time, so concurrent requests to the same
+   peer each take their own. */
+
+/* Opaque type for a pool instance: */
+typedef struct peer_pool_t peer_pool_t;
+
+/* Creates a pool that keeps up to `max_idle` idle connections per
+   peer and gives each request `timeout_ms` milliseconds: */
+peer_pool_t *make_peer_pool(int max_idle, int timeout_ms);
+
+/* Asks the peer at `host` and `port` for the friends of `user`,
+   calling `proc` with each one as the response streams in; a
+   friend string is valid only during the call. Returns 0 on success,
+   or -1 if the peer can't be reached, answers with an error, or
+   runs out of time (possibly after some calls to `proc`). */
+typedef void (*peer_friend_proc_t)(const char *friend, void *data);
+int peer_get_friends(peer_pool_t *p, const char *host, const char *port,
+                     const char *user, peer_friend_proc_t proc, void *data);
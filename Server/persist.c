@@ -0,0 +1,546 @@
+#include "csapp.h"
+#include "graph.h"
+#include "persist.h"
+
+/* Each log record is a 32-bit check value (FNV-1a over the rest of
+   the record), a change byte (GRAPH_BEFRIEND or GRAPH_UNFRIEND), the
+   32-bit lengths of the two names, and then the names' bytes. Replay
+   stops at the first incomplete or damaged record, which is where a
+   crash interrupted a write. */
+#define RECORD_HEADER 13
+
+#define INITIAL_BUF 65536
+
+/* A persist_commit_async() caller waiting for `target` bytes to be
+   durable: */
+typedef struct waiter_t {
+  struct waiter_t *next;
+  unsigned long long target;
+  persist_done_t done;
+  void *data;
+} waiter_t;
+
+struct persist_t {
+  graph_t *g;
+  char *dir;
+  int snapshot_interval;
+
+  pthread_mutex_t lock;
+  pthread_cond_t pending;     /* signaled when there is work to write */
+  pthread_cond_t flushed;     /* signaled when `durable` advances */
+
+  int fd;                     /* log file being appended to */
+  unsigned int gen;           /* generation of that log file */
+  char *buf;                  /* records not yet handed to the writer */
+  size_t len, alloc;
+  unsigned long long appended;  /* bytes logged so far */
+  unsigned long long durable;   /* bytes logged and synced so far */
+  int failed;                 /* set once a write or sync has failed */
+  int rotate;                 /* set to ask the writer for a new file */
+  waiter_t *waiters;          /* in order of `target` */
+  waiter_t **last_waiter;
+};
+
+static void log_change(int change, const char *user, const char *friend,
+                       void *vp);
+static void *log_writer(void *vp);
+static void *snapshotter(void *vp);
+static void recover(persist_t *p);
+static size_t replay(graph_t *g, const char *data, size_t len);
+static unsigned int *list_gens(const char *dir, const char *prefix,
+                               size_t *count_p);
+static char *gen_path(persist_t *p, const char *prefix, unsigned int gen);
+static void sync_dir(persist_t *p);
+static void remove_before(persist_t *p, const char *prefix, unsigned int gen);
+
+static void fail(const char *msg, const char *path) {
+  fprintf(stderr, "%s %s: %s\n", msg, path, strerror(errno));
+  exit(1);
+}
+
+persist_t *start_persist(graph_t *g, const char *dir, int snapshot_interval) {
+  persist_t *p = calloc(1, sizeof(persist_t));
+  pthread_t th;
+
+  p->g = g;
+  p->dir = strdup(dir);
+  p->snapshot_interval = snapshot_interval;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->pending, NULL);
+  pthread_cond_init(&p->flushed, NULL);
+  p->alloc = INITIAL_BUF;
+  p->buf = malloc(p->alloc);
+  p->last_waiter = &p->waiters;
+
+  if ((mkdir(dir, 0777) < 0) && (errno != EEXIST))
+    fail("cannot create", dir);
+
+  recover(p);
+  graph_set_log(g, log_change, p);
+
+  Pthread_create(&th, NULL, log_writer, p);
+  Pthread_detach(th);
+  if (snapshot_interval > 0) {
+    Pthread_create(&th, NULL, snapshotter, p);
+    Pthread_detach(th);
+  }
+
+  return p;
+}
+
+int persist_commit(persist_t *p) {
+  unsigned long long target;
+  int failed;
+
+  pthread_mutex_lock(&p->lock);
+  target = p->appended;
+  while ((p->durable < target) && !p->failed)
+    pthread_cond_wait(&p->flushed, &p->lock);
+  failed = p->failed;
+  pthread_mutex_unlock(&p->lock);
+
+  return failed ? -1 : 0;
+}
+
+void persist_commit_async(persist_t *p, persist_done_t done, void *data) {
+  waiter_t *w;
+  int failed, pending;
+
+  pthread_mutex_lock(&p->lock);
+  pending = (p->durable < p->appended);
+  if (pending && !p->failed && (w = malloc(sizeof(waiter_t)))) {
+    w->next = NULL;
+    w->target = p->appended;
+    w->done = done;
+    w->data = data;
+    *p->last_waiter = w;
+    p->last_waiter = &w->next;
+    pthread_mutex_unlock(&p->lock);
+    return;
+  }
+  failed = p->failed;
+  pthread_mutex_unlock(&p->lock);
+
+  /* Already durable, or there's no memory to wait without blocking */
+  if (!failed && pending)
+    failed = persist_commit(p);
+  done(failed ? -1 : 0, data);
+}
+
+static unsigned int fnv1a(unsigned int h, const char *s, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+
+  return h;
+}
+
+/* Called by the graph with the changed users' shards locked, so it
+   only copies the record into the buffer: */
+static void log_change(int change, const char *user, const char *friend,
+                       void *vp) {
+  persist_t *p = vp;
+  unsigned int ulen = strlen(user), flen = strlen(friend), check;
+  size_t n = RECORD_HEADER + ulen + flen;
+  char *r;
+
+  pthread_mutex_lock(&p->lock);
+
+  if (p->len + n > p->alloc) {
+    while (p->len + n > p->alloc)
+      p->alloc *= 2;
+    p->buf = realloc(p->buf, p->alloc);
+  }
+
+  r = p->buf + p->len;
+  r[4] = change;
+  memcpy(r + 5, &ulen, 4);
+  memcpy(r + 9, &flen, 4);
+  memcpy(r + RECORD_HEADER, user, ulen);
+  memcpy(r + RECORD_HEADER + ulen, friend, flen);
+  check = fnv1a(2166136261u, r + 4, n - 4);
+  memcpy(r, &check, 4);
+
+  p->len += n;
+  p->appended += n;
+  pthread_cond_signal(&p->pending);
+
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Writes and syncs batches of records. While a batch is on its way
+   to disk, new records collect in the other buffer, and the next
+   batch takes all of them at once. The lock is only held to swap
+   buffers and files, since log_change() takes it while graph shards
+   are locked; a new file is created and synced before that.
+
+   Once a write or sync fails, the log has a gap that replay would
+   stop at, so nothing is written after it and no later change
+   becomes durable. */
+static void *log_writer(void *vp) {
+  persist_t *p = vp;
+  char *out = malloc(INITIAL_BUF), *tmp;
+  size_t out_alloc = INITIAL_BUF, out_len, tmp_alloc, done;
+  unsigned long long target;
+  int fd, old_fd, new_fd, rotated, failed;
+  waiter_t *ready, **rp, *w;
+  ssize_t n;
+
+  while (1) {
+    pthread_mutex_lock(&p->lock);
+    while (!p->len && !p->rotate)
+      pthread_cond_wait(&p->pending, &p->lock);
+    rotated = p->rotate;
+    pthread_mutex_unlock(&p->lock);
+
+    /* Only this thread changes `gen` and `fd`: */
+    new_fd = -1;
+    if (rotated) {
+      char *path = gen_path(p, "wal", p->gen + 1);
+      if ((new_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0)
+        unix_error("Open error");
+      else
+        sync_dir(p);
+      free(path);
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    /* Swap buffers: */
+    tmp = p->buf;
+    tmp_alloc = p->alloc;
+    p->buf = out;
+    p->alloc = out_alloc;
+    out = tmp;
+    out_alloc = tmp_alloc;
+    out_len = p->len;
+    p->len = 0;
+    target = p->appended;
+    failed = p->failed;
+
+    /* Records logged from now on go to the next file: */
+    fd = p->fd;
+    old_fd = -1;
+    if (new_fd >= 0) {
+      old_fd = p->fd;
+      p->fd = new_fd;
+      p->gen++;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    for (done = 0; !failed && (done < out_len); done += n) {
+      n = write(fd, out + done, out_len - done);
+      if (n < 0) {
+        if (errno == EINTR)
+          n = 0;
+        else {
+          unix_error("Log write error");
+          failed = 1;
+          n = 0;
+        }
+      }
+    }
+    if (!failed && out_len && (fdatasync(fd) < 0)) {
+      unix_error("Log sync error");
+      failed = 1;
+    }
+    if (old_fd >= 0)
+      close(old_fd);
+
+    pthread_mutex_lock(&p->lock);
+    if (failed)
+      p->failed = 1;
+    else
+      p->durable = target;
+    if (rotated)
+      p->rotate = 0;
+    pthread_cond_broadcast(&p->flushed);
+
+    /* Take the waiters whose changes are now durable, or all of them
+       after a failure, and call them without the lock: */
+    for (rp = &p->waiters; *rp && (failed || ((*rp)->target <= target)); )
+      rp = &(*rp)->next;
+    ready = p->waiters;
+    p->waiters = *rp;
+    *rp = NULL;
+    if (!p->waiters)
+      p->last_waiter = &p->waiters;
+    pthread_mutex_unlock(&p->lock);
+
+    while ((w = ready)) {
+      ready = w->next;
+      w->done(failed ? -1 : 0, w->data);
+      free(w);
+    }
+  }
+
+  return NULL;
+}
+
+/* Returns the generation of a new log file, after every change in
+   earlier files is both on disk and applied to the graph: */
+static unsigned int rotate_log(persist_t *p) {
+  unsigned int gen;
+
+  pthread_mutex_lock(&p->lock);
+  p->rotate = 1;
+  pthread_cond_signal(&p->pending);
+  while (p->rotate)
+    pthread_cond_wait(&p->flushed, &p->lock);
+  gen = p->gen;
+  pthread_mutex_unlock(&p->lock);
+
+  return gen;
+}
+
+static int write_snapshot(persist_t *p, unsigned int gen) {
+  char *tmp = gen_path(p, "snapshot.tmp", gen);
+  char *path = gen_path(p, "snapshot", gen);
+  int result = -1;
+  FILE *f;
+
+  if ((f = fopen(tmp, "w"))) {
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    result = graph_write_snapshot(p->g, f);
+    if (fflush(f) || fsync(fileno(f)))
+      result = -1;
+    if (fclose(f))
+      result = -1;
+    if (!result && (rename(tmp, path) < 0))
+      result = -1;
+    if (result)
+      unlink(tmp);
+    else
+      sync_dir(p);
+  }
+
+  free(tmp);
+  free(path);
+  return result;
+}
+
+static void remove_before(persist_t *p, const char *prefix, unsigned int gen) {
+  unsigned int *gens;
+  size_t count, i;
+
+  gens = list_gens(p->dir, prefix, &count);
+  for (i = 0; i < count; i++) {
+    if (gens[i] < gen) {
+      char *path = gen_path(p, prefix, gens[i]);
+      unlink(path);
+      free(path);
+    }
+  }
+  free(gens);
+}
+
+/* Starts a new log file and then writes a snapshot that covers the
+   old ones, every `snapshot_interval` seconds that something has
+   changed (counting the first interval as a change, so that a log
+   replayed at startup gets folded into a snapshot): */
+static void *snapshotter(void *vp) {
+  persist_t *p = vp;
+  unsigned long long last = ~0ULL, appended;
+  unsigned int gen;
+
+  while (1) {
+    sleep(p->snapshot_interval);
+
+    pthread_mutex_lock(&p->lock);
+    appended = p->appended;
+    pthread_mutex_unlock(&p->lock);
+    if (appended == last)
+      continue;
+    last = appended;
+
+    gen = rotate_log(p);
+    if (write_snapshot(p, gen) < 0) {
+      unix_error("Snapshot error");
+      continue;
+    }
+    remove_before(p, "wal", gen);
+    remove_before(p, "snapshot", gen);
+  }
+
+  return NULL;
+}
+
+/* Maps a whole file, returning NULL for an empty one: */
+static char *map_file(const char *path, size_t *len_p) {
+  struct stat st;
+  char *data = NULL;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    fail("cannot open", path);
+  if (fstat(fd, &st) < 0)
+    fail("cannot stat", path);
+  *len_p = st.st_size;
+  if (st.st_size) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+      fail("cannot map", path);
+  }
+  close(fd);
+
+  return data;
+}
+
+/* Loads the latest snapshot and replays the log files from its
+   generation on, leaving the last log file open for appending: */
+static void recover(persist_t *p) {
+  unsigned int *snaps, *wals;
+  size_t nsnaps, nwals, i, len, valid;
+  char *path, *data;
+
+  snaps = list_gens(p->dir, "snapshot", &nsnaps);
+  wals = list_gens(p->dir, "wal", &nwals);
+
+  p->gen = 0;
+  if (nsnaps) {
+    p->gen = snaps[nsnaps - 1];
+    path = gen_path(p, "snapshot", p->gen);
+    data = map_file(path, &len);
+    if (graph_read_snapshot(p->g, data, len) < 0) {
+      fprintf(stderr, "malformed snapshot %s\n", path);
+      exit(1);
+    }
+    if (data)
+      munmap(data, len);
+    free(path);
+  }
+
+  for (i = 0; i < nwals; i++) {
+    if (wals[i] < p->gen)
+      continue;
+
+    path = gen_path(p, "wal", wals[i]);
+    data = map_file(path, &len);
+    valid = replay(p->g, data, len);
+    if (data)
+      munmap(data, len);
+
+    if (valid < len) {
+      fprintf(stderr, "%s: ignoring %lu damaged bytes at the end\n",
+              path, (unsigned long)(len - valid));
+      if (truncate(path, valid) < 0)
+        fail("cannot truncate", path);
+    }
+    free(path);
+
+    p->gen = wals[i];
+  }
+
+  path = gen_path(p, "wal", p->gen);
+  if ((p->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0)
+    fail("cannot open", path);
+  free(path);
+  sync_dir(p);
+
+  free(snaps);
+  free(wals);
+
+  /* Left behind by a crash while writing a snapshot: */
+  remove_before(p, "snapshot.tmp", ~0u);
+}
+
+/* Applies the log records in `data`, returning the length of the
+   part that holds complete, undamaged records: */
+static size_t replay(graph_t *g, const char *data, size_t len) {
+  size_t pos = 0, alloc = 0, n;
+  unsigned int check, ulen, flen;
+  char *user = NULL, *friend;
+
+  while (len - pos >= RECORD_HEADER) {
+    const char *r = data + pos;
+
+    memcpy(&check, r, 4);
+    memcpy(&ulen, r + 5, 4);
+    memcpy(&flen, r + 9, 4);
+    if ((ulen > len) || (flen > len)
+        || ((n = RECORD_HEADER + (size_t)ulen + flen) > len - pos)
+        || (fnv1a(2166136261u, r + 4, n - 4) != check))
+      break;
+
+    if (ulen + flen + 2 > alloc) {
+      alloc = 2 * (ulen + flen + 2);
+      user = realloc(user, alloc);
+    }
+    memcpy(user, r + RECORD_HEADER, ulen);
+    user[ulen] = 0;
+    friend = user + ulen + 1;
+    memcpy(friend, r + RECORD_HEADER + ulen, flen);
+    friend[flen] = 0;
+
+    if (r[4] == GRAPH_BEFRIEND)
+      graph_befriend(g, user, friend);
+    else if (r[4] == GRAPH_UNFRIEND)
+      graph_unfriend(g, user, friend);
+
+    pos += n;
+  }
+
+  free(user);
+  return pos;
+}
+
+static int compare_gens(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+  return (x > y) - (x < y);
+}
+
+/* Returns the generations n of files named "<prefix>.<n>" in `dir`,
+   in increasing order: */
+static unsigned int *list_gens(const char *dir, const char *prefix,
+                               size_t *count_p) {
+  size_t count = 0, alloc = 8, plen = strlen(prefix);
+  unsigned int *gens = malloc(alloc * sizeof(unsigned int));
+  struct dirent *de;
+  DIR *d;
+
+  if (!(d = opendir(dir)))
+    fail("cannot open", dir);
+
+  while ((de = readdir(d))) {
+    const char *s = de->d_name;
+    char *end;
+    unsigned long gen;
+
+    if (strncmp(s, prefix, plen) || (s[plen] != '.')
+        || !isdigit((unsigned char)s[plen + 1]))
+      continue;
+    gen = strtoul(s + plen + 1, &end, 10);
+    if (*end)
+      continue;
+
+    if (count == alloc) {
+      alloc *= 2;
+      gens = realloc(gens, alloc * sizeof(unsigned int));
+    }
+    gens[count++] = gen;
+  }
+  closedir(d);
+
+  qsort(gens, count, sizeof(unsigned int), compare_gens);
+  *count_p = count;
+  return gens;
+}
+
+static char *gen_path(persist_t *p, const char *prefix, unsigned int gen) {
+  size_t len = strlen(p->dir) + strlen(prefix) + 16;
+  char *path = malloc(len);
+
+  snprintf(path, len, "%s/%s.%u", p->dir, prefix, gen);
+  return path;
+}
+
+/* Makes file creations and renames in the directory durable: */
+static void sync_dir(persist_t *p) {
+  int fd = open(p->dir, O_RDONLY);
+
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
@@ -0,0 +1,37 @@
+/* Persistence keeps a friend graph in a directory, so that it
+   survives a restart. Every change to the graph is appended to a
+   write-ahead log (WAL) file. A background thread writes the log:
+   each write and fsync() covers all of the changes that arrived
+   while the previous one was in progress ("group commit").
+
+   Another background thread periodically writes a snapshot of the
+   whole graph while requests continue. It then deletes the log
+   files that the snapshot makes unnecessary. On startup, the graph
+   is loaded from the latest snapshot and then from the log files
+   written since that snapshot started.
+
+   The directory holds "snapshot.<n>" and "wal.<n>" files. The
+   snapshot with generation n, if there is one, reflects every
+   change logged before "wal.<n>". */
+
+/* Opaque type for a persistence instance: */
+typedef struct persist_t persist_t;
+
+/* Loads `g`, which must be empty, from the directory `dir` (creating
+   `dir` if needed) and starts logging changes to `g` there, with a
+   snapshot every `snapshot_interval` seconds. Exits with an error
+   message if the directory cannot be used. */
+persist_t *start_persist(graph_t *g, const char *dir, int snapshot_interval);
+
+/* Waits until every change logged so far (by any thread) is on
+   disk, returning 0, or returns -1 if the log could not be written,
+   in which case no later change will be saved either; a request
+   handler calls this before reporting success: */
+int persist_commit(persist_t *p);
+
+/* Like persist_commit(), but instead of waiting, calls `done` with
+   `data` and what persist_commit() would return, from the thread
+   that writes the log (or from this one, before returning, if there
+   is nothing to wait for). `done` should not block. */
+typedef void (*persist_done_t)(int status, void *data);
+void persist_commit_async(persist_t *p, persist_done_t done, void *data);
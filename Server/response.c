@@ -0,0 +1,348 @@
+#include "csapp.h"
+#include <limits.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include "response.h"
+#include "stats.h"
+#include "log.h"
+
+#define BLOCK_SIZE    4096
+#define INITIAL_IOVS  16
+
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+
+/* Copied bytes live in a chain of blocks that never move, so slices
+   can point into them: */
+typedef struct block_t {
+  struct block_t *next;
+  size_t used, size;
+  char data[];
+} block_t;
+
+struct response_t {
+  struct iovec *iov;    /* iov[0] is the header, the rest the body */
+  int niov, iov_alloc;
+  size_t length;        /* body bytes */
+  block_t *blocks;      /* most recent block first */
+  int streamed;         /* whether the body is sent in chunks */
+  int fd;               /* where a streamed response goes */
+  int failed;           /* a chunk could not be sent */
+  char size_line[32];   /* the current chunk's size line */
+};
+
+static int send_slices(int fd, struct iovec *iov, int niov);
+static int send_chunk(response_t *r, int last);
+
+static int send_timeout = -1;   /* milliseconds */
+
+/* Where the calling thread's sends go instead of waiting: */
+static __thread const response_queue_t *send_queue;
+
+void response_set_timeout(int ms) {
+  send_timeout = ms;
+}
+
+void response_set_queue(const response_queue_t *q) {
+  send_queue = q;
+}
+
+/* Hands the slices to the thread's queue, returning 0 or -1: */
+static int queue_slices(int fd, struct iovec *iov, int niov) {
+  int i;
+
+  for (i = 0; i < niov; i++)
+    if (iov[i].iov_len
+        && (send_queue->queue(fd, iov[i].iov_base, iov[i].iov_len) < 0)) {
+      errno = ENOBUFS;
+      return -1;
+    }
+
+  return 0;
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+response_t *make_response(void) {
+  response_t *r = calloc(1, sizeof(response_t));
+
+  r->iov_alloc = INITIAL_IOVS;
+  r->iov = malloc(r->iov_alloc * sizeof(struct iovec));
+  r->iov[0].iov_base = NULL;
+  r->iov[0].iov_len = 0;
+  r->niov = 1;
+
+  return r;
+}
+
+void free_response(response_t *r) {
+  block_t *b, *next;
+
+  for (b = r->blocks; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+  free(r->iov);
+  free(r);
+}
+
+static void add_slice(response_t *r, char *s, size_t len) {
+  if (r->niov == r->iov_alloc) {
+    r->iov_alloc *= 2;
+    r->iov = realloc(r->iov, r->iov_alloc * sizeof(struct iovec));
+  }
+  r->iov[r->niov].iov_base = s;
+  r->iov[r->niov].iov_len = len;
+  r->niov++;
+}
+
+/* Copies into the current block (or a fresh one), returning where
+   the copy landed: */
+static char *copy_bytes(response_t *r, const char *s, size_t len) {
+  block_t *b = r->blocks;
+  char *dest;
+
+  if (!b || (b->size - b->used < len)) {
+    size_t size = (len > BLOCK_SIZE ? len : BLOCK_SIZE);
+    b = malloc(sizeof(block_t) + size);
+    b->used = 0;
+    b->size = size;
+    b->next = r->blocks;
+    r->blocks = b;
+  }
+
+  dest = b->data + b->used;
+  memcpy(dest, s, len);
+  b->used += len;
+
+  return dest;
+}
+
+void response_add(response_t *r, const char *s, size_t len) {
+  char *dest;
+  struct iovec *last;
+
+  if (!len)
+    return;
+
+  dest = copy_bytes(r, s, len);
+  r->length += len;
+
+  /* Grow the previous body slice if the copy landed right after it: */
+  last = &r->iov[r->niov - 1];
+  if ((r->niov > 1) && ((char *)last->iov_base + last->iov_len == dest))
+    last->iov_len += len;
+  else
+    add_slice(r, dest, len);
+
+  if (r->streamed && (r->length >= RESPONSE_CHUNK))
+    send_chunk(r, 0);
+}
+
+void response_addstr(response_t *r, const char *s) {
+  response_add(r, s, strlen(s));
+}
+
+void response_addref(response_t *r, const char *s, size_t len) {
+  if (!len)
+    return;
+
+  add_slice(r, (char *)s, len);
+  r->length += len;
+
+  if (r->streamed && (r->length >= RESPONSE_CHUNK))
+    send_chunk(r, 0);
+}
+
+size_t response_length(response_t *r) {
+  return r->length;
+}
+
+void response_copy_body(response_t *r, char *dest) {
+  int i;
+
+  for (i = 1; i < r->niov; i++) {
+    memcpy(dest, r->iov[i].iov_base, r->iov[i].iov_len);
+    dest += r->iov[i].iov_len;
+  }
+}
+
+void response_set_header(response_t *r, const char *s, size_t len) {
+  r->iov[0].iov_base = copy_bytes(r, s, len);
+  r->iov[0].iov_len = len;
+}
+
+int response_send(response_t *r, int fd) {
+  if (r->streamed)
+    return send_chunk(r, 1);
+  return send_slices(fd, r->iov, r->niov);
+}
+
+void response_stream(response_t *r, int fd) {
+  int on = 1;
+
+  r->streamed = 1;
+  r->fd = fd;
+
+  /* The last chunk is often small; send it without waiting for the
+     client to acknowledge the ones before it */
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+int response_is_streamed(response_t *r) {
+  return r->streamed;
+}
+
+/* Sends the waiting body bytes as one chunk (after the header, if it
+   has not been sent yet), followed by the final chunk if `last`, and
+   then drops them: */
+static int send_chunk(response_t *r, int last) {
+  static char crlf[] = "\r\n";
+  static char end[] = "0\r\n\r\n";
+  static char crlf_end[] = "\r\n0\r\n\r\n";
+  struct iovec *iov = malloc((r->niov + 2) * sizeof(struct iovec));
+  int niov = 0, result = -1;
+  block_t *b, *next;
+
+  /* The header, if it is still there, and the size line: */
+  iov[niov++] = r->iov[0];
+  if (r->length) {
+    iov[niov].iov_base = r->size_line;
+    iov[niov].iov_len = snprintf(r->size_line, sizeof(r->size_line),
+                                 "%lx\r\n", (unsigned long)r->length);
+    niov++;
+  }
+
+  memcpy(iov + niov, r->iov + 1, (r->niov - 1) * sizeof(struct iovec));
+  niov += r->niov - 1;
+
+  if (r->length) {
+    iov[niov].iov_base = (last ? crlf_end : crlf);
+    iov[niov].iov_len = (last ? sizeof(crlf_end) : sizeof(crlf)) - 1;
+    niov++;
+  } else if (last) {
+    iov[niov].iov_base = end;
+    iov[niov].iov_len = sizeof(end) - 1;
+    niov++;
+  }
+
+  if (!r->failed) {
+    result = send_slices(r->fd, iov, niov);
+    if (result < 0)
+      r->failed = 1;
+  }
+  free(iov);
+
+  /* Start over with no header and an empty body: */
+  for (b = r->blocks; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+  r->blocks = NULL;
+  r->iov[0].iov_base = NULL;
+  r->iov[0].iov_len = 0;
+  r->niov = 1;
+  r->length = 0;
+
+  return result;
+}
+
+/* Writes slices to `fd`, returning 0 on success and -1 on error or
+   once the send timeout passes. When the slices don't fit in one
+   system call, every call but the last uses MSG_MORE. On a thread
+   with a queue, whatever the socket can't take goes to the queue
+   instead. */
+static int send_slices(int fd, struct iovec *iov, int niov) {
+  long deadline = (send_timeout >= 0) ? now_ms() + send_timeout : 0;
+  struct msghdr msg;
+  ssize_t n;
+  int wait;
+
+  memset(&msg, 0, sizeof(msg));
+
+  /* Bytes already waiting go first */
+  if (send_queue && send_queue->pending(fd)) {
+    if (queue_slices(fd, iov, niov) < 0)
+      niov = -1;
+    else
+      niov = 0;
+  }
+
+  while (niov > 0) {
+    /* A client that reads, but too slowly, is timed out too */
+    wait = -1;
+    if (deadline && ((wait = deadline - now_ms()) <= 0)) {
+      errno = ETIMEDOUT;
+      break;
+    }
+
+    /* Skip empty or fully written slices */
+    if (!iov->iov_len) {
+      iov++;
+      niov--;
+      continue;
+    }
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (niov > IOV_MAX ? IOV_MAX : niov);
+    n = sendmsg(fd, &msg, (niov > IOV_MAX ? MSG_MORE : 0));
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (((errno == EAGAIN) || (errno == EWOULDBLOCK)) && send_queue) {
+        niov = (queue_slices(fd, iov, niov) < 0) ? -1 : 0;
+        break;
+      }
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        /* Non-blocking descriptor: wait until it drains */
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int ready = poll(&pfd, 1, wait);
+        if (ready == 0)
+          errno = ETIMEDOUT;
+        if ((ready == 0) || ((ready < 0) && (errno != EINTR)))
+          break;
+        continue;
+      }
+      break;
+    }
+
+    stats_bytes_out(n);
+
+    /* Advance past what was written, possibly mid-slice */
+    while (n > 0) {
+      if ((size_t)n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov->iov_len = 0;
+        iov++;
+        niov--;
+      } else {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+        n = 0;
+      }
+    }
+  }
+
+  if (niov != 0) {
+    int timed_out = (errno == ETIMEDOUT);
+
+    /* A client that goes away or stops reading is routine, not a
+       server error */
+    log_msg(LOG_DEBUG, "Response on %d not sent: %s\n", fd,
+            (niov < 0) ? "output queue full" : strerror(errno));
+    /* Rather than time out again on each later response, make them
+       fail at once, and let whoever reads the connection see EOF */
+    if (timed_out)
+      shutdown(fd, SHUT_RDWR);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,75 @@
+/* A response collects the pieces of an HTTP response as a list of
+   slices and sends them all at once with a vectored write, so that
+   assembling a response doesn't copy the body into one big string
+   and sending it doesn't take a system call per piece. */
+
+/* Opaque type for a response instance: */
+typedef struct response_t response_t;
+
+/* Creates an empty response: */
+response_t *make_response(void);
+
+/* Destroys a response and any bytes that it copied: */
+void free_response(response_t *r);
+
+/* Appends a copy of `len` bytes at `s` to the body. Small copies are
+   packed together into a few blocks that the response owns. */
+void response_add(response_t *r, const char *s, size_t len);
+
+/* Appends a copy of the string `s` to the body: */
+void response_addstr(response_t *r, const char *s);
+
+/* Appends `len` bytes at `s` to the body without copying them, so
+   they must stay unchanged until the response is sent or freed: */
+void response_addref(response_t *r, const char *s, size_t len);
+
+/* Returns the number of body bytes added so far (and, for a streamed
+   response, not yet sent): */
+size_t response_length(response_t *r);
+
+/* Copies the body bytes added so far to `dest`, which must have room
+   for response_length() bytes: */
+void response_copy_body(response_t *r, char *dest);
+
+/* Sets (a copy of) the header block that is sent before the body: */
+void response_set_header(response_t *r, const char *s, size_t len);
+
+/* Writes the header and body to the socket `fd`, returning 0 on
+   success and -1 on error. Writes as few segments as possible:
+   when the slices don't fit in one system call, every call but the
+   last uses MSG_MORE. A response can be sent only once. */
+int response_send(response_t *r, int fd);
+
+/* Sets how many milliseconds each send may take, including any
+   wait for a slow client to make room, before it fails (with errno
+   ETIMEDOUT) and shuts the connection down; a negative value waits
+   forever, which is the default.
+   For a blocking socket, also give it an SO_SNDTIMEO no longer than
+   this, so that a stalled write returns to be timed. */
+void response_set_timeout(int ms);
+
+/* Instead of waiting for a slow client, a thread that serves many
+   connections can have sends hand off the bytes that a socket can't
+   take yet, and send them itself once the socket has room. While
+   `pending` returns nonzero for a socket, every send to it is handed
+   off, so that bytes stay in order. `queue` takes a copy of `len`
+   bytes at `data`, returning 0, or -1 if it can't, in which case the
+   send fails. The queue applies to sends from the calling thread. */
+typedef struct {
+  int (*pending)(int fd);
+  int (*queue)(int fd, const char *data, size_t len);
+} response_queue_t;
+void response_set_queue(const response_queue_t *q);
+
+/* Makes `r` a streamed response on the socket `fd`, for a body that
+   is too big to collect first. The body is sent with chunked
+   transfer coding, so the header (which must be set first) should
+   include "Transfer-Encoding: chunked" and no Content-Length. Once
+   RESPONSE_CHUNK body bytes are waiting, they go out as one chunk,
+   along with the header the first time; response_send() sends the
+   rest and the final chunk. */
+#define RESPONSE_CHUNK 16384
+void response_stream(response_t *r, int fd);
+
+/* Returns 1 if response_stream() has been called on `r`: */
+int response_is_streamed(response_t *r);
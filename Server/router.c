@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include "router.h"
+
+/* Routes are first added to a trie of separately allocated nodes.
+   Compiling copies it breadth-first into an array, where each node's
+   children are contiguous and sorted by byte, and then frees the
+   original. */
+
+typedef struct build_t {
+  unsigned char byte;
+  const void *route;
+  struct build_t *child, *next;   /* `next` is a sibling, in byte order */
+} build_t;
+
+typedef struct {
+  const void *route;
+  unsigned int first;     /* index of the first child */
+  unsigned short nchildren;
+  unsigned char byte;     /* the byte leading here from the parent */
+} node_t;
+
+struct router_t {
+  build_t *root;
+  node_t *nodes;
+  size_t nnodes;
+};
+
+router_t *make_router(void) {
+  router_t *rt = calloc(1, sizeof(router_t));
+
+  rt->root = calloc(1, sizeof(build_t));
+
+  return rt;
+}
+
+void router_add(router_t *rt, const char *prefix, const void *route) {
+  build_t *n = rt->root, **link, *c;
+  const unsigned char *p;
+
+  for (p = (const unsigned char *)prefix; *p; p++) {
+    for (link = &n->child; *link && ((*link)->byte < *p); link = &(*link)->next)
+      ;
+    if (!*link || ((*link)->byte != *p)) {
+      c = calloc(1, sizeof(build_t));
+      c->byte = *p;
+      c->next = *link;
+      *link = c;
+    }
+    n = *link;
+  }
+
+  n->route = route;
+}
+
+static size_t count_nodes(build_t *n) {
+  size_t count = 1;
+  build_t *c;
+
+  for (c = n->child; c; c = c->next)
+    count += count_nodes(c);
+
+  return count;
+}
+
+static void free_build(build_t *n) {
+  build_t *c, *next;
+
+  for (c = n->child; c; c = next) {
+    next = c->next;
+    free_build(c);
+  }
+  free(n);
+}
+
+void router_compile(router_t *rt) {
+  size_t count = count_nodes(rt->root), head = 0, tail = 1;
+  build_t **queue = malloc(count * sizeof(build_t *)), *c;
+
+  rt->nodes = calloc(count, sizeof(node_t));
+  rt->nnodes = count;
+
+  /* Each node's children are queued together, so their indices in
+     the array are consecutive */
+  queue[0] = rt->root;
+  while (head < tail) {
+    node_t *node = &rt->nodes[head];
+
+    node->route = queue[head]->route;
+    node->byte = queue[head]->byte;
+    node->first = tail;
+    for (c = queue[head]->child; c; c = c->next) {
+      queue[tail++] = c;
+      node->nchildren++;
+    }
+    head++;
+  }
+
+  free(queue);
+  free_build(rt->root);
+  rt->root = NULL;
+}
+
+const void *router_match(router_t *rt, const char *uri, size_t len) {
+  const node_t *n = rt->nodes, *kids;
+  const void *found = n->route;
+  size_t i;
+  int lo, hi, mid;
+
+  for (i = 0; i < len; i++) {
+    unsigned char b = uri[i];
+
+    /* Binary search among the children */
+    kids = rt->nodes + n->first;
+    lo = 0;
+    hi = n->nchildren - 1;
+    while (lo <= hi) {
+      mid = (lo + hi) / 2;
+      if (kids[mid].byte < b)
+        lo = mid + 1;
+      else if (kids[mid].byte > b)
+        hi = mid - 1;
+      else
+        break;
+    }
+    if (lo > hi)
+      break;
+
+    n = &kids[mid];
+    if (n->route)
+      found = n->route;
+  }
+
+  return found;
+}
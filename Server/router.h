@@ -0,0 +1,24 @@
+/* A router maps the start of a request's URI to a route. Prefixes
+   are added at startup and then compiled into a trie whose nodes sit
+   in one array, so that finding a route takes one step per byte of
+   the matched prefix, no matter how many routes there are.
+
+   A router is not safe to change from multiple threads, but once
+   compiled it can be searched by any number of threads. */
+
+/* Opaque type for a router instance: */
+typedef struct router_t router_t;
+
+/* Creates a router with no routes: */
+router_t *make_router(void);
+
+/* Maps URIs that start with `prefix` to `route`, replacing any route
+   already added for the same prefix: */
+void router_add(router_t *rt, const char *prefix, const void *route);
+
+/* Builds the trie for searching; call after the last router_add(): */
+void router_compile(router_t *rt);
+
+/* Returns the route for the longest added prefix of the `len` bytes
+   at `uri`, or NULL if no prefix matches: */
+const void *router_match(router_t *rt, const char *uri, size_t len);
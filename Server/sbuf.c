@@ -0,0 +1,85 @@
+#include "csapp.h"
+#include "sbuf.h"
+
+static long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void sbuf_init(sbuf_t *sp, int n)
+{
+  sp->buf = Calloc(n, sizeof(int));
+  sp->stamps = Calloc(n, sizeof(long));
+  sp->n = n;
+  sp->front = sp->rear = 0;
+  sp->count = 0;
+  Sem_init(&sp->mutex, 0, 1);
+  Sem_init(&sp->slots, 0, n);
+  Sem_init(&sp->items, 0, 0);
+}
+
+void sbuf_deinit(sbuf_t *sp)
+{
+  Free(sp->buf);
+  Free(sp->stamps);
+}
+
+static void put(sbuf_t *sp, int item)
+{
+  long stamp = now_ms();
+
+  P(&sp->mutex);
+  sp->rear = (sp->rear + 1) % sp->n;
+  sp->buf[sp->rear] = item;
+  sp->stamps[sp->rear] = stamp;
+  sp->count++;
+  V(&sp->mutex);
+  V(&sp->items);
+}
+
+void sbuf_insert(sbuf_t *sp, int item)
+{
+  P(&sp->slots);
+  put(sp, item);
+}
+
+int sbuf_tryinsert(sbuf_t *sp, int item)
+{
+  if (!TryP(&sp->slots))
+    return 0;
+  put(sp, item);
+  return 1;
+}
+
+int sbuf_count(sbuf_t *sp)
+{
+  int n;
+  P(&sp->mutex);
+  n = sp->count;
+  V(&sp->mutex);
+  return n;
+}
+
+int sbuf_remove(sbuf_t *sp)
+{
+  long waited_ms;
+  return sbuf_remove_aged(sp, &waited_ms);
+}
+
+int sbuf_remove_aged(sbuf_t *sp, long *waited_ms)
+{
+  int item;
+  long stamp;
+  P(&sp->items);
+  P(&sp->mutex);
+  sp->front = (sp->front + 1) % sp->n;
+  item = sp->buf[sp->front];
+  stamp = sp->stamps[sp->front];
+  sp->count--;
+  V(&sp->mutex);
+  V(&sp->slots);
+  *waited_ms = now_ms() - stamp;
+  return item;
+}
@@ -0,0 +1,38 @@
+/* An sbuf is a bounded FIFO queue of integers (such as connected
+   descriptors) shared between producer and consumer threads. Each
+   item is stamped with the time it was added, so that a consumer can
+   tell how long it waited. */
+typedef struct {
+  int *buf;     /* Buffer array */
+  long *stamps; /* When each item was added, in milliseconds */
+  int n;        /* Maximum number of slots */
+  int front;    /* buf[(front+1)%n] is first item */
+  int rear;     /* buf[rear%n] is last item */
+  int count;    /* Number of items in buf */
+  sem_t mutex;  /* Protects accesses to buf */
+  sem_t slots;  /* Counts available slots */
+  sem_t items;  /* Counts available items */
+} sbuf_t;
+
+/* Creates an empty queue with `n` slots: */
+void sbuf_init(sbuf_t *sp, int n);
+
+/* Frees the queue's buffer: */
+void sbuf_deinit(sbuf_t *sp);
+
+/* Adds `item` to the rear of the queue, waiting for a free slot: */
+void sbuf_insert(sbuf_t *sp, int item);
+
+/* Adds `item` to the rear of the queue and returns 1 if a slot is
+   free, or returns 0 immediately if the queue is full: */
+int sbuf_tryinsert(sbuf_t *sp, int item);
+
+/* Returns the number of items waiting in the queue: */
+int sbuf_count(sbuf_t *sp);
+
+/* Removes and returns the first item, waiting for one to arrive: */
+int sbuf_remove(sbuf_t *sp);
+
+/* Like sbuf_remove(), but also sets `*waited_ms` to the milliseconds
+   that the item spent in the queue: */
+int sbuf_remove_aged(sbuf_t *sp, long *waited_ms);
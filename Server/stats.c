@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+/* Buckets per power of two, and the number of buckets, which covers
+   latencies up to 2^33 microseconds (longer ones land in the last): */
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS (32 * SUB_BUCKETS)
+#define MAX_VALUE ((1UL << 33) - 1)
+
+static const char *route_names[STATS_ROUTES] = {
+  "/sum", "/friends", "/befriend", "/unfriend", "/mutual", "/introduce",
+  "/distance", "other"
+};
+
+typedef struct {
+  unsigned long requests[STATS_ROUTES];
+  unsigned long total_us[STATS_ROUTES];
+  unsigned long buckets[STATS_ROUTES][BUCKETS];
+  unsigned long bytes_in, bytes_out, opened, closed;
+  unsigned long max_us[STATS_ROUTES];   /* (not a sum, so keep last) */
+} counters_t;
+
+/* One thread's counters. Only the owning thread writes `c`, and the
+   list links (which other threads update) are on a separate cache
+   line. */
+typedef struct thread_stats_t {
+  struct thread_stats_t *next, *prev;
+  counters_t c __attribute__((aligned(64)));
+} thread_stats_t;
+
+/* Every live thread's counters, and the totals of exited threads: */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats_t *threads;
+static counters_t retired;
+static time_t started;
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/* Adds `from` to `to`; `from` may be updated meanwhile by its owner: */
+static void add_counters(counters_t *to, counters_t *from) {
+  unsigned long *f = (unsigned long *)from, *t = (unsigned long *)to, max;
+  size_t i, n = offsetof(counters_t, max_us) / sizeof(unsigned long);
+  int r;
+
+  for (i = 0; i < n; i++)
+    t[i] += __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+
+  for (r = 0; r < STATS_ROUTES; r++) {
+    max = __atomic_load_n(&from->max_us[r], __ATOMIC_RELAXED);
+    if (max > to->max_us[r])
+      to->max_us[r] = max;
+  }
+}
+
+static void retire_thread(void *v) {
+  thread_stats_t *ts = v;
+
+  pthread_mutex_lock(&registry_lock);
+  add_counters(&retired, &ts->c);
+  if (ts->prev)
+    ts->prev->next = ts->next;
+  else
+    threads = ts->next;
+  if (ts->next)
+    ts->next->prev = ts->prev;
+  pthread_mutex_unlock(&registry_lock);
+
+  free(ts);
+}
+
+static void make_stats_key(void) {
+  pthread_key_create(&stats_key, retire_thread);
+  started = time(NULL);
+}
+
+static counters_t *my_counters(void) {
+  thread_stats_t *ts;
+  void *p;
+
+  pthread_once(&stats_once, make_stats_key);
+  ts = pthread_getspecific(stats_key);
+  if (!ts) {
+    if (posix_memalign(&p, 64, sizeof(thread_stats_t)))
+      abort();
+    ts = memset(p, 0, sizeof(thread_stats_t));
+    pthread_setspecific(stats_key, ts);
+
+    pthread_mutex_lock(&registry_lock);
+    ts->next = threads;
+    if (threads)
+      threads->prev = ts;
+    threads = ts;
+    pthread_mutex_unlock(&registry_lock);
+  }
+
+  return &ts->c;
+}
+
+/* Adds to a counter that only this thread writes, without a locked
+   read-modify-write, but so that readers never see a torn value: */
+static void bump(unsigned long *p, unsigned long n) {
+  __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+static int bucket_index(unsigned long v) {
+  int m;
+
+  if (v > MAX_VALUE)
+    v = MAX_VALUE;
+  if (v < SUB_BUCKETS)
+    return v;
+  m = 63 - __builtin_clzl(v);
+  return (m - SUB_BITS + 1) * SUB_BUCKETS
+         + ((v >> (m - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Returns the largest value that lands in bucket `i`: */
+static unsigned long bucket_top(int i) {
+  int m = i / SUB_BUCKETS + SUB_BITS - 1;
+  unsigned long next = SUB_BUCKETS + i % SUB_BUCKETS + 1;
+
+  if (i < SUB_BUCKETS)
+    return i;
+  return (next << (m - SUB_BITS)) - 1;
+}
+
+void stats_request(int route, long usec) {
+  counters_t *c = my_counters();
+  unsigned long v = (usec < 0) ? 0 : usec;
+
+  bump(&c->requests[route], 1);
+  bump(&c->total_us[route], v);
+  bump(&c->buckets[route][bucket_index(v)], 1);
+  if (v > c->max_us[route])
+    __atomic_store_n(&c->max_us[route], v, __ATOMIC_RELAXED);
+}
+
+void stats_bytes_in(size_t n) {
+  bump(&my_counters()->bytes_in, n);
+}
+
+void stats_bytes_out(size_t n) {
+  bump(&my_counters()->bytes_out, n);
+}
+
+void stats_conn_opened(void) {
+  bump(&my_counters()->opened, 1);
+}
+
+void stats_conn_closed(void) {
+  bump(&my_counters()->closed, 1);
+}
+
+/* Returns the value below which `fraction` of a route's requests
+   fall, to within a bucket: */
+static unsigned long percentile(counters_t *c, int route, double fraction) {
+  unsigned long want = (unsigned long)(fraction * c->requests[route] + 0.5);
+  unsigned long seen = 0, top;
+  int i;
+
+  if (!want)
+    want = 1;
+  for (i = 0; i < BUCKETS; i++) {
+    seen += c->buckets[route][i];
+    if (seen >= want) {
+      top = bucket_top(i);
+      return (top < c->max_us[route]) ? top : c->max_us[route];
+    }
+  }
+
+  return c->max_us[route];
+}
+
+char *stats_json(const stats_gauge_t *gauges, int n) {
+  counters_t *sum = malloc(sizeof(counters_t));
+  thread_stats_t *ts;
+  char *json;
+  size_t len;
+  FILE *f;
+  int i, r;
+
+  pthread_once(&stats_once, make_stats_key);
+
+  pthread_mutex_lock(&registry_lock);
+  memcpy(sum, &retired, sizeof(counters_t));
+  for (ts = threads; ts; ts = ts->next)
+    add_counters(sum, &ts->c);
+  pthread_mutex_unlock(&registry_lock);
+
+  f = open_memstream(&json, &len);
+  fprintf(f, "{\n  \"uptime_s\": %ld,\n", (long)(time(NULL) - started));
+  fprintf(f, "  \"connections\": { \"opened\": %lu, \"active\": %ld },\n",
+          sum->opened, (long)(sum->opened - sum->closed));
+  fprintf(f, "  \"bytes\": { \"in\": %lu, \"out\": %lu },\n",
+          sum->bytes_in, sum->bytes_out);
+  for (i = 0; i < n; i++)
+    fprintf(f, "  \"%s\": %ld,\n", gauges[i].name, gauges[i].value);
+
+  fprintf(f, "  \"routes\": {\n");
+  for (r = 0; r < STATS_ROUTES; r++) {
+    unsigned long count = sum->requests[r];
+
+    fprintf(f, "    \"%s\": { \"count\": %lu", route_names[r], count);
+    if (count)
+      fprintf(f, ", \"mean_us\": %lu, \"p50_us\": %lu, \"p90_us\": %lu,"
+              " \"p99_us\": %lu, \"p999_us\": %lu, \"max_us\": %lu",
+              sum->total_us[r] / count,
+              percentile(sum, r, 0.5), percentile(sum, r, 0.9),
+              percentile(sum, r, 0.99), percentile(sum, r, 0.999),
+              sum->max_us[r]);
+    fprintf(f, " }%s\n", (r + 1 < STATS_ROUTES) ? "," : "");
+  }
+  fprintf(f, "  }\n}\n");
+  fclose(f);
+
+  free(sum);
+  return json;
+}
@@ -0,0 +1,43 @@
+/* Stats count requests, bytes, and connections, and keep a latency
+   histogram for each route. Every thread records into its own
+   counters, aligned to their own cache lines, so recording takes no
+   locks and writes no memory that another thread writes; the
+   threads' counters are added up only when they are reported. When a
+   thread exits, its counters are folded into a shared total.
+
+   Histogram buckets are spaced logarithmically, with 8 buckets per
+   power of two, so a reported percentile is within 12.5% of the true
+   value at any scale. */
+
+/* Routes that requests are counted under: */
+#define STATS_SUM       0
+#define STATS_FRIENDS   1
+#define STATS_BEFRIEND  2
+#define STATS_UNFRIEND  3
+#define STATS_MUTUAL    4
+#define STATS_INTRODUCE 5
+#define STATS_DISTANCE  6
+#define STATS_OTHER     7
+#define STATS_ROUTES    8
+
+/* Records a request for `route` that took `usec` microseconds: */
+void stats_request(int route, long usec);
+
+/* Records bytes read from or written to clients: */
+void stats_bytes_in(size_t n);
+void stats_bytes_out(size_t n);
+
+/* Records a client connection opening or closing; the two may be
+   recorded by different threads. */
+void stats_conn_opened(void);
+void stats_conn_closed(void);
+
+/* A value sampled when the stats are reported: */
+typedef struct {
+  const char *name;
+  long value;
+} stats_gauge_t;
+
+/* Returns a freshly allocated JSON object with the totals over all
+   threads so far, plus the `n` `gauges`: */
+char *stats_json(const stats_gauge_t *gauges, int n);
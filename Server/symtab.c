@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "symtab.h"
+
+/* Strings are kept in fixed-size chunks indexed by ID. A chunk never
+   moves once allocated, so symtab_name() can read it without taking
+   the lock: an ID is only handed out after its string is stored. A
+   separate open-addressing table (linear probing) maps a string's
+   hash to its ID. */
+
+#define CHUNK_BITS 12
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define MAX_CHUNKS (1 << 16)
+
+#define SLOT_EMPTY 0xFFFFFFFFu
+
+struct symtab_t {
+  pthread_rwlock_t lock;
+  size_t count;
+  const char **chunks[MAX_CHUNKS];
+  unsigned int *slots;    /* an ID, or SLOT_EMPTY */
+  size_t nslots;
+};
+
+static unsigned int hash_string(const char *s);
+static long find_slot(symtab_t *t, const char *s, unsigned int h);
+static void rebuild_slots(symtab_t *t, size_t nslots);
+
+symtab_t *make_symtab(void) {
+  symtab_t *t = calloc(1, sizeof(symtab_t));
+
+  pthread_rwlock_init(&t->lock, NULL);
+  rebuild_slots(t, 64);
+
+  return t;
+}
+
+unsigned int symtab_intern(symtab_t *t, const char *s) {
+  unsigned int h = hash_string(s);
+  long slot;
+  unsigned int id;
+
+  /* Most strings are already interned, so try a shared lock first: */
+  pthread_rwlock_rdlock(&t->lock);
+  slot = find_slot(t, s, h);
+  id = t->slots[slot];
+  pthread_rwlock_unlock(&t->lock);
+  if (id != SLOT_EMPTY)
+    return id;
+
+  pthread_rwlock_wrlock(&t->lock);
+  slot = find_slot(t, s, h);
+  if ((id = t->slots[slot]) == SLOT_EMPTY) {
+    id = t->count;
+    if (!(id & (CHUNK_SIZE - 1)))
+      t->chunks[id >> CHUNK_BITS] = malloc(CHUNK_SIZE * sizeof(char *));
+    t->chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)] = strdup(s);
+    t->slots[slot] = id;
+    t->count++;
+
+    /* Keep the table at most 3/4 full: */
+    if (t->count * 4 > t->nslots * 3)
+      rebuild_slots(t, t->nslots * 2);
+  }
+  pthread_rwlock_unlock(&t->lock);
+
+  return id;
+}
+
+long symtab_lookup(symtab_t *t, const char *s) {
+  unsigned int id;
+
+  pthread_rwlock_rdlock(&t->lock);
+  id = t->slots[find_slot(t, s, hash_string(s))];
+  pthread_rwlock_unlock(&t->lock);
+
+  return (id == SLOT_EMPTY) ? -1 : (long)id;
+}
+
+const char *symtab_name(symtab_t *t, unsigned int id) {
+  return t->chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+}
+
+size_t symtab_count(symtab_t *t) {
+  size_t count;
+
+  pthread_rwlock_rdlock(&t->lock);
+  count = t->count;
+  pthread_rwlock_unlock(&t->lock);
+
+  return count;
+}
+
+/* FNV-1a: */
+static unsigned int hash_string(const char *s) {
+  const unsigned char *p = (const unsigned char *)s;
+  unsigned int h = 2166136261u;
+
+  for (; *p; p++)
+    h = (h ^ *p) * 16777619u;
+
+  return h;
+}
+
+/* Returns the slot that holds `s`, or else the empty slot where `s`
+   should be inserted: */
+static long find_slot(symtab_t *t, const char *s, unsigned int h) {
+  size_t mask = t->nslots - 1, i;
+
+  for (i = h & mask; ; i = (i + 1) & mask) {
+    unsigned int id = t->slots[i];
+    if ((id == SLOT_EMPTY) || !strcmp(symtab_name(t, id), s))
+      return i;
+  }
+}
+
+static void rebuild_slots(symtab_t *t, size_t nslots) {
+  size_t i, s, mask = nslots - 1;
+
+  free(t->slots);
+  t->slots = malloc(nslots * sizeof(unsigned int));
+  for (s = 0; s < nslots; s++)
+    t->slots[s] = SLOT_EMPTY;
+  t->nslots = nslots;
+
+  for (i = 0; i < t->count; i++) {
+    s = hash_string(symtab_name(t, i)) & mask;
+    while (t->slots[s] != SLOT_EMPTY)
+      s = (s + 1) & mask;
+    t->slots[s] = i;
+  }
+}
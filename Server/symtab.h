@@ -0,0 +1,24 @@
+/* A symbol table interns strings: it gives each distinct string a
+   small integer ID, counting up from 0 in order of first use, and
+   maps IDs back to strings. Interned strings are never freed, so a
+   string returned by symtab_name() stays valid as long as the table.
+
+   The table is safe to use from multiple threads. */
+
+/* Opaque type for a symbol table instance: */
+typedef struct symtab_t symtab_t;
+
+/* Creates an empty symbol table: */
+symtab_t *make_symtab(void);
+
+/* Returns the ID of `s`, interning a copy of `s` if needed: */
+unsigned int symtab_intern(symtab_t *t, const char *s);
+
+/* Returns the ID of `s`, or -1 if `s` has not been interned: */
+long symtab_lookup(symtab_t *t, const char *s);
+
+/* Returns the string with ID `id`: */
+const char *symtab_name(symtab_t *t, unsigned int id);
+
+/* Returns the number of interned strings: */
+size_t symtab_count(symtab_t *t);
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include "wheel.h"
+
+/* Each slot is a circular list of the timers whose expiry tick maps
+   to it, headed by a sentinel. Timers that have expired move to the
+   `due` list until wheel_expired() hands them out. */
+
+struct wheel_t {
+  int tick_ms, nslots;
+  long tick;              /* the last tick whose slot has been checked */
+  long count;             /* scheduled timers, including due ones */
+  wheel_timer_t *slots;
+  wheel_timer_t due;
+};
+
+static void list_init(wheel_timer_t *head) {
+  head->next = head->prev = head;
+}
+
+static void list_add(wheel_timer_t *head, wheel_timer_t *t) {
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void list_remove(wheel_timer_t *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+wheel_t *make_wheel(int tick_ms, int nslots, long now_ms) {
+  wheel_t *w = calloc(1, sizeof(wheel_t));
+  int i;
+
+  w->tick_ms = tick_ms;
+  w->nslots = nslots;
+  w->tick = now_ms / tick_ms;
+  w->slots = malloc(nslots * sizeof(wheel_timer_t));
+  for (i = 0; i < nslots; i++)
+    list_init(&w->slots[i]);
+  list_init(&w->due);
+
+  return w;
+}
+
+void wheel_timer_init(wheel_timer_t *t) {
+  t->next = t->prev = NULL;
+  t->expires = 0;
+}
+
+void wheel_schedule(wheel_t *w, wheel_timer_t *t, long when_ms) {
+  long tick = (when_ms + w->tick_ms - 1) / w->tick_ms;
+
+  wheel_cancel(w, t);
+
+  /* A slot that has already been checked won't be again for a
+     whole turn, so a deadline that has passed is due at once */
+  t->expires = tick;
+  if (tick <= w->tick)
+    list_add(&w->due, t);
+  else
+    list_add(&w->slots[tick % w->nslots], t);
+  w->count++;
+}
+
+void wheel_cancel(wheel_t *w, wheel_timer_t *t) {
+  if (t->next) {
+    list_remove(t);
+    w->count--;
+  }
+}
+
+wheel_timer_t *wheel_expired(wheel_t *w, long now_ms) {
+  long now = now_ms / w->tick_ms;
+  wheel_timer_t *slot, *t, *next;
+
+  while ((w->due.next == &w->due) && (w->tick < now) && w->count) {
+    w->tick++;
+    slot = &w->slots[w->tick % w->nslots];
+    for (t = slot->next; t != slot; t = next) {
+      next = t->next;
+      if (t->expires <= w->tick) {
+        list_remove(t);
+        list_add(&w->due, t);
+      }
+    }
+  }
+  if (!w->count)
+    w->tick = now;
+
+  if ((t = w->due.next) == &w->due)
+    return NULL;
+  list_remove(t);
+  w->count--;
+  return t;
+}
+
+int wheel_wait_ms(wheel_t *w, long now_ms) {
+  long next_ms = (w->tick + 1) * w->tick_ms;
+
+  if (!w->count)
+    return -1;
+  if (w->due.next != &w->due)
+    return 0;
+  return (next_ms > now_ms) ? next_ms - now_ms : 0;
+}
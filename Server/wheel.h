@@ -0,0 +1,41 @@
+/* A timer wheel keeps track of many deadlines cheaply: scheduling,
+   moving, or cancelling a timer takes constant time, and finding the
+   timers that have expired takes a step per tick that has passed plus
+   a step per timer in the ticks' slots. Deadlines are rounded up to a
+   whole tick.
+
+   Timers are embedded in the objects that they time, so the wheel
+   never allocates after it is made. A wheel is not safe to use from
+   multiple threads; each thread that needs one should have its own. */
+
+/* A timer; initialize it with wheel_timer_init(): */
+typedef struct wheel_timer_t {
+  struct wheel_timer_t *next, *prev;
+  long expires;   /* tick at which the timer expires */
+} wheel_timer_t;
+
+/* Opaque type for a timer wheel instance: */
+typedef struct wheel_t wheel_t;
+
+/* Creates a wheel with `nslots` slots of `tick_ms` milliseconds each,
+   starting at the time `now_ms`. Deadlines further than a turn of the
+   wheel away work, but cost a step each time the wheel passes them. */
+wheel_t *make_wheel(int tick_ms, int nslots, long now_ms);
+
+/* Prepares a timer that is not scheduled: */
+void wheel_timer_init(wheel_timer_t *t);
+
+/* Schedules `t` to expire at `when_ms`, moving it if it is already
+   scheduled: */
+void wheel_schedule(wheel_t *w, wheel_timer_t *t, long when_ms);
+
+/* Unschedules `t`, if it is scheduled: */
+void wheel_cancel(wheel_t *w, wheel_timer_t *t);
+
+/* Returns a timer that has expired by `now_ms`, unscheduling it, or
+   NULL if there are none: */
+wheel_timer_t *wheel_expired(wheel_t *w, long now_ms);
+
+/* Returns the milliseconds from `now_ms` until the wheel next needs
+   to be checked for expired timers, or -1 if no timer is scheduled: */
+int wheel_wait_ms(wheel_t *w, long now_ms);